@@ -0,0 +1,311 @@
+/*
+ * cache_bench.c - Cache lookup cost and hit ratio
+ *
+ * By default, fills the cache with small objects and times hits and
+ * misses through cache_lookup() at each size, next to a linear strcmp()
+ * scan over the same URLs (the lookup cache_find() used to do).
+ *
+ * With -w, replays skewed workloads instead, under each eviction policy
+ * in turn, and prints the hit ratio, byte hit ratio and share of fetch
+ * time saved: requests for NOBJECTS objects of mixed sizes and fetch
+ * times, Zipf-distributed (s = 1), inserting each miss; then the same
+ * with every fourth request replaced by one for an object that is never
+ * requested again, as a crawler would.
+ * Each run gets a fresh cache, in a child process.
+ *
+ * With -r, measures how long a restarted proxy takes to warm up: warms a
+ * cache with the Zipf workload and saves a snapshot of it, then replays
+ * the workload against a cold cache and against one started from the
+ * snapshot, printing the hit ratio of each window of WINDOW requests and
+ * how many requests each took to come within 5% of the warm hit ratio.
+ *
+ * usage: bench/cache_bench [lookups per size]
+ *        bench/cache_bench -w [requests]
+ *        bench/cache_bench -r [warm-up requests]
+ */
+#include "proxy.h"
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#define MAXENTRIES 4096
+#define OBJSIZE    64           /* MAXENTRIES entries fit in the cache */
+#define NMISSES    1000
+#define NOBJECTS   4000         /* About 35 times the cache */
+#define MAXOBJSIZE 16896
+#define WINDOW     100          /* Requests per hit ratio sample */
+#define NWINDOWS   30
+
+static char urls[MAXENTRIES][64], misses[NMISSES][64];
+static char obj[MAXOBJSIZE];
+
+/* Shared by the -r runs with the parent */
+typedef struct {
+    double steady;              /* Hit ratio once warm */
+    int saved;                  /* Objects in the snapshot */
+    double load_ms[2];          /* Cold, warm */
+    double ratio[2][NWINDOWS];
+} warm_results;
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The pre-index lookup: walk every entry until the URL matches */
+static int linear_find(char *url, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (!strcmp(urls[i], url))
+            return i;
+    return -1;
+}
+
+static unsigned long next_rand(unsigned long *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+static int obj_size(int i) {
+    return 512 + (i * 7919) % (MAXOBJSIZE - 512);
+}
+
+/* ms to fetch object i: one in ten comes from a slow origin */
+static unsigned long obj_cost(unsigned long i) {
+    return (i * 104729) % 10 == 0 ? 500 + (i * 31) % 500 : 1 + (i * 37) % 100;
+}
+
+static char *policies[] = {
+    "clock", "lru", "s3fifo", "arc", "tinylfu", "gdsf"
+};
+
+/* Pick object k in proportion to 1 / (k + 1) */
+static int zipf_object(unsigned long *seed) {
+    static double cdf[NOBJECTS], sum;
+    double x;
+    int i, lo, hi, mid;
+
+    if (sum == 0)
+        for (i = 0; i < NOBJECTS; i++)
+            cdf[i] = (sum += 1.0 / (i + 1));
+    x = (double)(next_rand(seed) % 1000000) / 1000000 * sum;
+    for (lo = 0, hi = NOBJECTS - 1; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Spread popular objects over the URL space */
+static void object_url(char *url, int i) {
+    sprintf(url, "http://www.example.com/objects/%06lu.html",
+            (i * 2654435761UL) % 1000003);
+}
+
+/* Look up a Zipf-chosen object, inserting it on a miss; 1 on a hit */
+static int zipf_request(unsigned long *seed) {
+    char url[64], *data;
+    cache_block *p;
+    int i = zipf_object(seed), size;
+
+    object_url(url, i);
+    if ((p = cache_lookup(url, &data, &size)) != NULL) {
+        cache_release(p);
+        return 1;
+    }
+    cache_insert(url, obj, obj_size(i), obj_cost(i), 0);
+    return 0;
+}
+
+static void workload(int requests, int scan) {
+    char url[64], *data;
+    cache_block *p;
+    unsigned long seed = 1, once = 0;
+    long hits = 0, bytes = 0, hit_bytes = 0;
+    unsigned long cost, total_cost = 0, hit_cost = 0;
+    int i, k, size;
+
+    for (i = 0; i < requests; i++) {
+        if (scan && i % 4 == 3) {
+            sprintf(url, "http://www.example.com/crawl/%08lu.html", once);
+            size = obj_size(once);
+            cost = obj_cost(NOBJECTS + once++);
+        } else {
+            k = zipf_object(&seed);
+            object_url(url, k);
+            size = obj_size(k);
+            cost = obj_cost(k);
+        }
+        bytes += size;
+        total_cost += cost;
+        if ((p = cache_lookup(url, &data, &size)) != NULL) {
+            hits++;
+            hit_bytes += size;
+            hit_cost += cost;
+            cache_release(p);
+        } else
+            cache_insert(url, obj, size, cost, 0);
+    }
+    printf(" %6.1f%% %6.1f%% %6.1f%%", 100.0 * hits / requests,
+           100.0 * hit_bytes / bytes, 100.0 * hit_cost / total_cost);
+}
+
+/* Run each workload under each policy, each in a fresh process */
+static void workloads(int requests) {
+    unsigned i;
+    int scan;
+
+    printf("%d requests over %d objects\n", requests, NOBJECTS);
+    printf("%-8s %-24s %s\n", "", "        zipf", "    zipf + one-offs");
+    printf("%-8s %7s %7s %7s %7s %7s %7s\n", "policy", "hits", "bytes",
+           "time", "hits", "bytes", "time");
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        printf("%-8s", policies[i]);
+        for (scan = 0; scan <= 1; scan++) {
+            fflush(stdout);
+            if (Fork() == 0) {
+                cache_init(1, policies[i]);
+                workload(requests, scan);
+                fflush(stdout);
+                exit(0);
+            }
+            Wait(NULL);
+        }
+        printf("\n");
+    }
+}
+
+/* Requests until a run's hit ratio came within 5% of r->steady */
+static int time_to_warm(warm_results *r, int warm) {
+    int w;
+
+    for (w = 0; w < NWINDOWS; w++)
+        if (r->ratio[warm][w] >= 0.95 * r->steady)
+            return (w + 1) * WINDOW;
+    return -1;
+}
+
+static void restart(int requests) {
+    char path[] = "/tmp/cache_bench.XXXXXX";
+    warm_results *r;
+    unsigned long seed;
+    double t0;
+    int i, w, warm, hits;
+
+    r = Mmap(NULL, sizeof(warm_results), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    Close(mkstemp(path));
+
+    /* Warm a cache up and save it, as SIGTERM would */
+    if (Fork() == 0) {
+        cache_init(1, "clock");
+        seed = 1;
+        for (i = hits = 0; i < requests; i++)
+            if (zipf_request(&seed) && i >= requests / 2)
+                hits++;
+        r->steady = (double)hits / (requests - requests / 2);
+        r->saved = cache_save(path);
+        exit(0);
+    }
+    Wait(NULL);
+
+    /* Go on with the same workload after a cold and a warm restart */
+    for (warm = 0; warm <= 1; warm++) {
+        if (Fork() == 0) {
+            cache_init(1, "clock");
+            t0 = now_ns();
+            if (warm && cache_load(path) < 0)
+                app_error("cache_bench: no snapshot");
+            r->load_ms[warm] = (now_ns() - t0) / 1e6;
+            seed = 2;
+            for (w = 0; w < NWINDOWS; w++) {
+                for (i = hits = 0; i < WINDOW; i++)
+                    hits += zipf_request(&seed);
+                r->ratio[warm][w] = (double)hits / WINDOW;
+            }
+            exit(0);
+        }
+        Wait(NULL);
+    }
+    unlink(path);
+
+    printf("warm hit ratio %.1f%% after %d requests; snapshot of %d "
+           "objects\n", 100 * r->steady, requests, r->saved);
+    printf("%10s %8s %8s\n", "requests", "cold", "snapshot");
+    for (w = 0; w < NWINDOWS; w++)
+        printf("%10d %7.1f%% %7.1f%%\n", (w + 1) * WINDOW,
+               100 * r->ratio[0][w], 100 * r->ratio[1][w]);
+    printf("requests to warm: cold %d, snapshot %d (-1: never)\n",
+           time_to_warm(r, 0), time_to_warm(r, 1));
+    printf("snapshot load: %.3f ms\n", r->load_ms[1]);
+}
+
+int main(int argc, char **argv) {
+    cache_block *p;
+    char *data;
+    int lookups = argc > 1 ? atoi(argv[1]) : 200000;
+    int n = 0, target, i, size;
+    unsigned long seed = 1;
+    volatile long sink = 0;
+    double t0, hit_ns, miss_ns, scan_ns;
+    struct rusage ru;
+
+    memset(obj, 'x', sizeof(obj));
+    if (argc > 1 && !strcmp(argv[1], "-w")) {
+        workloads(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "-r")) {
+        restart(argc > 2 ? atoi(argv[2]) : 200000);
+        return 0;
+    }
+    cache_init(1, "clock");
+    for (i = 0; i < NMISSES; i++)
+        sprintf(misses[i], "http://www.example.com:8080/missing/%06d.html", i);
+    printf("%8s %12s %12s %12s\n", "entries", "hit ns", "miss ns",
+           "scan ns");
+
+    for (target = 16; target <= MAXENTRIES; target *= 2) {
+        for (; n < target; n++) {
+            sprintf(urls[n], "http://www.example.com:8080/objects/%06d.html",
+                    n);
+            cache_insert(urls[n], obj, OBJSIZE, 0, 0);
+        }
+
+        t0 = now_ns();
+        for (i = 0; i < lookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            if ((p = cache_lookup(urls[(seed >> 16) % n], &data, &size))
+                == NULL)
+                app_error("cache_bench: expected a hit");
+            sink += data[0];
+            cache_release(p);
+        }
+        hit_ns = (now_ns() - t0) / lookups;
+
+        t0 = now_ns();
+        for (i = 0; i < lookups; i++)
+            if (cache_lookup(misses[i % NMISSES], &data, &size) != NULL)
+                app_error("cache_bench: expected a miss");
+        miss_ns = (now_ns() - t0) / lookups;
+
+        t0 = now_ns();
+        for (i = 0; i < lookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            sink += linear_find(urls[(seed >> 16) % n], n);
+        }
+        scan_ns = (now_ns() - t0) / lookups;
+
+        printf("%8d %12.1f %12.1f %12.1f\n", n, hit_ns, miss_ns, scan_ns);
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    printf("max resident: %ld KB\n", ru.ru_maxrss);
+    return 0;
+}
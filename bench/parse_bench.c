@@ -0,0 +1,172 @@
+/*
+ * parse_bench.c - Request head parsing throughput
+ *
+ * Parses a few typical request heads over and over, already in a Rio
+ * buffer, and prints the ns per head and MB/s of:
+ *
+ *   readline  the line-at-a-time way doit() used to: each line copied
+ *             out with rio_readlineb(), the request line split with
+ *             sscanf() into MAXLINE arrays
+ *   parse     http_parse() over the whole head in place
+ *   strstr/N  the way the event loops used to wait for a head arriving
+ *             N bytes at a time: strstr() over all of it for the blank
+ *             line after each read, then the request line split as above
+ *   parse/N   http_parse() fed the same reads, resuming each time
+ *
+ * usage: bench/parse_bench [iterations per head]
+ */
+#include "proxy.h"
+#include <time.h>
+
+#define CHUNK 16                /* Bytes per simulated read */
+
+static char *heads[] = {
+    /* curl */
+    "GET http://www.example.com/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "Proxy-Connection: Keep-Alive\r\n"
+    "\r\n",
+    /* A browser */
+    "GET http://www.example.com/static/js/app.3f9a1c.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101"
+    " Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"5e1f-61a3c2b9e8f40\"\r\n"
+    "If-Modified-Since: Tue, 14 Oct 2025 09:12:44 GMT\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n",
+    NULL,                       /* A browser with cookies, made in main() */
+};
+static char *names[] = { "curl", "browser", "cookies" };
+#define NHEADS (int)(sizeof(heads) / sizeof(heads[0]))
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Put head in rp's buffer, as if just read */
+static void fill(rio_t *rp, char *head, int len) {
+    rio_readinitb(rp, -1);
+    memcpy(rp->rio_buf, head, len);
+    rp->rio_cnt = len;
+}
+
+/* The old doit(): a line at a time, the request line through sscanf() */
+static int readline_parse(rio_t *rp) {
+    static char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+    static char version[MAXLINE];
+    int n = 0;
+
+    rio_readlineb(rp, buf, MAXLINE);
+    sscanf(buf, "%s %s %s", method, uri, version);
+    while (rio_readlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+        n++;
+    return n;
+}
+
+/* The old event loops: look for the blank line after every read */
+static int strstr_parse(char *in, char *head, int len) {
+    static char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    int got = 0, n;
+
+    while (1) {
+        n = len - got < CHUNK ? len - got : CHUNK;
+        memcpy(in + got, head + got, n);
+        got += n;
+        in[got] = '\0';
+        if (strstr(in, "\r\n\r\n"))
+            break;
+    }
+    sscanf(in, "%s %s %s", method, uri, version);
+    return got;
+}
+
+static int chunked_parse(http_parser *hp, char *in, char *head, int len) {
+    int got = 0, n;
+
+    http_parser_init(hp);
+    do {
+        n = len - got < CHUNK ? len - got : CHUNK;
+        memcpy(in + got, head + got, n);
+        got += n;
+    } while (http_parse(hp, in, got) == 0);
+    return hp->nheaders;
+}
+
+static void report(double ns, int len) {
+    printf(" %9.1f %7.0f", ns, len / ns * 1e3);
+}
+
+int main(int argc, char **argv) {
+    static rio_t rio;
+    static http_parser hp;
+    static char in[MAXLINE + 1], cookies[MAXLINE];
+    int iters = argc > 1 ? atoi(argv[1]) : 200000;
+    int h, i, len;
+    volatile long sink = 0;
+    double t0;
+
+    /* The browser's head again, with 2 KB of cookies */
+    len = strlen(heads[1]) - 2;
+    memcpy(cookies, heads[1], len);
+    len += sprintf(cookies + len, "Cookie: ");
+    for (i = 0; len < 2200; i++)
+        len += sprintf(cookies + len, "c%d=%08x%08x; ", i, i * 2654435761U,
+                       i * 40503U);
+    sprintf(cookies + len, "end=1\r\n\r\n");
+    heads[2] = cookies;
+
+    printf("%-8s %5s %17s %17s %17s %17s\n", "", "", "readline",
+           "parse", "strstr/16", "parse/16");
+    printf("%-8s %5s", "head", "bytes");
+    for (i = 0; i < 4; i++)
+        printf(" %9s %7s", "ns", "MB/s");
+    printf("\n");
+
+    for (h = 0; h < NHEADS; h++) {
+        len = strlen(heads[h]);
+        printf("%-8s %5d", names[h], len);
+
+        t0 = now_ns();
+        for (i = 0; i < iters; i++) {
+            fill(&rio, heads[h], len);
+            sink += readline_parse(&rio);
+        }
+        report((now_ns() - t0) / iters, len);
+
+        t0 = now_ns();
+        for (i = 0; i < iters; i++) {
+            fill(&rio, heads[h], len);
+            http_parser_init(&hp);
+            if (http_parse(&hp, rio.rio_bufptr, rio.rio_cnt) != 1)
+                app_error("parse_bench: head did not parse");
+            sink += hp.nheaders;
+        }
+        report((now_ns() - t0) / iters, len);
+
+        t0 = now_ns();
+        for (i = 0; i < iters; i++)
+            sink += strstr_parse(in, heads[h], len);
+        report((now_ns() - t0) / iters, len);
+
+        t0 = now_ns();
+        for (i = 0; i < iters; i++)
+            sink += chunked_parse(&hp, in, heads[h], len);
+        report((now_ns() - t0) / iters, len);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,805 @@
+/*
+ * cache.c - Web object cache shared by all server modes
+ *
+ * The cache is split into shards by URL hash, each with its own lock,
+ * hash index, eviction lists and byte budget, so that lookups and
+ * inserts on different cores rarely meet on a lock.  The budgets add up
+ * to at most MAX_CACHE_SIZE, and each fits the largest entry, which caps
+ * the number of shards at CACHE_MAXSHARDS.
+ *
+ * An entry is a single allocation of exactly the size it needs: the
+ * header, then the URL, its validators, and the object.  Budgets count
+ * memory, not payload: each entry is charged what malloc() actually set
+ * aside for it, and each shard its hash index.
+ *
+ * Within a shard, lookups go through a hash index rather than scanning
+ * the list: each entry stores the 64-bit hash of its URL, so a lookup
+ * compares strings only on a hash match.  The index doubles whenever it
+ * holds more entries than buckets.
+ *
+ * Which entry to evict is up to the eviction policy chosen at startup
+ * (policy.c), which keeps its own lists of each shard's entries.  The
+ * default, CLOCK (second chance), changes nothing but atomic fields on a
+ * hit, so hits need only the shard's read lock; policies that reorder
+ * lists on a hit take the write lock instead.  Each shard counts its
+ * hits and bytes served, so policies can be compared by hit ratio and
+ * byte hit ratio (cache_report()).
+ *
+ * Entries never change once inserted, but for their expiry, which a 304
+ * moves on in place; as readers may hold no lock, it is only read and
+ * written atomically (CACHE_EXPIRES()).  A hit pins its entry with a
+ * reference and drops the lock before writing to the client, so a slow
+ * reader holds up nobody else; eviction only unlinks an entry, and the
+ * last reader to let go of it frees it.
+ *
+ * With a disk tier (disk.c), evicted entries are written out to it
+ * after the shard is unlocked, objects too large for memory go straight
+ * there, and a miss in memory is looked up there before giving up.
+ * Before that, it is looked up in the snapshot loaded at startup, if
+ * any (snapshot.c), which holds what the last run had in memory.
+ *
+ * Each entry goes stale at the time cache_expiry() (freshness.c) worked
+ * out from its response's headers.  Lookups pass over stale entries as
+ * if they were not there.  Those with a validator (ETag or Last-Modified)
+ * stay until evicted, for doit() to revalidate with a conditional request
+ * (cache_stale()), and a 304 makes them fresh again in place
+ * (cache_refresh()).  Stale entries may also be served for a grace
+ * period past their expiry (cache_use_stale()).  A reaper thread evicts
+ * the rest once that is over, looking only at shards where the earliest
+ * such time has come.
+ *
+ * Each entry counts its hits since it was inserted.  cache_hot() ranks
+ * the entries about to go stale by hits per second, for the proxy to
+ * fetch the hottest again before they do (refresh_ahead_init()).
+ */
+#include "cache.h"
+#include <malloc.h>
+
+#define CACHE_MINBUCKETS 64
+#define MALLOC_OVERHEAD  sizeof(size_t)     /* glibc chunk header */
+#define CACHE_MAXREPLAY  8      /* Hits replayed for a restored entry */
+#define CACHE_REAP_INTERVAL 1   /* Seconds between the reaper's rounds */
+#define CACHE_AHEAD_WINDOW  2   /* Least seconds before expiry to refresh */
+#define STAT(x) __atomic_load_n(&(x), __ATOMIC_RELAXED) /* For reports */
+
+static cache_policy *policy;
+static cache_list *shards;
+static int nshards;
+static long nblocks;            /* Entries allocated: linked, or evicted
+                                   but still pinned */
+
+static cache_list *shard_of(uint64_t hash);
+static void lock(cache_list *c, int write);
+static void unlock(cache_list *c);
+static cache_block *lookup(cache_list *c, char *url, uint64_t hash);
+static void evict(cache_list *c, cache_block *p);
+static void put_block(cache_block *p);
+static cache_block *new_block(char *url, uint64_t hash, char *data, int size,
+                              disk_seg *disk);
+static void grow(cache_list *c);
+static cache_block *insert(cache_list *c, char *url, uint64_t hash,
+                           char *buf, int size, unsigned long cost,
+                           long expires);
+static void *reaper(void *vargp);
+static void reap(cache_list *c, long now);
+static long reap_time(cache_block *p);
+static int refresh_due(cache_block *p, long now);
+static cache_block *disk_lookup(cache_list *c, char *url, uint64_t hash);
+static void count_hit(cache_list *c, cache_block *p);
+static void report_ratios(cache_list *c);
+static void report_percent(unsigned long n, unsigned long total);
+
+/*
+ * cache_init - Split the cache into n shards, one per core if n <= 0,
+ *     evicting with the policy called name. Returns -1 if there is none.
+ */
+int cache_init(int n, char *name) {
+    cache_list *c;
+    int i, rc;
+
+    if ((policy = cache_policy_find(name)) == NULL)
+        return -1;
+    if (n <= 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        n = 1;
+    if (n > CACHE_MAXSHARDS)
+        n = CACHE_MAXSHARDS;
+    nshards = n;
+    shards = Calloc(n, sizeof(cache_list));
+    for (i = 0; i < n; i++) {
+        c = &shards[i];
+        c->budget = MAX_CACHE_SIZE / n;
+        c->nbuckets = CACHE_MINBUCKETS;
+        c->buckets = Calloc(c->nbuckets, sizeof(cache_block *));
+        c->total_size = cache_charge(c->buckets);
+        if ((rc = pthread_rwlock_init(&c->lock, NULL)) != 0)
+            posix_error(rc, "pthread_rwlock_init error");
+        if (policy->init)
+            policy->init(c);
+    }
+    return 0;
+}
+
+/*
+ * cache_expire_init - Keep responses that give no lifetime of their own
+ *     default_ttl seconds, or until evicted if 0, let those that give no
+ *     grace period be served stale for grace seconds, and start reaping
+ *     stale entries.
+ */
+void cache_expire_init(int default_ttl, int grace) {
+    pthread_t tid;
+
+    cache_default_ttl = default_ttl;
+    cache_default_grace = grace;
+    Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/* 64-bit FNV-1a */
+uint64_t cache_hash(char *url) {
+    uint64_t h = 14695981039346656037UL;
+
+    while (*url) {
+        h ^= (unsigned char)*url++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/*
+ * cache_find - Serve url from the cache. Returns 1 on a hit, even if
+ *     the client went away part way through.
+ */
+int cache_find(char *url, int connfd) {
+    cache_block *p;
+    char *data;
+    int size;
+
+    if ((p = cache_lookup(url, &data, &size)) == NULL)
+        return 0;
+    rio_writen(connfd, data, size);
+    cache_release(p);
+    return 1;
+}
+
+/*
+ * cache_lookup - Pin the fresh object cached for url and point *data
+ *     and *size at it, or return NULL on a miss. The object stays valid,
+ *     even if evicted, until the caller passes the returned handle to
+ *     cache_release().
+ */
+cache_block *cache_lookup(char *url, char **data, int *size) {
+    uint64_t hash = cache_hash(url);
+    cache_list *c = shard_of(hash);
+    cache_block *p;
+    long now = time(NULL);
+
+    lock(c, policy->hit_writes);
+    __atomic_add_fetch(&c->lookups, 1, __ATOMIC_RELAXED);
+    if ((p = lookup(c, url, hash)) != NULL
+        && CACHE_EXPIRED(CACHE_EXPIRES(p), now))
+        p = NULL;               /* Left for the reaper */
+    if (p) {
+        policy->hit(c, p);
+        __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&p->hits, 1, __ATOMIC_RELAXED);
+        count_hit(c, p);
+    }
+    unlock(c);
+
+    if (p == NULL && __atomic_load_n(&snapshot_pending, __ATOMIC_ACQUIRE))
+        p = snapshot_take(url, hash);
+    if (p == NULL && disk_max_object > 0)
+        p = disk_lookup(c, url, hash);
+    if (p) {
+        *data = p->data;
+        *size = p->size;
+    }
+    return p;
+}
+
+/*
+ * cache_stale - Pin the stale copy of url, if it has a validator to
+ *     revalidate it with or may still be served (cache_use_stale()), and
+ *     point *data and *size at it and *etag and *modified at its
+ *     validators, NULL for one it lacks. Returns NULL if there is none.
+ *     The caller lets go with cache_release().
+ */
+cache_block *cache_stale(char *url, char **data, int *size, char **etag,
+                         char **modified) {
+    uint64_t hash = cache_hash(url);
+    cache_list *c = shard_of(hash);
+    cache_block *p;
+    disk_seg *s;
+    unsigned long cost;
+    long expires, now = time(NULL);
+
+    lock(c, 0);
+    if ((p = lookup(c, url, hash)) != NULL
+        && CACHE_EXPIRED(reap_time(p), now))
+        p = NULL;
+    if (p)
+        __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+    unlock(c);
+
+    if (p == NULL && disk_max_object > 0
+        && (s = disk_get(url, hash, data, size, &cost, &expires)) != NULL) {
+        p = new_block(url, hash, *data, *size, s);
+        p->cost = cost;
+        p->expires = expires;
+        if (CACHE_EXPIRED(reap_time(p), now)) {
+            put_block(p);
+            disk_forget(url, hash);     /* Of no further use */
+            return NULL;
+        }
+    }
+    if (p) {
+        *data = p->data;
+        *size = p->size;
+        *etag = p->etag;
+        *modified = p->modified;
+    }
+    return p;
+}
+
+/*
+ * cache_refresh - Make p, from cache_stale(), fresh until expires, the
+ *     origin having answered 304 Not Modified.
+ */
+void cache_refresh(cache_block *p, long expires) {
+    cache_list *c = shard_of(p->hash);
+
+    __atomic_add_fetch(&c->revalidated, 1, __ATOMIC_RELAXED);
+    if (p->disk) {
+        disk_refresh(p->url, p->hash, expires);
+        return;
+    }
+    lock(c, 1);
+    if (lookup(c, p->url, p->hash) == p)
+        __atomic_store_n(&p->expires, expires, __ATOMIC_RELAXED);
+    unlock(c);
+}
+
+/*
+ * cache_use_stale - Return 1, and count a stale hit, if p, from
+ *     cache_stale(), may be served though stale: while it is fetched
+ *     again, or if error, because the origin failed.
+ */
+int cache_use_stale(cache_block *p, int error) {
+    int grace = error ? p->grace_error : p->grace_revalidate;
+    long expires = CACHE_EXPIRES(p);
+
+    if (expires == 0 || time(NULL) >= expires + grace)
+        return 0;
+    __atomic_add_fetch(&shard_of(p->hash)->stale_hits, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * cache_hot - Copy into urls the URLs of the n entries in memory with
+ *     the most hits per second that are due to be refreshed ahead of
+ *     their expiry, hottest first, leaving out those never hit. Returns
+ *     how many there were, up to n.
+ */
+int cache_hot(char (*urls)[MAXLINE], int n) {
+    cache_list *c;
+    cache_block *p;
+    double *rate, r;
+    unsigned long b;
+    long now = time(NULL);
+    int i, j, k = 0, hits;
+
+    if (n <= 0)
+        return 0;
+    rate = Malloc(n * sizeof(double));
+    for (i = 0; i < nshards; i++) {
+        c = &shards[i];
+        lock(c, 0);
+        for (b = 0; b < c->nbuckets; b++)
+            for (p = c->buckets[b]; p; p = p->hnext) {
+                hits = __atomic_load_n(&p->hits, __ATOMIC_RELAXED);
+                if (hits == 0 || !refresh_due(p, now))
+                    continue;
+                r = (double)hits / (now - p->stored + 1);
+                if (k == n && r <= rate[n - 1])
+                    continue;
+                /* Insertion sort into the n hottest so far */
+                for (j = k < n ? k++ : n - 1; j > 0 && rate[j - 1] < r; j--) {
+                    rate[j] = rate[j - 1];
+                    strcpy(urls[j], urls[j - 1]);
+                }
+                rate[j] = r;
+                strcpy(urls[j], p->url);
+            }
+        unlock(c);
+    }
+    Free(rate);
+    return k;
+}
+
+/* Count a refresh of url, from cache_hot(), started ahead of its expiry */
+void cache_count_ahead(char *url) {
+    __atomic_add_fetch(&shard_of(cache_hash(url))->ahead, 1,
+                       __ATOMIC_RELAXED);
+}
+
+/* Unpin an object; needs no lock */
+void cache_release(cache_block *p) {
+    put_block(p);
+}
+
+/*
+ * cache_insert - Cache a copy of the object fetched for url, which took
+ *     cost ms to fetch and is fresh until expires (see cache_expiry()):
+ *     in memory if it fits, else on disk if there is a disk tier.
+ */
+void cache_insert(char *url, char *buf, int size, unsigned long cost,
+                  long expires) {
+    uint64_t hash = cache_hash(url);
+    cache_list *c = shard_of(hash);
+    cache_block *old;
+
+    if (size > cache_max_object() || strlen(url) >= MAXLINE)
+        return;
+    /* Older copies are superseded */
+    if (__atomic_load_n(&snapshot_pending, __ATOMIC_ACQUIRE))
+        snapshot_forget(url, hash);
+    if (disk_max_object > 0)
+        disk_forget(url, hash);
+
+    if (size > MAX_OBJECT_SIZE) {
+        lock(c, 1);
+        if ((old = lookup(c, url, hash)) != NULL)
+            evict(c, old);
+        unlock(c);
+        disk_put(url, hash, buf, size, cost, expires);
+        return;
+    }
+    put_block(insert(c, url, hash, buf, size, cost, expires));
+    __atomic_add_fetch(&c->miss_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->miss_cost, cost, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_restore - Put an object from a snapshot back, replaying up to
+ *     CACHE_MAXREPLAY of its hits to the policy, for a lookup that is
+ *     counted as a hit. Returns it pinned.
+ */
+cache_block *cache_restore(char *url, uint64_t hash, char *data, int size,
+                           unsigned long cost, long expires, int hits) {
+    cache_list *c = shard_of(hash);
+    cache_block *p = insert(c, url, hash, data, size, cost, expires);
+    int i;
+
+    lock(c, 1);
+    if (lookup(c, url, hash) == p)
+        for (i = 0; i < hits && i < CACHE_MAXREPLAY; i++)
+            policy->hit(c, p);
+    p->hits = hits + 1;
+    count_hit(c, p);
+    unlock(c);
+    return p;
+}
+
+/* Entries allocated: those linked, and those evicted but still pinned */
+long cache_blocks(void) {
+    return __atomic_load_n(&nblocks, __ATOMIC_RELAXED);
+}
+
+/* Call fn on every entry, one shard at a time under its read lock */
+void cache_walk(void (*fn)(cache_block *p, void *arg), void *arg) {
+    cache_list *c;
+    cache_block *p;
+    unsigned long b;
+    int i;
+
+    for (i = 0; i < nshards; i++) {
+        c = &shards[i];
+        lock(c, 0);
+        for (b = 0; b < c->nbuckets; b++)
+            for (p = c->buckets[b]; p; p = p->hnext)
+                fn(p, arg);
+        unlock(c);
+    }
+}
+
+char *cache_policy_name(void) {
+    return policy->name;
+}
+
+/* The largest object cache_insert() takes */
+int cache_max_object(void) {
+    return disk_max_object > 0 ? disk_max_object : MAX_OBJECT_SIZE;
+}
+
+/*
+ * cache_append - Add n bytes to a response being collected for
+ *     cache_insert() in *buf, of *cap bytes, growing it as needed. *size
+ *     counts every byte, even those past what the cache can take, which
+ *     are not kept.
+ */
+void cache_append(char **buf, int *cap, int *size, char *data, int n) {
+    int max = cache_max_object();
+
+    if (*size + n < max) {
+        if (*size + n > *cap) {
+            *cap = 2 * (*size + n);
+            if (*cap > max)
+                *cap = max;
+            *buf = Realloc(*buf, *cap);
+        }
+        memcpy(*buf + *size, data, n);
+    }
+    *size += n;
+}
+
+/*
+ * cache_report - Print each shard's lock acquisitions, how many had to
+ *     wait, entries, bytes and hit ratios, then the policy's overall hit
+ *     ratios and the entries allocated, evicted ones still pinned
+ *     included. Async-signal-safe, for SIGUSR1 handlers: the counts are
+ *     read without the locks, with STAT(), as they are only changed
+ *     atomically.
+ */
+void cache_report(void) {
+    cache_list *c, all;
+    int i;
+
+    all.lookups = all.hits = 0;
+    all.hit_bytes = all.miss_bytes = all.hit_cost = all.miss_cost = 0;
+    for (i = 0; i < nshards; i++) {
+        c = &shards[i];
+        sio_puts("cache shard ");
+        sio_putl(i);
+        sio_puts(": locks ");
+        sio_putl(STAT(c->locks));
+        sio_puts(" contended ");
+        sio_putl(STAT(c->contended));
+        sio_puts(" entries ");
+        sio_putl(STAT(c->nentries));
+        sio_puts(" bytes ");
+        sio_putl(STAT(c->total_size));
+        sio_puts("/");
+        sio_putl(c->budget);
+        sio_puts(" expired ");
+        sio_putl(STAT(c->expired));
+        sio_puts(" revalidated ");
+        sio_putl(STAT(c->revalidated));
+        sio_puts(" stale ");
+        sio_putl(STAT(c->stale_hits));
+        sio_puts(" ahead ");
+        sio_putl(STAT(c->ahead));
+        report_ratios(c);
+        all.lookups += STAT(c->lookups);
+        all.hits += STAT(c->hits);
+        all.hit_bytes += STAT(c->hit_bytes);
+        all.miss_bytes += STAT(c->miss_bytes);
+        all.hit_cost += STAT(c->hit_cost);
+        all.miss_cost += STAT(c->miss_cost);
+    }
+    sio_puts("cache policy ");
+    sio_puts(policy->name);
+    sio_puts(":");
+    report_ratios(&all);
+    sio_puts("cache blocks allocated ");
+    sio_putl(cache_blocks());
+    sio_puts("\n");
+    if (disk_max_object > 0)
+        disk_report();
+}
+
+/*
+ * Print hits per lookup, bytes served from the cache per byte served,
+ * and fetch time saved per fetch time needed. Misses are counted when
+ * inserted.
+ */
+static void report_ratios(cache_list *c) {
+    sio_puts(" hit ratio ");
+    report_percent(STAT(c->hits), STAT(c->lookups));
+    sio_puts(" byte hit ratio ");
+    report_percent(STAT(c->hit_bytes),
+                   STAT(c->hit_bytes) + STAT(c->miss_bytes));
+    sio_puts(" fetch time saved ");
+    report_percent(STAT(c->hit_cost),
+                   STAT(c->hit_cost) + STAT(c->miss_cost));
+    sio_puts("\n");
+}
+
+/* n of total, to a tenth of a percent */
+static void report_percent(unsigned long n, unsigned long total) {
+    unsigned long r = total ? (unsigned long)((double)n * 1000 / total) : 0;
+
+    sio_putl(r / 10);
+    sio_puts(".");
+    sio_putl(r % 10);
+    sio_puts("%");
+}
+
+/* ---------------- Tiers ---------------- */
+
+static void count_hit(cache_list *c, cache_block *p) {
+    __atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->hit_bytes, p->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->hit_cost, p->cost, __ATOMIC_RELAXED);
+}
+
+/*
+ * insert - Link a copy of an object into c, replacing any older one, and
+ *     demote the entries it pushes out to disk. Returns the copy pinned
+ *     for the caller, who may find it already evicted.
+ */
+static cache_block *insert(cache_list *c, char *url, uint64_t hash,
+                           char *buf, int size, unsigned long cost,
+                           long expires) {
+    cache_block *p = new_block(url, hash, buf, size, NULL);
+    cache_block *old, *victim, *demote = NULL, **bp;
+
+    /* Copied outside the lock */
+    p->charge = cache_charge(p);
+    p->cost = cost;
+    p->expires = expires;
+    p->refcnt = 2;
+
+    lock(c, 1);
+    if ((old = lookup(c, url, hash)) != NULL)
+        evict(c, old);          /* Replaced by the newer copy */
+    if (c->nentries + 1 > c->nbuckets)
+        grow(c);
+
+    bp = &c->buckets[hash & (c->nbuckets - 1)];
+    p->hnext = *bp;
+    *bp = p;
+    __atomic_add_fetch(&c->nentries, 1, __ATOMIC_RELAXED);
+    policy->insert(c, p);
+    __atomic_add_fetch(&c->total_size, p->charge, __ATOMIC_RELAXED);
+    if (reap_time(p) && (c->soonest == 0 || reap_time(p) < c->soonest))
+        __atomic_store_n(&c->soonest, reap_time(p), __ATOMIC_RELAXED);
+
+    /* The policy may turn the new entry itself away. Victims are kept
+       pinned on a list through hnext, to be written out after unlocking */
+    while (c->total_size > c->budget && (victim = policy->victim(c))) {
+        if (disk_max_object > 0)
+            __atomic_add_fetch(&victim->refcnt, 1, __ATOMIC_RELAXED);
+        evict(c, victim);
+        if (disk_max_object > 0) {
+            victim->hnext = demote;
+            demote = victim;
+        }
+    }
+    unlock(c);
+
+    for (; demote; demote = victim) {
+        victim = demote->hnext;
+        disk_put(demote->url, demote->hash, demote->data, demote->size,
+                 demote->cost, CACHE_EXPIRES(demote));
+        put_block(demote);
+    }
+    return p;
+}
+
+/*
+ * disk_lookup - Look for url on disk after a miss in c. Objects that fit
+ *     in memory move back there; larger ones are served from disk.
+ */
+static cache_block *disk_lookup(cache_list *c, char *url, uint64_t hash) {
+    cache_block *p;
+    disk_seg *s;
+    char *data;
+    int size;
+    unsigned long cost;
+    long expires;
+
+    if ((s = disk_get(url, hash, &data, &size, &cost, &expires)) == NULL)
+        return NULL;
+    if (CACHE_EXPIRED(expires, time(NULL))) {
+        disk_unpin(s);          /* For cache_stale() */
+        return NULL;
+    }
+    if (size <= MAX_OBJECT_SIZE) {
+        p = insert(c, url, hash, data, size, cost, expires);
+        disk_unpin(s);
+        return p;
+    }
+    p = new_block(url, hash, data, size, s);
+    p->cost = cost;
+    p->expires = expires;
+    return p;
+}
+
+/* ---------------- Expiry ---------------- */
+static void *reaper(void *vargp) {
+    long now, soonest;
+    int i;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1) {
+        Sleep(CACHE_REAP_INTERVAL);
+        now = time(NULL);
+        for (i = 0; i < nshards; i++) {
+            soonest = __atomic_load_n(&shards[i].soonest, __ATOMIC_RELAXED);
+            if (CACHE_EXPIRED(soonest, now))
+                reap(&shards[i], now);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Evict c's entries that are past their reap_time(), and note when the
+ * next one will be
+ */
+static void reap(cache_list *c, long now) {
+    cache_block *p, *next;
+    unsigned long b;
+    long soonest = 0, t;
+
+    lock(c, 1);
+    for (b = 0; b < c->nbuckets; b++)
+        for (p = c->buckets[b]; p; p = next) {
+            next = p->hnext;
+            if (CACHE_EXPIRED(t = reap_time(p), now)) {
+                evict(c, p);
+                __atomic_add_fetch(&c->expired, 1, __ATOMIC_RELAXED);
+            } else if (t && (soonest == 0 || t < soonest))
+                soonest = t;
+        }
+    __atomic_store_n(&c->soonest, soonest, __ATOMIC_RELAXED);
+    unlock(c);
+}
+
+/*
+ * When p is of no further use: once stale, if it has no validator, and
+ * past any grace period. 0 if never.
+ */
+static long reap_time(cache_block *p) {
+    long expires = CACHE_EXPIRES(p);
+
+    if (expires == 0 || p->etag || p->modified)
+        return 0;
+    return expires + (p->grace_revalidate > p->grace_error
+                         ? p->grace_revalidate : p->grace_error);
+}
+
+/*
+ * Whether p goes stale within the last tenth of its lifetime, or within
+ * CACHE_AHEAD_WINDOW seconds, of now, and is still fresh
+ */
+static int refresh_due(cache_block *p, long now) {
+    long expires = CACHE_EXPIRES(p);
+    long window = (expires - p->stored) / 10;
+
+    if (window < CACHE_AHEAD_WINDOW)
+        window = CACHE_AHEAD_WINDOW;
+    return expires != 0 && expires > now && expires - now <= window;
+}
+
+/* ---------------- Shards ---------------- */
+
+/* The index uses the low bits of the hash, so pick shards by the high */
+static cache_list *shard_of(uint64_t hash) {
+    return &shards[(hash >> 32) % nshards];
+}
+
+/* Take c's lock, counting the times someone else had it */
+static void lock(cache_list *c, int write) {
+    int rc;
+
+    if ((write ? pthread_rwlock_trywrlock(&c->lock)
+         : pthread_rwlock_tryrdlock(&c->lock)) != 0) {
+        if ((rc = write ? pthread_rwlock_wrlock(&c->lock)
+             : pthread_rwlock_rdlock(&c->lock)) != 0)
+            posix_error(rc, "pthread_rwlock error");
+        __atomic_add_fetch(&c->contended, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&c->locks, 1, __ATOMIC_RELAXED);
+}
+
+static void unlock(cache_list *c) {
+    pthread_rwlock_unlock(&c->lock);
+}
+
+/* ---------------- Index ---------------- */
+static cache_block *lookup(cache_list *c, char *url, uint64_t hash) {
+    cache_block *p;
+
+    for (p = c->buckets[hash & (c->nbuckets - 1)]; p; p = p->hnext)
+        if (p->hash == hash && !strcmp(p->url, url))
+            return p;
+    return NULL;
+}
+
+/* Unlink p from the index and the policy and drop the cache's reference */
+static void evict(cache_list *c, cache_block *p) {
+    cache_block **bp;
+
+    for (bp = &c->buckets[p->hash & (c->nbuckets - 1)]; *bp != p;
+         bp = &(*bp)->hnext)
+        ;
+    *bp = p->hnext;
+
+    policy->remove(c, p);
+
+    __atomic_sub_fetch(&c->nentries, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->total_size, p->charge, __ATOMIC_RELAXED);
+    put_block(p);
+}
+
+/*
+ * new_block - Make an entry for an object, copying it after the URL and
+ *     validators, or, for one served from disk segment s, pointing at it.
+ *     The caller fills in the rest.
+ */
+static cache_block *new_block(char *url, uint64_t hash, char *data, int size,
+                              disk_seg *disk) {
+    cache_block *p;
+    char *etag, *modified, *q;
+    int urllen = strlen(url);
+    int elen = cache_validator(data, size, "ETag", &etag);
+    int mlen = cache_validator(data, size, "Last-Modified", &modified);
+
+    p = Malloc(sizeof(cache_block) + urllen + 1 + (elen ? elen + 1 : 0)
+               + (mlen ? mlen + 1 : 0) + (disk ? 0 : size));
+    p->url = q = (char *)(p + 1);
+    memcpy(q, url, urllen + 1);
+    q += urllen + 1;
+    p->etag = p->modified = NULL;
+    if (elen) {
+        p->etag = q;
+        memcpy(q, etag, elen);
+        q[elen] = '\0';
+        q += elen + 1;
+    }
+    if (mlen) {
+        p->modified = q;
+        memcpy(q, modified, mlen);
+        q[mlen] = '\0';
+        q += mlen + 1;
+    }
+    if (disk == NULL) {
+        memcpy(q, data, size);
+        data = q;
+    }
+    p->data = data;
+    p->size = size;
+    cache_grace(data, size, &p->grace_revalidate, &p->grace_error);
+    p->hash = hash;
+    p->refcnt = 1;
+    p->hits = 0;
+    p->stored = time(NULL);
+    p->disk = disk;
+    p->referenced = 0;
+    __atomic_add_fetch(&nblocks, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void put_block(cache_block *p) {
+    if (__atomic_sub_fetch(&p->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (p->disk)
+            disk_unpin(p->disk);
+        Free(p);
+        __atomic_sub_fetch(&nblocks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void grow(cache_list *c) {
+    unsigned long n = c->nbuckets * 2, i;
+    cache_block **buckets = Calloc(n, sizeof(cache_block *));
+    cache_block *p, *next;
+
+    for (i = 0; i < c->nbuckets; i++)
+        for (p = c->buckets[i]; p; p = next) {
+            next = p->hnext;
+            p->hnext = buckets[p->hash & (n - 1)];
+            buckets[p->hash & (n - 1)] = p;
+        }
+    __atomic_add_fetch(&c->total_size,
+                       cache_charge(buckets) - cache_charge(c->buckets),
+                       __ATOMIC_RELAXED);
+    Free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+}
+
+/* Memory malloc() set aside for p, its bookkeeping included */
+int cache_charge(void *p) {
+    return malloc_usable_size(p) + MALLOC_OVERHEAD;
+}
@@ -0,0 +1,136 @@
+/*
+ * cache.h - Internals shared by the cache (cache.c) and its eviction
+ *     policies (policy.c)
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "proxy.h"
+
+/* Whether something that expires at t has by now */
+#define CACHE_EXPIRED(t, now) ((t) != 0 && (t) <= (now))
+
+/* An entry's expiry, which a 304 may move on while others read it */
+#define CACHE_EXPIRES(p) __atomic_load_n(&(p)->expires, __ATOMIC_RELAXED)
+
+typedef struct disk_seg disk_seg;
+
+struct cache_block {
+    char *url;                  /* All point into the same allocation */
+    char *etag, *modified;      /* Validators; NULL if it has none */
+    char *data;
+    int size;
+    int charge;                 /* Bytes of memory it accounts for */
+    uint64_t hash;              /* cache_hash(url) */
+    unsigned long cost;         /* ms the origin took to supply it */
+    long expires;               /* time() it goes stale at; 0 if never.
+                                   Atomic: see CACHE_EXPIRES() */
+    int grace_revalidate;       /* Seconds past that it may be served while
+                                   refreshed, */
+    int grace_error;            /* ... and if the origin fails */
+    int refcnt;                 /* The cache's while linked, and readers' */
+    int hits;                   /* Since inserted, kept by snapshots */
+    long stored;                /* time() it was inserted, for its hit rate */
+    disk_seg *disk;             /* For a hit served from disk, the segment
+                                   it pins; NULL for entries in memory */
+
+    /* Policy state */
+    int referenced;             /* Hit count or bit, set under a read lock */
+    int queue;                  /* Which of the shard's queues it is on,
+                                   or its place in the GDSF heap */
+    struct cache_block *prev;   /* That queue, or the CLOCK ring */
+    struct cache_block *next;
+    double priority;            /* GDSF */
+
+    struct cache_block *hnext;  /* Hash chain */
+};
+
+/* An LRU or FIFO list of entries, most recent at the head */
+typedef struct {
+    cache_block *head, *tail;
+    long bytes;
+} cache_queue;
+
+typedef struct ghost ghost;
+
+typedef struct {
+    int total_size;             /* Memory held by entries and bookkeeping */
+    int budget;                 /* Bytes this shard may hold */
+    cache_block **buckets;
+    unsigned long nbuckets;     /* A power of two */
+    unsigned long nentries;
+    pthread_rwlock_t lock;      /* Read for lookups, write for changes */
+    unsigned long locks;        /* Times the lock was taken */
+    unsigned long contended;    /* ... after waiting for another thread */
+    long soonest;               /* Earliest expiry of an entry, or 0 */
+    unsigned long expired;      /* Entries reaped once stale */
+    unsigned long revalidated;  /* Stale entries a 304 made fresh again */
+    unsigned long stale_hits;   /* Stale entries served in their grace */
+    unsigned long ahead;        /* Refreshes started ahead of expiry */
+
+    /* Policy state */
+    cache_block *hand;          /* CLOCK */
+    cache_queue q[3];
+    ghost *ghosts[2];           /* Recently evicted hashes */
+    long target;                /* ARC's share for q[0], in bytes */
+    int ghost_hit;              /* Where the entry being inserted was found */
+    unsigned char *sketch;      /* W-TinyLFU frequencies, 4 rows */
+    unsigned long width;        /* Counters per row, a power of two */
+    unsigned long samples;      /* Since the counters were last halved */
+    cache_block **heap;         /* GDSF, lowest priority first */
+    unsigned long heapsize, heapcap;
+    double inflation;           /* GDSF's L: the last victim's priority */
+
+    /* Statistics, for comparing policies */
+    unsigned long lookups, hits;
+    unsigned long hit_bytes;    /* Object bytes served from the cache */
+    unsigned long miss_bytes;   /* ... and inserted after a miss */
+    unsigned long hit_cost;     /* Fetch ms saved by hits */
+    unsigned long miss_cost;    /* ... and spent on inserted misses */
+} cache_list;
+
+/*
+ * An eviction policy. Every hook runs under the shard's write lock,
+ * except hit() for policies that leave hit_writes clear: those must only
+ * touch p->referenced, atomically, under the read lock.
+ */
+typedef struct {
+    char *name;
+    int hit_writes;
+    void (*init)(cache_list *c);
+    void (*hit)(cache_list *c, cache_block *p);
+    void (*insert)(cache_list *c, cache_block *p);
+    cache_block *(*victim)(cache_list *c);  /* NULL if nothing to evict */
+    void (*remove)(cache_list *c, cache_block *p);
+} cache_policy;
+
+cache_policy *cache_policy_find(char *name);
+char *cache_policy_name(void);
+int cache_charge(void *p);
+void cache_walk(void (*fn)(cache_block *p, void *arg), void *arg);
+cache_block *cache_restore(char *url, uint64_t hash, char *data, int size,
+                           unsigned long cost, long expires, int hits);
+
+/* Freshness (freshness.c) */
+extern int cache_default_ttl;   /* Seconds for responses that give none */
+extern int cache_default_grace;
+int cache_validator(char *buf, int size, char *name, char **value);
+void cache_grace(char *buf, int size, int *revalidate, int *error);
+
+/* On-disk second tier (disk.c) */
+extern long disk_max_object;    /* 0 if there is no disk tier */
+void disk_put(char *url, uint64_t hash, char *data, int size,
+              unsigned long cost, long expires);
+disk_seg *disk_get(char *url, uint64_t hash, char **data, int *size,
+                   unsigned long *cost, long *expires);
+void disk_unpin(disk_seg *s);
+void disk_refresh(char *url, uint64_t hash, long expires);
+void disk_forget(char *url, uint64_t hash);
+void disk_report(void);
+
+/* Snapshots (snapshot.c) */
+extern int snapshot_pending;    /* Entries in the snapshot not yet taken */
+cache_block *snapshot_take(char *url, uint64_t hash);
+void snapshot_forget(char *url, uint64_t hash);
+
+#endif /* __CACHE_H__ */
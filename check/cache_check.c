@@ -0,0 +1,158 @@
+/*
+ * cache_check.c - Concurrent stress check of the cache
+ *
+ * Under each eviction policy in turn, in a fresh process, NCHECKERS
+ * threads look up random objects among NOBJECTS, several times what the
+ * cache holds, and insert each one they miss, so that inserts, hits and
+ * evictions race on every shard.  Every object's bytes follow from its
+ * number, and each hit is checked against them while pinned, after a
+ * yield to let evictions run meanwhile.  Once the threads are done,
+ * every entry left must hold only the cache's own reference, and no
+ * evicted entry may still be allocated: their references drained.
+ *
+ * usage: check/cache_check [operations per thread]
+ */
+#include "proxy.h"
+#include "cache.h"
+#include <sched.h>
+
+#define NCHECKERS  8
+#define NSHARDS    4
+#define NOBJECTS   2000         /* About 16 times the cache */
+#define MAXOBJSIZE 16384
+
+static char *policies[] = {
+    "clock", "lru", "s3fifo", "arc", "tinylfu", "gdsf"
+};
+#define NPOLICIES (int)(sizeof(policies) / sizeof(policies[0]))
+
+static int nops;
+
+typedef struct {
+    unsigned long seed;
+    long hits, bad;
+} worker_t;
+
+typedef struct {
+    long entries, bad;
+} walk_t;
+
+static unsigned long next_rand(unsigned long *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+static int obj_size(int k) {
+    return 64 + (k * 7919) % (MAXOBJSIZE - 64);
+}
+
+/* Object k: a response head naming it, then bytes that depend on k */
+static int make_obj(char *buf, int k) {
+    int size = obj_size(k), i;
+
+    i = sprintf(buf, "HTTP/1.0 200 OK\r\nX-Object: %d\r\n\r\n", k);
+    for (; i < size; i++)
+        buf[i] = (char)(k * 31 + i * 7);
+    return size;
+}
+
+static void obj_url(char *url, int k) {
+    sprintf(url, "http://check.example.com/objects/%d", k);
+}
+
+static void *checker(void *vargp) {
+    worker_t *w = vargp;
+    char url[64], *data, *obj, *want;
+    cache_block *p;
+    int i, k, size;
+
+    obj = Malloc(MAXOBJSIZE);
+    want = Malloc(MAXOBJSIZE);
+    for (i = 0; i < nops; i++) {
+        k = next_rand(&w->seed) % NOBJECTS;
+        obj_url(url, k);
+        if ((p = cache_lookup(url, &data, &size)) != NULL) {
+            w->hits++;
+            sched_yield();      /* Let others evict it under us */
+            if (size != make_obj(want, k) || memcmp(data, want, size))
+                w->bad++;
+            cache_release(p);
+        } else {
+            size = make_obj(obj, k);
+            cache_insert(url, obj, size, 1 + k % 100, 0);
+        }
+    }
+    Free(obj);
+    Free(want);
+    return NULL;
+}
+
+/* Count the entries left, and those with references besides the cache's */
+static void check_entry(cache_block *p, void *arg) {
+    walk_t *wk = arg;
+
+    wk->entries++;
+    if (__atomic_load_n(&p->refcnt, __ATOMIC_RELAXED) != 1)
+        wk->bad++;
+}
+
+/* Stress the cache under policy; returns the number of failures */
+static int check_policy(char *policy) {
+    pthread_t tids[NCHECKERS];
+    worker_t w[NCHECKERS];
+    walk_t wk;
+    long hits = 0, bad = 0;
+    int i, failures = 0;
+
+    cache_init(NSHARDS, policy);
+    for (i = 0; i < NCHECKERS; i++) {
+        memset(&w[i], 0, sizeof(w[i]));
+        w[i].seed = i + 1;
+        Pthread_create(&tids[i], NULL, checker, &w[i]);
+    }
+    for (i = 0; i < NCHECKERS; i++) {
+        Pthread_join(tids[i], NULL);
+        hits += w[i].hits;
+        bad += w[i].bad;
+    }
+
+    memset(&wk, 0, sizeof(wk));
+    cache_walk(check_entry, &wk);
+    printf("%-8s %8d ops %8ld hits %5ld entries", policy,
+           nops * NCHECKERS, hits, wk.entries);
+    if (bad) {
+        printf("  FAIL: %ld hits with the wrong bytes", bad);
+        failures++;
+    }
+    if (wk.bad) {
+        printf("  FAIL: %ld entries still pinned", wk.bad);
+        failures++;
+    }
+    if (cache_blocks() != wk.entries) {
+        printf("  FAIL: %ld evicted entries not freed",
+               cache_blocks() - wk.entries);
+        failures++;
+    }
+    if (hits == 0 || wk.entries >= NOBJECTS) {
+        printf("  FAIL: no hits or no evictions");
+        failures++;
+    }
+    printf("\n");
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    int i, status, failures = 0;
+
+    nops = argc > 1 ? atoi(argv[1]) : 5000;
+    for (i = 0; i < NPOLICIES; i++) {
+        fflush(stdout);
+        if (Fork() == 0)
+            exit(check_policy(policies[i]));
+        Wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failures++;
+    }
+    printf("cache_check: %d policies, %d failed\n", NPOLICIES, failures);
+    return failures > 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * http_check.c - Correctness checks for http.c's request head parser
+ *
+ * Each case is a head and what http_parse() must make of it: -1 if it
+ * is malformed, 0 if it is incomplete, or 1 with its length, request
+ * line and first header.  Every head is also fed to the parser in two
+ * reads split at each byte boundary, and one byte at a time, which must
+ * give the same result down to the last span.
+ *
+ * usage: check/http_check
+ */
+#include "proxy.h"
+
+#define HEAD(s) s, sizeof(s) - 1
+#define BAD(name, s) { name, HEAD(s), -1, 0, NULL, NULL, NULL, 0, NULL, NULL }
+
+typedef struct {
+    char *name;
+    char *head;
+    int len;
+    int rc;                 /* What http_parse() must return */
+    int off;                /* The head's length, if rc is 1 */
+    char *method, *uri, *version;
+    int nheaders;
+    char *hname, *hvalue;   /* The first header, if any */
+} parse_case;
+
+static parse_case cases[] = {
+    { "crlf", HEAD("GET http://h/x HTTP/1.1\r\nHost: h\r\n"
+                   "Accept: */*\r\n\r\n"),
+      1, -1, "GET", "http://h/x", "HTTP/1.1", 2, "Host", "h" },
+    { "bare lf", HEAD("GET /x HTTP/1.0\nHost: h\n\n"),
+      1, -1, "GET", "/x", "HTTP/1.0", 1, "Host", "h" },
+    { "mixed endings", HEAD("GET /x HTTP/1.0\r\nHost: h\n\r\n"),
+      1, -1, "GET", "/x", "HTTP/1.0", 1, "Host", "h" },
+    { "no headers", HEAD("GET /x HTTP/1.0\r\n\r\n"),
+      1, -1, "GET", "/x", "HTTP/1.0", 0, NULL, NULL },
+    { "leading empty lines", HEAD("\r\n\nGET /x HTTP/1.0\r\n\r\n"),
+      1, -1, "GET", "/x", "HTTP/1.0", 0, NULL, NULL },
+    { "body after head", HEAD("GET /x HTTP/1.0\r\nA: b\r\n\r\nbody"),
+      1, 25, "GET", "/x", "HTTP/1.0", 1, "A", "b" },
+    { "ows", HEAD("GET /x HTTP/1.0\r\nA: \t b c \t\r\n\r\n"),
+      1, -1, "GET", "/x", "HTTP/1.0", 1, "A", "b c" },
+    { "empty value", HEAD("GET /x HTTP/1.0\r\nA:\r\n\r\n"),
+      1, -1, "GET", "/x", "HTTP/1.0", 1, "A", "" },
+    { "colon in value", HEAD("GET /x HTTP/1.0\r\nHost: h:80\r\n\r\n"),
+      1, -1, "GET", "/x", "HTTP/1.0", 1, "Host", "h:80" },
+    { "incomplete", HEAD("GET /x HTTP/1.0\r\nHost: h\r\n"),
+      0, 0, NULL, NULL, NULL, 0, NULL, NULL },
+    { "incomplete cr", HEAD("GET /x HTTP/1.0\r\nHost: h\r\n\r"),
+      0, 0, NULL, NULL, NULL, 0, NULL, NULL },
+
+    /* Obsolete line folding */
+    BAD("fold sp", "GET /x HTTP/1.0\r\nA: b\r\n c\r\n\r\n"),
+    BAD("fold tab", "GET /x HTTP/1.0\r\nA: b\r\n\tc\r\n\r\n"),
+    BAD("fold first", "GET /x HTTP/1.0\r\n A: b\r\n\r\n"),
+
+    /* Malformed header lines */
+    BAD("sp before colon", "GET /x HTTP/1.0\r\nA : b\r\n\r\n"),
+    BAD("tab before colon", "GET /x HTTP/1.0\r\nA\t: b\r\n\r\n"),
+    BAD("no colon", "GET /x HTTP/1.0\r\nA b\r\n\r\n"),
+    BAD("empty name", "GET /x HTTP/1.0\r\n: b\r\n\r\n"),
+    BAD("stray cr", "GET /x HTTP/1.0\r\nA: b\rc\r\n\r\n"),
+    BAD("cr cr lf", "GET /x HTTP/1.0\r\nA: b\r\r\n\r\n"),
+    BAD("nul", "GET /x HTTP/1.0\r\nA: b\0c\r\n\r\n"),
+
+    /* Malformed request lines */
+    BAD("no uri", "GET\r\n\r\n"),
+    BAD("http/0.9", "GET /x\r\n\r\n"),
+    BAD("empty uri", "GET  HTTP/1.0\r\n\r\n"),
+    BAD("leading sp", " GET /x HTTP/1.0\r\n\r\n"),
+    BAD("trailing sp", "GET /x HTTP/1.0 \r\n\r\n"),
+    BAD("sp in uri", "GET /x y HTTP/1.0\r\n\r\n"),
+    BAD("bad version", "GET /x FTP/1.0\r\n\r\n"),
+    BAD("short version", "GET /x HTTP/1\r\n\r\n"),
+    BAD("lower version", "GET /x http/1.0\r\n\r\n"),
+    BAD("cr in request line", "GET /x\rHTTP/1.0\r\n\r\n"),
+};
+#define NCASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+static int failures;
+
+static void fail(char *name, char *how, int split) {
+    printf("FAIL %s: %s", name, how);
+    if (split >= 0)
+        printf(" (split at %d)", split);
+    printf("\n");
+    failures++;
+}
+
+/* Whether span s of buf holds exactly str */
+static int span_eq(char *buf, http_span s, char *str) {
+    return s.len == (int)strlen(str) && !memcmp(buf + s.off, str, s.len);
+}
+
+/* Parse buf whole, and check it gives what c expects */
+static int check_whole(parse_case *c, char *buf, http_parser *hp) {
+    int rc;
+
+    http_parser_init(hp);
+    if ((rc = http_parse(hp, buf, c->len)) != c->rc) {
+        fail(c->name, "wrong return", -1);
+        return rc;
+    }
+    if (rc != 1)
+        return rc;
+    if (hp->off != (c->off < 0 ? c->len : c->off))
+        fail(c->name, "wrong length", -1);
+    if (!span_eq(buf, hp->method, c->method)
+        || !span_eq(buf, hp->uri, c->uri)
+        || !span_eq(buf, hp->version, c->version))
+        fail(c->name, "wrong request line", -1);
+    if (hp->nheaders != c->nheaders)
+        fail(c->name, "wrong header count", -1);
+    else if (c->nheaders > 0
+             && (!span_eq(buf, hp->headers[0].name, c->hname)
+                 || !span_eq(buf, hp->headers[0].value, c->hvalue)))
+        fail(c->name, "wrong first header", -1);
+    return rc;
+}
+
+/* Whether a and b came to the same result */
+static int same_result(http_parser *a, int arc, http_parser *b, int brc) {
+    int i;
+
+    if (arc != brc)
+        return 0;
+    if (arc != 1)
+        return 1;
+    if (a->off != b->off || a->nheaders != b->nheaders
+        || memcmp(&a->method, &b->method, sizeof(http_span))
+        || memcmp(&a->uri, &b->uri, sizeof(http_span))
+        || memcmp(&a->version, &b->version, sizeof(http_span)))
+        return 0;
+    for (i = 0; i < a->nheaders; i++)
+        if (memcmp(&a->headers[i], &b->headers[i], sizeof(http_header)))
+            return 0;
+    return 1;
+}
+
+/* Feed buf in reads ending at split and len, or 1 byte at a time if 0 */
+static int parse_split(http_parser *hp, char *buf, int len, int split) {
+    int got, rc;
+
+    http_parser_init(hp);
+    if (split > 0) {
+        if ((rc = http_parse(hp, buf, split)) != 0)
+            return rc;
+        return http_parse(hp, buf, len);
+    }
+    for (got = 1, rc = 0; rc == 0 && got <= len; got++)
+        rc = http_parse(hp, buf, got);
+    return rc;
+}
+
+static void check_case(parse_case *c) {
+    static http_parser whole, part;
+    char *buf = Malloc(c->len);     /* Exactly the head, for valgrind */
+    int rc, split;
+
+    memcpy(buf, c->head, c->len);
+    rc = check_whole(c, buf, &whole);
+    for (split = 0; split < c->len; split++)
+        if (!same_result(&whole, rc, &part,
+                         parse_split(&part, buf, c->len, split)))
+            fail(c->name, "differs when split", split);
+    Free(buf);
+}
+
+/* A head with n headers, which must parse only up to HTTP_MAXHEADERS */
+static void check_maxheaders(int n) {
+    static char head[MAXLINE * 2];
+    static char name[64];
+    parse_case c;
+    int i, len;
+
+    len = sprintf(head, "GET /x HTTP/1.0\r\n");
+    for (i = 0; i < n; i++)
+        len += sprintf(head + len, "H%d: %d\r\n", i, i);
+    len += sprintf(head + len, "\r\n");
+
+    sprintf(name, "%d headers", n);
+    memset(&c, 0, sizeof(c));
+    c.name = name;
+    c.head = head;
+    c.len = len;
+    c.rc = n <= HTTP_MAXHEADERS ? 1 : -1;
+    c.off = -1;
+    c.method = "GET";
+    c.uri = "/x";
+    c.version = "HTTP/1.0";
+    c.nheaders = n;
+    c.hname = "H0";
+    c.hvalue = "0";
+    check_case(&c);
+}
+
+int main(void) {
+    int i;
+
+    for (i = 0; i < NCASES; i++)
+        check_case(&cases[i]);
+    check_maxheaders(HTTP_MAXHEADERS - 1);
+    check_maxheaders(HTTP_MAXHEADERS);
+    check_maxheaders(HTTP_MAXHEADERS + 1);
+
+    printf("http_check: %d heads, %d failures\n", NCASES + 3, failures);
+    return failures > 0;
+}
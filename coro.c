@@ -0,0 +1,325 @@
+/*
+ * coro.c - Coroutine server mode (-m coro)
+ *
+ * Runs the unmodified doit() for every connection, but inside a stackful
+ * coroutine instead of a thread.  Each scheduler thread owns an epoll
+ * instance; descriptors are non-blocking, and when a Rio routine would
+ * block it calls the rio_wait hook, which parks the coroutine on epoll
+ * and switches back to the scheduler until the descriptor is ready.
+ *
+ * Coroutine stacks are CORO_STACKSIZE bytes (with a guard page) and are
+ * recycled per scheduler, and doit()'s buffers come from the request
+ * frame pool, so an in-flight request costs a small fraction of a
+ * thread.  Name lookups run on the resolver threads of dns.c, and the
+ * coroutine waits for them like for any other descriptor.
+ */
+#include "proxy.h"
+#include <poll.h>
+#include <sys/epoll.h>
+#include <ucontext.h>
+
+#define CORO_STACKSIZE (64 * 1024)
+#define CORO_POOLMAX   1024     /* Idle coroutines kept per scheduler */
+#define EV_MAXEVENTS   256
+#define ACCEPT_PAUSE   100      /* ms to stop accepting when out of fds */
+
+typedef struct coro {
+    ucontext_t ctx;
+    char *stack;            /* Mapping of guard page + CORO_STACKSIZE */
+    int connfd;
+    int done;
+    struct coro *next;      /* Run queue or free list */
+
+    int waitfd;             /* Descriptor a timed wait is parked on */
+    unsigned long deadline; /* For a timed wait, in ms of now_ms() */
+    int timed_out;
+    struct coro *tprev, *tnext;     /* Timed waits of the scheduler */
+} coro_t;
+
+typedef struct {
+    int epfd;
+    ucontext_t main_ctx;    /* Scheduler context */
+    coro_t *current;
+    coro_t *runq_head, *runq_tail;
+    coro_t *free;
+    int nfree;
+    coro_t *timers;         /* Coroutines in a timed wait, unordered */
+    unsigned long resume;   /* now_ms() to watch the listener again, or 0 */
+} sched_t;
+
+static void *sched_thread(void *vargp);
+static void accept_conns(sched_t *s);
+static void watch_listener(sched_t *s);
+static void spawn(sched_t *s, int connfd);
+static void run(sched_t *s, coro_t *c);
+static void coro_main(void);
+static int coro_wait(int fd, int for_write, int timeout);
+static int next_timeout(sched_t *s);
+static void expire_timers(sched_t *s);
+static void timer_del(sched_t *s, coro_t *c);
+static void make_ready(sched_t *s, coro_t *c);
+static void set_nonblocking(int fd);
+
+static int listen_fd;
+static __thread sched_t *cur_sched;
+
+/* ---------------- Schedulers ---------------- */
+void coro_serve(int listenfd, int nscheds) {
+    pthread_t tid;
+    int i;
+
+    set_nonblocking(listenfd);
+    listen_fd = listenfd;
+    rio_wait = coro_wait;
+
+    for (i = 1; i < nscheds; i++)
+        Pthread_create(&tid, NULL, sched_thread, NULL);
+    sched_thread(NULL);
+}
+
+static void *sched_thread(void *vargp) {
+    struct epoll_event events[EV_MAXEVENTS];
+    sched_t sched;
+    coro_t *c;
+    int n, i;
+
+    (void)vargp;
+    memset(&sched, 0, sizeof(sched));
+    if ((sched.epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    cur_sched = &sched;
+    watch_listener(&sched);
+
+    while (1) {
+        while ((c = sched.runq_head) != NULL) {
+            sched.runq_head = c->next;
+            run(&sched, c);
+        }
+        sched.runq_tail = NULL;
+
+        n = epoll_wait(sched.epfd, events, EV_MAXEVENTS, next_timeout(&sched));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            if ((c = events[i].data.ptr) == NULL) {
+                accept_conns(&sched);
+                continue;
+            }
+            if (c->deadline)
+                timer_del(&sched, c);
+            make_ready(&sched, c);
+        }
+        expire_timers(&sched);
+        if (sched.resume && now_ms() >= sched.resume)
+            watch_listener(&sched);
+    }
+    return NULL;
+}
+
+static void accept_conns(sched_t *s) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    int connfd;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        if ((connfd = accept(listen_fd, (SA *)&clientaddr, &clientlen)) < 0) {
+            /* Out of descriptors the listener stays readable, so stop
+               watching it for a while rather than spin on it */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+                || errno == ENOMEM) {
+                epoll_ctl(s->epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+                s->resume = now_ms() + ACCEPT_PAUSE;
+            }
+            return;         /* EAGAIN, or a transient accept error */
+        }
+        set_nonblocking(connfd);
+        spawn(s, connfd);
+    }
+}
+
+static void watch_listener(sched_t *s) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;     /* NULL marks the listening socket */
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    s->resume = 0;
+}
+
+/* ---------------- Coroutines ---------------- */
+
+/* Start doit(connfd) in a pooled coroutine; it runs on the next round */
+static void spawn(sched_t *s, int connfd) {
+    coro_t *c;
+
+    if ((c = s->free) != NULL) {
+        s->free = c->next;
+        s->nfree--;
+    } else {
+        c = Malloc(sizeof(coro_t));
+        c->stack = Mmap(NULL, CORO_STACKSIZE + getpagesize(),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mprotect(c->stack, getpagesize(), PROT_NONE) < 0)
+            unix_error("mprotect error");
+    }
+
+    if (getcontext(&c->ctx) < 0)
+        unix_error("getcontext error");
+    c->ctx.uc_stack.ss_sp = c->stack + getpagesize();
+    c->ctx.uc_stack.ss_size = CORO_STACKSIZE;
+    c->ctx.uc_link = &s->main_ctx;
+    makecontext(&c->ctx, coro_main, 0);
+    c->connfd = connfd;
+    c->done = 0;
+    c->deadline = 0;
+    make_ready(s, c);
+}
+
+/* Switch to c until it waits or finishes */
+static void run(sched_t *s, coro_t *c) {
+    s->current = c;
+    if (swapcontext(&s->main_ctx, &c->ctx) < 0)
+        unix_error("swapcontext error");
+    s->current = NULL;
+
+    if (c->done) {
+        if (s->nfree < CORO_POOLMAX) {
+            c->next = s->free;
+            s->free = c;
+            s->nfree++;
+        } else {
+            Munmap(c->stack, CORO_STACKSIZE + getpagesize());
+            Free(c);
+        }
+    }
+}
+
+/* Coroutine body; returning resumes the scheduler through uc_link */
+static void coro_main(void) {
+    coro_t *c = cur_sched->current;
+
+    doit(c->connfd);
+    Close(c->connfd);
+    if (cur_sched->resume)
+        cur_sched->resume = now_ms();   /* A descriptor is free again */
+    c->done = 1;
+}
+
+/*
+ * coro_wait - rio_wait hook: park the current coroutine until fd is
+ *     ready, or for at most timeout ms if timeout >= 0. Returns -1 with
+ *     errno ETIMEDOUT on timeout. Outside a coroutine, as in a background
+ *     refresh, it blocks the thread in poll() instead.
+ */
+static int coro_wait(int fd, int for_write, int timeout) {
+    sched_t *s = cur_sched;
+    struct epoll_event ev;
+    struct pollfd pfd;
+    coro_t *c;
+    int rc;
+
+    if (s == NULL || (c = s->current) == NULL) {
+        pfd.fd = fd;
+        pfd.events = for_write ? POLLOUT : POLLIN;
+        while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+            ;
+        if (rc == 0)
+            errno = ETIMEDOUT;
+        return rc > 0 ? 0 : -1;
+    }
+
+    ev.events = (for_write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
+    }
+
+    c->timed_out = 0;
+    if (timeout >= 0) {
+        c->waitfd = fd;
+        c->deadline = now_ms() + timeout;
+        c->tprev = NULL;
+        c->tnext = s->timers;
+        if (s->timers)
+            s->timers->tprev = c;
+        s->timers = c;
+    }
+
+    if (swapcontext(&c->ctx, &s->main_ctx) < 0)
+        unix_error("swapcontext error");
+    if (c->timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+static void make_ready(sched_t *s, coro_t *c) {
+    c->next = NULL;
+    if (s->runq_tail)
+        s->runq_tail->next = c;
+    else
+        s->runq_head = c;
+    s->runq_tail = c;
+}
+
+static void set_nonblocking(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        unix_error("fcntl error");
+}
+
+/* ---------------- Timers ---------------- */
+
+/*
+ * epoll_wait() timeout until the earliest deadline, or until the
+ * listener is watched again, -1 if neither
+ */
+static int next_timeout(sched_t *s) {
+    unsigned long now, first;
+    coro_t *c;
+
+    if (s->timers == NULL && s->resume == 0)
+        return -1;
+    first = s->resume ? s->resume : s->timers->deadline;
+    for (c = s->timers; c; c = c->tnext)
+        if (c->deadline < first)
+            first = c->deadline;
+    now = now_ms();
+    return first > now ? (int)(first - now) : 0;
+}
+
+/* Resume timed waits whose deadline passed, disarming their descriptor */
+static void expire_timers(sched_t *s) {
+    unsigned long now = now_ms();
+    coro_t *c, *next;
+
+    for (c = s->timers; c; c = next) {
+        next = c->tnext;
+        if (c->deadline > now)
+            continue;
+        timer_del(s, c);
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->waitfd, NULL);
+        c->timed_out = 1;
+        make_ready(s, c);
+    }
+}
+
+static void timer_del(sched_t *s, coro_t *c) {
+    if (c->tprev)
+        c->tprev->tnext = c->tnext;
+    else
+        s->timers = c->tnext;
+    if (c->tnext)
+        c->tnext->tprev = c->tprev;
+    c->deadline = 0;
+}
@@ -23,6 +23,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include <poll.h>
 
 /************************** 
  * Error-handling functions
@@ -270,21 +271,21 @@ static size_t sio_strlen(char s[])
 
 ssize_t sio_puts(char s[]) /* Put string */
 {
-    return write(STDOUT_FILENO, s, sio_strlen(s)); //line:csapp:siostrlen
+    return write(STDOUT_FILENO, s, sio_strlen(s)); /* line:csapp:siostrlen */
 }
 
 ssize_t sio_putl(long v) /* Put long */
 {
     char s[128];
     
-    sio_ltoa(v, s, 10); /* Based on K&R itoa() */  //line:csapp:sioltoa
+    sio_ltoa(v, s, 10); /* Based on K&R itoa() */  /* line:csapp:sioltoa */
     return sio_puts(s);
 }
 
 void sio_error(char s[]) /* Put error message and exit */
 {
     sio_puts(s);
-    _exit(1);                                      //line:csapp:sioexit
+    _exit(1);                                      /* line:csapp:sioexit */
 }
 /* $end siopublic */
 
@@ -756,6 +757,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 	if ((nread = read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* Interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
+	    else if (errno == EAGAIN && rio_wait && rio_wait(fd, 0, -1) == 0)
+		nread = 0;      /* Ready again after rio_wait */
 	    else
 		return -1;      /* errno set by read() */ 
 	} 
@@ -768,6 +771,15 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_readn */
 
+/*
+ * rio_wait - Optional cooperative-scheduling hook.  When set, the Rio
+ *     routines call rio_wait(fd, for_write, -1) instead of failing with
+ *     EAGAIN on a non-blocking descriptor, and retry once it returns 0.
+ *     With a timeout >= 0 (ms), it returns -1 with errno ETIMEDOUT if fd
+ *     did not become ready in time.
+ */
+int (*rio_wait)(int fd, int for_write, int timeout) = NULL;
+
 /*
  * rio_writen - Robustly write n bytes (unbuffered)
  */
@@ -782,6 +794,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
+	    else if (errno == EAGAIN && rio_wait && rio_wait(fd, 1, -1) == 0)
+		nwritten = 0;    /* Ready again after rio_wait */
 	    else
 		return -1;       /* errno set by write() */
 	}
@@ -793,13 +807,32 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * rio_poll - Wait up to timeout ms for fd to become readable. Returns
+ *     -1 with errno ETIMEDOUT if it did not.
+ */
+static int rio_poll(int fd, int timeout)
+{
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+	;
+    if (rc == 0)
+	errno = ETIMEDOUT;
+    return rc > 0 ? 0 : -1;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() if the internal buffer is empty.  A refill that finds no
+ *    data within rp->rio_timeout ms fails with errno ETIMEDOUT.
  */
 /* $begin rio_read */
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
@@ -807,9 +840,15 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	if (rp->rio_timeout >= 0 && !rio_wait
+	    && rio_poll(rp->rio_fd, rp->rio_timeout) < 0)
+	    return -1;
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
+	    if (errno == EAGAIN && rio_wait
+		&& rio_wait(rp->rio_fd, 0, rp->rio_timeout) == 0)
+		continue;       /* Ready again after rio_wait */
 	    if (errno != EINTR) /* Interrupted by sig handler return */
 		return -1;
 	}
@@ -838,10 +877,61 @@ void rio_readinitb(rio_t *rp, int fd)
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
+    rp->rio_timeout = -1;
     rp->rio_bufptr = rp->rio_buf;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_readb - Read up to n bytes (buffered), waiting only if none are
+ *     buffered. Like read(), it returns 0 at EOF.
+ */
+ssize_t rio_readb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t rc;
+
+    while ((rc = rio_read(rp, usrbuf, n)) < 0 && errno == EINTR)
+	;
+    return rc;
+}
+
+/*
+ * rio_fillb - Read more into rp's buffer without consuming what is
+ *     there, so that a caller can parse it in place; the unread bytes
+ *     move to the front of the buffer if there is no room after them.
+ *     Returns the number of bytes added, 0 at EOF or if the buffer is
+ *     full, or -1 on error.
+ */
+ssize_t rio_fillb(rio_t *rp)
+{
+    char *end;
+    ssize_t n;
+
+    if (rp->rio_cnt >= (int)sizeof(rp->rio_buf))
+	return 0;
+    end = rp->rio_bufptr + rp->rio_cnt;
+    if (end == rp->rio_buf + sizeof(rp->rio_buf)) {
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+	end = rp->rio_buf + rp->rio_cnt;
+    }
+    while (1) {
+	if (rp->rio_timeout >= 0 && !rio_wait
+	    && rio_poll(rp->rio_fd, rp->rio_timeout) < 0)
+	    return -1;
+	if ((n = read(rp->rio_fd, end,
+		      rp->rio_buf + sizeof(rp->rio_buf) - end)) >= 0)
+	    break;
+	if (errno == EAGAIN && rio_wait
+	    && rio_wait(rp->rio_fd, 0, rp->rio_timeout) == 0)
+	    continue;           /* Ready again after rio_wait */
+	if (errno != EINTR)     /* Interrupted by sig handler return */
+	    return -1;
+    }
+    rp->rio_cnt += n;
+    return n;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -970,7 +1060,7 @@ int open_clientfd(char *hostname, char *port) {
         /* Connect to the server */
         if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
             break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
+        if (close(clientfd) < 0) { /* Connect failed, try another */  /* line:netp:openclientfd:closefd */
             fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
             return -1;
         } 
@@ -985,6 +1075,8 @@ int open_clientfd(char *hostname, char *port) {
 }
 /* $end open_clientfd */
 
+static int open_listenfd_opt(char *port, int reuseport);
+
 /*  
  * open_listenfd - Open and return a listening socket on port. This
  *     function is reentrant and protocol-independent.
@@ -995,6 +1087,22 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but sets SO_REUSEPORT so
+ *     that several sockets can listen on the same port and the kernel
+ *     spreads incoming connections across them.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1016,8 +1124,13 @@ int open_listenfd(char *port)
             continue;  /* Socket failed, try the next */
 
         /* Eliminates "Address already in use" error from bind */
-        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    /* line:netp:csapp:setsockopt */
                    (const void *)&optval , sizeof(int));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1041,7 +1154,6 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1064,6 +1176,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,259 @@
+/*
+ * disk.c - On-disk second tier of the cache
+ *
+ * With -o dir, entries evicted from memory are written to disk instead
+ * of being dropped, as are objects too large for memory, up to a
+ * segment's size.  A lookup that misses in memory looks here next.  A
+ * hit on an object small enough for memory moves it back there; larger
+ * ones are served straight from the segment's mapping, i.e. from the
+ * page cache, without being copied.
+ *
+ * The tier is a ring of segment files of DISK_SEGSIZE bytes each,
+ * allocated up front and mapped shared, and filled in turn like a log:
+ * each object is copied to the end of the current segment, and when the
+ * ring comes round to a segment again, everything in it is forgotten at
+ * once.  Only the index is kept in memory: the URL, segment, offset and
+ * size of each object.  A replaced object's old copy is dead space until
+ * its segment is reused.
+ *
+ * A hit pins its segment until the reader lets go of it, and a writer
+ * reserves its space and pins the segment, then copies outside the
+ * lock.  When the ring comes round to a segment that is still pinned,
+ * objects are dropped rather than written until it is released.
+ */
+#include "cache.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define DISK_MINBUCKETS 1024
+#define DISK_AVGOBJECT  16384   /* Sizes the index */
+
+typedef struct disk_entry {
+    char *url;
+    uint64_t hash;
+    disk_seg *seg;
+    long off;
+    int size;
+    unsigned long cost;         /* As cache_block's */
+    long expires;
+    int live;                   /* Still in the index */
+    struct disk_entry *hnext;   /* Hash chain */
+    struct disk_entry *snext;   /* Its segment's entries, live or not */
+} disk_entry;
+
+struct disk_seg {
+    char *map;
+    long used;                  /* Bytes reserved from the start */
+    int pins;                   /* Readers and writers */
+    disk_entry *entries;
+};
+
+static struct {
+    disk_seg *segs;
+    int nsegs, cur;             /* The segment being filled */
+    disk_entry **buckets;
+    unsigned long nbuckets;     /* A power of two */
+    sem_t mutex;
+} disk;
+
+static struct {
+    unsigned long objects;      /* In the index */
+    unsigned long hits;
+    unsigned long writes;
+    unsigned long dropped;      /* Writes refused by a pinned segment */
+} disk_stats;
+
+long disk_max_object;
+
+static disk_entry *find(char *url, uint64_t hash);
+static void unlink_entry(disk_entry *e);
+static void reclaim(disk_seg *s);
+
+/*
+ * disk_init - Create budget bytes' worth of segments, at least two, in
+ *     dir, replacing any left there.
+ */
+void disk_init(char *dir, long budget) {
+    char path[MAXLINE];
+    disk_seg *s;
+    int i, fd, rc;
+
+    if ((disk.nsegs = budget / DISK_SEGSIZE) < 2)
+        disk.nsegs = 2;
+    disk.segs = Calloc(disk.nsegs, sizeof(disk_seg));
+    for (i = 0; i < disk.nsegs; i++) {
+        s = &disk.segs[i];
+        snprintf(path, sizeof(path), "%s/segment.%d", dir, i);
+        fd = Open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if ((rc = posix_fallocate(fd, 0, DISK_SEGSIZE)) != 0)
+            posix_error(rc, "posix_fallocate error");
+        s->map = Mmap(NULL, DISK_SEGSIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+        Close(fd);
+    }
+
+    for (disk.nbuckets = DISK_MINBUCKETS;
+         disk.nbuckets * DISK_AVGOBJECT < (unsigned long)budget;
+         disk.nbuckets *= 2)
+        ;
+    disk.buckets = Calloc(disk.nbuckets, sizeof(disk_entry *));
+    Sem_init(&disk.mutex, 0, 1);
+    disk_max_object = DISK_SEGSIZE;
+}
+
+/* Write an object to the tier, replacing any older copy */
+void disk_put(char *url, uint64_t hash, char *data, int size,
+              unsigned long cost, long expires) {
+    disk_seg *s;
+    disk_entry *e, *old;
+    int urllen = strlen(url);
+    long off;
+
+    if (size > disk_max_object)
+        return;
+
+    P(&disk.mutex);
+    s = &disk.segs[disk.cur];
+    if (s->used + size > DISK_SEGSIZE) {
+        s = &disk.segs[(disk.cur + 1) % disk.nsegs];
+        if (__atomic_load_n(&s->pins, __ATOMIC_ACQUIRE) > 0) {
+            __atomic_add_fetch(&disk_stats.dropped, 1, __ATOMIC_RELAXED);
+            V(&disk.mutex);
+            return;
+        }
+        disk.cur = s - disk.segs;
+        reclaim(s);
+    }
+    off = s->used;
+    s->used += size;
+    __atomic_add_fetch(&s->pins, 1, __ATOMIC_RELAXED);
+    V(&disk.mutex);
+
+    memcpy(s->map + off, data, size);
+    e = Malloc(sizeof(disk_entry) + urllen + 1);
+    e->url = (char *)(e + 1);
+    memcpy(e->url, url, urllen + 1);
+    e->hash = hash;
+    e->seg = s;
+    e->off = off;
+    e->size = size;
+    e->cost = cost;
+    e->expires = expires;
+    e->live = 1;
+
+    P(&disk.mutex);
+    if ((old = find(url, hash)) != NULL)
+        unlink_entry(old);
+    e->hnext = disk.buckets[hash & (disk.nbuckets - 1)];
+    disk.buckets[hash & (disk.nbuckets - 1)] = e;
+    e->snext = s->entries;
+    s->entries = e;
+    __atomic_add_fetch(&disk_stats.objects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&disk_stats.writes, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&s->pins, 1, __ATOMIC_RELEASE);
+    V(&disk.mutex);
+}
+
+/*
+ * disk_get - Point *data, *size, *cost and *expires at the copy of url on
+ *     disk, fresh or not, and pin its segment, or return NULL if there is
+ *     none. The caller lets go with disk_unpin().
+ */
+disk_seg *disk_get(char *url, uint64_t hash, char **data, int *size,
+                   unsigned long *cost, long *expires) {
+    disk_entry *e;
+    disk_seg *s = NULL;
+
+    P(&disk.mutex);
+    if ((e = find(url, hash)) != NULL) {
+        s = e->seg;
+        __atomic_add_fetch(&s->pins, 1, __ATOMIC_RELAXED);
+        *data = s->map + e->off;
+        *size = e->size;
+        *cost = e->cost;
+        *expires = e->expires;
+        __atomic_add_fetch(&disk_stats.hits, 1, __ATOMIC_RELAXED);
+    }
+    V(&disk.mutex);
+    return s;
+}
+
+void disk_unpin(disk_seg *s) {
+    __atomic_sub_fetch(&s->pins, 1, __ATOMIC_RELEASE);
+}
+
+/* Make the copy of url on disk fresh until expires, after a 304 */
+void disk_refresh(char *url, uint64_t hash, long expires) {
+    disk_entry *e;
+
+    P(&disk.mutex);
+    if ((e = find(url, hash)) != NULL)
+        e->expires = expires;
+    V(&disk.mutex);
+}
+
+/* Drop the copy of url on disk, if any, once a newer one is fetched */
+void disk_forget(char *url, uint64_t hash) {
+    disk_entry *e;
+
+    P(&disk.mutex);
+    if ((e = find(url, hash)) != NULL)
+        unlink_entry(e);
+    V(&disk.mutex);
+}
+
+/*
+ * Async-signal-safe, like cache_report(): the counts are only changed
+ * atomically, and read so, without the mutex.
+ */
+void disk_report(void) {
+    sio_puts("cache disk: objects ");
+    sio_putl(__atomic_load_n(&disk_stats.objects, __ATOMIC_RELAXED));
+    sio_puts(" hits ");
+    sio_putl(__atomic_load_n(&disk_stats.hits, __ATOMIC_RELAXED));
+    sio_puts(" writes ");
+    sio_putl(__atomic_load_n(&disk_stats.writes, __ATOMIC_RELAXED));
+    sio_puts(" dropped ");
+    sio_putl(__atomic_load_n(&disk_stats.dropped, __ATOMIC_RELAXED));
+    sio_puts(" segments ");
+    sio_putl(disk.nsegs);
+    sio_puts(" x ");
+    sio_putl(DISK_SEGSIZE);
+    sio_puts("\n");
+}
+
+/* ---------------- Index ---------------- */
+static disk_entry *find(char *url, uint64_t hash) {
+    disk_entry *e;
+
+    for (e = disk.buckets[hash & (disk.nbuckets - 1)]; e; e = e->hnext)
+        if (e->hash == hash && !strcmp(e->url, url))
+            return e;
+    return NULL;
+}
+
+/* Take e out of the index; its segment frees it when reused */
+static void unlink_entry(disk_entry *e) {
+    disk_entry **ep;
+
+    for (ep = &disk.buckets[e->hash & (disk.nbuckets - 1)]; *ep != e;
+         ep = &(*ep)->hnext)
+        ;
+    *ep = e->hnext;
+    e->live = 0;
+    __atomic_sub_fetch(&disk_stats.objects, 1, __ATOMIC_RELAXED);
+}
+
+/* Forget everything in s, to fill it again */
+static void reclaim(disk_seg *s) {
+    disk_entry *e, *next;
+
+    for (e = s->entries; e; e = next) {
+        next = e->snext;
+        if (e->live)
+            unlink_entry(e);
+        Free(e);
+    }
+    s->entries = NULL;
+    s->used = 0;
+}
@@ -0,0 +1,380 @@
+/*
+ * dns.c - Name resolution cache and resolver pool
+ *
+ * Results are kept per (hostname, port) for dns_ttl seconds, and
+ * failures for dns_neg_ttl seconds, so that misses to a known origin
+ * skip the resolver.  getaddrinfo() does not report the record TTL, so
+ * both lifetimes are fixed by the command line.
+ *
+ * Lookups that miss are queued to a pool of resolver threads, so a slow
+ * getaddrinfo() never runs on a thread that serves connections.  The
+ * entry goes into the table at once, marked pending, and later lookups
+ * of the same name wait for that entry instead of starting their own.
+ * A pending entry has an eventfd that becomes readable once it is
+ * resolved.  Waiters get duplicates of it from dns_fd(): doit() waits on
+ * one with a deadline, the event loops poll theirs like any other
+ * descriptor.  The entry's own is closed as soon as it is resolved, so
+ * cached entries hold no descriptors.
+ *
+ * Entries are shared: dns_lookup() hands out a reference that the
+ * caller keeps while it walks the address list and drops with
+ * dns_release().
+ */
+#include "proxy.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define DNS_BUCKETS    256
+#define DNS_MAXENTRIES 1024     /* Sweep expired entries beyond this */
+
+struct dns_entry {
+    char *key;              /* "host:port" */
+    struct addrinfo *ai;    /* NULL for a failure */
+    int rc;                 /* getaddrinfo() result */
+    int pending;            /* Queued or being resolved */
+    int efd;                /* Readable once resolved; -1 after */
+    int linked;             /* In the table */
+    time_t expires;
+    int refcnt;             /* The table's, the resolver's and callers' */
+    struct dns_entry *next; /* Bucket chain */
+    struct dns_entry *qnext;        /* Resolver queue */
+};
+
+static struct {
+    dns_entry *buckets[DNS_BUCKETS];
+    int nentries;
+    int ttl, neg_ttl;
+    int timeout;            /* ms dns_resolve() waits by default */
+    sem_t mutex;
+    dns_entry *qhead, *qtail;       /* Lookups for the resolvers */
+    sem_t queued;
+} dns;
+
+dns_stats_t dns_stats;
+
+static void *resolver(void *vargp);
+static struct addrinfo *interleave(struct addrinfo *list);
+static int wait_entry(dns_entry *e, int timeout);
+static unsigned long dns_hash(char *key);
+static void unlink_entry(dns_entry **pp);
+static void sweep(time_t now);
+static void put_entry(dns_entry *e);
+
+void dns_init(int ttl, int neg_ttl, int timeout, int nresolvers) {
+    pthread_t tid;
+    int i;
+
+    memset(dns.buckets, 0, sizeof(dns.buckets));
+    dns.nentries = 0;
+    dns.ttl = ttl;
+    dns.neg_ttl = neg_ttl;
+    dns.timeout = timeout;
+    Sem_init(&dns.mutex, 0, 1);
+    dns.qhead = dns.qtail = NULL;
+    Sem_init(&dns.queued, 0, 0);
+    for (i = 0; i < nresolvers; i++)
+        Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+/*
+ * dns_lookup - Start resolving hostname and a numeric port, or find the
+ *     cached or in-flight lookup of the same name. Never blocks; wait
+ *     for dns_fd() to become readable before calling dns_result().
+ */
+dns_entry *dns_lookup(char *hostname, char *port) {
+    char key[MAXLINE];
+    unsigned long h;
+    dns_entry *e, **pp;
+    time_t now = time(NULL);
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    h = dns_hash(key);
+
+    P(&dns.mutex);
+    for (pp = &dns.buckets[h]; (e = *pp) != NULL; pp = &e->next) {
+        if (strcmp(e->key, key))
+            continue;
+        if (e->pending || now < e->expires)
+            break;
+        unlink_entry(pp);   /* Expired */
+        e = NULL;
+        break;
+    }
+
+    if (e != NULL) {
+        e->refcnt++;
+        if (e->pending)
+            dns_stats.joined++;
+        else if (e->ai)
+            dns_stats.hits++;
+        else
+            dns_stats.neg_hits++;
+        V(&dns.mutex);
+        return e;
+    }
+
+    dns_stats.misses++;
+    if (dns.nentries >= DNS_MAXENTRIES)
+        sweep(now);
+    e = Calloc(1, sizeof(dns_entry));
+    e->key = Malloc(strlen(key) + 1);
+    strcpy(e->key, key);
+    e->pending = 1;
+    if ((e->efd = eventfd(0, 0)) < 0)
+        unix_error("eventfd error");
+    e->refcnt = 3;
+    e->linked = 1;
+    e->next = dns.buckets[h];
+    dns.buckets[h] = e;
+    dns.nentries++;
+
+    e->qnext = NULL;
+    if (dns.qtail)
+        dns.qtail->qnext = e;
+    else
+        dns.qhead = e;
+    dns.qtail = e;
+    V(&dns.mutex);
+    V(&dns.queued);
+    return e;
+}
+
+/*
+ * dns_fd - Returns a new descriptor, for the caller to close, that is
+ *     readable once e is resolved, or -1 on error.
+ */
+int dns_fd(dns_entry *e) {
+    int fd;
+
+    P(&dns.mutex);
+    if (e->pending)
+        fd = dup(e->efd);
+    else
+        fd = eventfd(1, 0); /* Resolved since the caller looked */
+    V(&dns.mutex);
+    return fd;
+}
+
+/*
+ * dns_result - Returns 1 and sets *list to the addresses once e is
+ *     resolved, 0 while it is pending, -1 if the lookup failed.
+ */
+int dns_result(dns_entry *e, struct addrinfo **list) {
+    int rc;
+
+    P(&dns.mutex);
+    rc = e->pending ? 0 : e->ai ? 1 : -1;
+    *list = e->ai;
+    V(&dns.mutex);
+    return rc;
+}
+
+/*
+ * dns_resolve - dns_lookup() and wait up to timeout ms (the -R default
+ *     if timeout < 0). Returns a reference to the entry and sets *list
+ *     to its addresses, or returns NULL on failure or timeout.
+ */
+dns_entry *dns_resolve(char *hostname, char *port, struct addrinfo **list,
+                       int timeout) {
+    dns_entry *e = dns_lookup(hostname, port);
+
+    if (wait_entry(e, timeout < 0 ? dns.timeout : timeout) < 0) {
+        fprintf(stderr, "dns: lookup of %s:%s timed out\n", hostname, port);
+        P(&dns.mutex);
+        dns_stats.timeouts++;
+        put_entry(e);
+        V(&dns.mutex);
+        return NULL;
+    }
+    if (dns_result(e, list) < 0) {
+        dns_release(e);
+        return NULL;
+    }
+    return e;
+}
+
+/* Drop a reference returned by dns_lookup() or dns_resolve() */
+void dns_release(dns_entry *e) {
+    P(&dns.mutex);
+    put_entry(e);
+    V(&dns.mutex);
+}
+
+/* ---------------- Resolvers ---------------- */
+static void *resolver(void *vargp) {
+    struct addrinfo hints, *ai;
+    char host[MAXLINE], *port;
+    dns_entry *e, **pp;
+    sigset_t mask;
+    unsigned long h;
+    uint64_t one = 1;
+    int rc;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    Sigfillset(&mask);      /* Signals are for the serving threads */
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+
+    while (1) {
+        P(&dns.queued);
+        P(&dns.mutex);
+        e = dns.qhead;
+        if ((dns.qhead = e->qnext) == NULL)
+            dns.qtail = NULL;
+        V(&dns.mutex);
+
+        strcpy(host, e->key);
+        port = strrchr(host, ':');
+        *port++ = '\0';
+        if ((rc = getaddrinfo(host, port, &hints, &ai)) != 0) {
+            fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n",
+                    host, port, gai_strerror(rc));
+            ai = NULL;
+        }
+        if (ai)
+            ai = interleave(ai);
+
+        P(&dns.mutex);
+        e->ai = ai;
+        e->rc = rc;
+        e->pending = 0;
+        e->expires = time(NULL) + (ai ? dns.ttl : dns.neg_ttl);
+
+        /* Keep it only if caching is on; transient failures never */
+        if (e->linked && (dns.ttl == 0 || (ai == NULL
+                          && (dns.neg_ttl == 0 || rc == EAI_AGAIN
+                              || rc == EAI_MEMORY || rc == EAI_SYSTEM)))) {
+            h = dns_hash(e->key);
+            for (pp = &dns.buckets[h]; *pp != e; pp = &(*pp)->next)
+                ;
+            unlink_entry(pp);
+        }
+        if (write(e->efd, &one, sizeof(one)) < 0)
+            unix_error("eventfd write error");
+        close(e->efd);      /* Waiters hold duplicates */
+        e->efd = -1;
+        put_entry(e);
+        V(&dns.mutex);
+    }
+    return NULL;
+}
+
+/*
+ * interleave - Reorder a getaddrinfo() list so that address families
+ *     alternate, starting with the preferred one and otherwise keeping
+ *     the resolver's order (RFC 8305, section 4). Connection attempts
+ *     walk the list in this order.
+ */
+static struct addrinfo *interleave(struct addrinfo *list) {
+    struct addrinfo *first = NULL, *other = NULL, **fp = &first, **op = &other;
+    struct addrinfo *p, *next, **tail;
+
+    for (p = list; p; p = next) {
+        next = p->ai_next;
+        if (p->ai_family == list->ai_family) {
+            *fp = p;
+            fp = &p->ai_next;
+        } else {
+            *op = p;
+            op = &p->ai_next;
+        }
+    }
+    *fp = *op = NULL;
+
+    for (list = NULL, tail = &list; first || other; ) {
+        if (first) {
+            *tail = first;
+            tail = &first->ai_next;
+            first = first->ai_next;
+        }
+        if (other) {
+            *tail = other;
+            tail = &other->ai_next;
+            other = other->ai_next;
+        }
+    }
+    *tail = NULL;
+    return list;
+}
+
+/*
+ * wait_entry - Wait up to timeout ms for e to be resolved. Returns -1
+ *     on timeout.
+ */
+static int wait_entry(dns_entry *e, int timeout) {
+    struct pollfd pfd;
+    int pending, rc;
+
+    P(&dns.mutex);
+    pending = e->pending;
+    V(&dns.mutex);
+    if (!pending)
+        return 0;           /* Cached: no descriptor needed */
+    if ((pfd.fd = dns_fd(e)) < 0)
+        return -1;
+
+    if (rio_wait) {
+        rc = rio_wait(pfd.fd, 0, timeout);
+        if (rc == 0 || errno == ETIMEDOUT) {
+            close(pfd.fd);
+            return rc;
+        }
+    }
+
+    /* Not in a coroutine: block this thread */
+    pfd.events = POLLIN;
+    while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+        ;
+    close(pfd.fd);
+    return rc > 0 ? 0 : -1;
+}
+
+/* ---------------- Table ---------------- */
+static unsigned long dns_hash(char *key) {
+    unsigned long h = 5381;
+
+    while (*key)
+        h = h * 33 + (unsigned char)*key++;
+    return h % DNS_BUCKETS;
+}
+
+/* Remove *pp from its bucket and drop the table's reference */
+static void unlink_entry(dns_entry **pp) {
+    dns_entry *e = *pp;
+
+    *pp = e->next;
+    e->linked = 0;
+    dns.nentries--;
+    put_entry(e);
+}
+
+static void sweep(time_t now) {
+    dns_entry **pp;
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        pp = &dns.buckets[i];
+        while (*pp) {
+            if (!(*pp)->pending && now >= (*pp)->expires)
+                unlink_entry(pp);
+            else
+                pp = &(*pp)->next;
+        }
+    }
+}
+
+/* Drop one reference; caller holds dns.mutex */
+static void put_entry(dns_entry *e) {
+    if (--e->refcnt > 0)
+        return;
+    if (e->ai)
+        freeaddrinfo(e->ai);
+    if (e->efd >= 0)
+        close(e->efd);
+    Free(e->key);
+    Free(e);
+}
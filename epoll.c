@@ -0,0 +1,705 @@
+/*
+ * epoll.c - Non-blocking event-loop server mode (-m epoll)
+ *
+ * Instead of one thread per connection, each event loop owns an epoll
+ * instance and drives every connection through a small state machine:
+ *
+ *   READ_REQ --hit--> WRITE_HIT
+ *            --miss-> CONNECT -> SEND_REQ -> RELAY
+ *
+ * The semantics follow doit(): only GET is served, hits come out of the
+ * shared cache and complete responses smaller than MAX_OBJECT_SIZE are
+ * handed to cache_insert().  Several loops may share the listening
+ * socket; EPOLLEXCLUSIVE keeps a new connection from waking all of them.
+ *
+ * Name lookups go to the resolver threads of dns.c; until the answer
+ * arrives, the connection waits in RESOLVE on the lookup's descriptor.
+ *
+ * Connects race the origin's addresses like upstream_connect(): a new
+ * attempt starts every CONNECT_DELAY ms, or as soon as one fails, for at
+ * most -c seconds.  A miss must be answered within -t seconds, and while
+ * waiting on the origin the first byte within -f and each later one
+ * within -i.  Each loop keeps its connections' deadlines in a min-heap
+ * and sleeps in epoll_wait() until the earliest; a connection whose
+ * deadline passes gets a 504 if nothing was relayed yet, and is closed.
+ */
+#include "proxy.h"
+#include <sys/epoll.h>
+
+#define EV_MAXEVENTS 256
+#define REQ_INITSIZE 1024  /* First request buffer, grown up to MAXLINE */
+#define ACCEPT_PAUSE 100   /* ms to stop accepting when out of descriptors */
+
+enum conn_state { ST_READ_REQ, ST_WRITE_HIT, ST_RESOLVE, ST_CONNECT,
+                  ST_SEND_REQ, ST_RELAY };
+
+typedef struct conn conn_t;
+
+/* Per-loop state; each event loop thread owns one */
+typedef struct {
+    int epfd;
+    conn_t *dead;           /* Closed this round, freed after the batch */
+    unsigned long resume;   /* now_ms() to watch the listener again, or 0 */
+    conn_t **timers;        /* Min-heap of connections on timer_at */
+    int ntimers, timers_cap;
+} loop_t;
+
+/* One side of a connection, as registered with epoll */
+typedef struct {
+    int fd;
+    unsigned events;        /* Current epoll interest, 0 if idle */
+    int registered;
+    conn_t *c;
+} endpoint_t;
+
+struct conn {
+    enum conn_state state;
+    endpoint_t client, server;
+
+    char *in;               /* Request head read from the client */
+    int in_len, in_cap;
+    http_parser hp;         /* ... parsed as it arrives */
+
+    char *uri;              /* Cache key */
+    dns_entry *dns;         /* Holds ai_list */
+    struct addrinfo *ai_list, *ai_next;
+    endpoint_t tries[CONNECT_MAXRACE];  /* Connect attempts, fd -1 once
+                                           over; slots are not reused */
+    int ntries, pending;
+    unsigned long next_try; /* now_ms() to race the next address, or 0 */
+
+    char *req;              /* Request to the origin */
+    int req_len, req_off;
+
+    char *out;              /* Pending bytes for the client */
+    int out_len, out_off;
+    cache_block *hit;       /* Pins out for a cache hit */
+
+    char *obj;              /* Response copy for the cache */
+    int obj_size, obj_cap;
+    unsigned long started;  /* now_ms() when the fetch began */
+
+    unsigned long deadline; /* now_ms() the response must be done by, or 0 */
+    unsigned long wait_by;  /* ... the origin must send more by, or 0 */
+    unsigned long timer_at; /* The earlier of the two, as kept in the heap */
+    int timer_idx;          /* Index in the heap, -1 if not in it */
+
+    int closed;
+    conn_t *next_dead;
+};
+
+static void *loop_thread(void *vargp);
+static void accept_conns(loop_t *lp, int listenfd);
+static void watch_listener(loop_t *lp);
+static int next_timeout(loop_t *lp);
+static void handle_event(loop_t *lp, endpoint_t *ep, unsigned events);
+static int read_request(loop_t *lp, conn_t *c);
+static int start_request(loop_t *lp, conn_t *c);
+static int resolve(loop_t *lp, conn_t *c);
+static void stop_resolve(loop_t *lp, conn_t *c);
+static int start_connect(loop_t *lp, conn_t *c);
+static int finish_connect(loop_t *lp, conn_t *c, endpoint_t *ep);
+static int connected(loop_t *lp, conn_t *c, int fd);
+static void stop_tries(conn_t *c);
+static int send_request(loop_t *lp, conn_t *c);
+static int relay(loop_t *lp, conn_t *c);
+static int flush_client(conn_t *c);
+static void ep_set(loop_t *lp, endpoint_t *ep, unsigned events);
+static void conn_close(loop_t *lp, conn_t *c);
+static void conn_free(conn_t *c);
+static void set_nonblocking(int fd);
+static void wait_origin(loop_t *lp, conn_t *c, int timeout);
+static void timer_update(loop_t *lp, conn_t *c);
+static void timer_del(loop_t *lp, conn_t *c);
+static void timer_sift(loop_t *lp, int i);
+static void timer_swap(loop_t *lp, int i, int j);
+static void expire_conns(loop_t *lp);
+
+static int listen_fd;
+
+/* ---------------- Event loops ---------------- */
+void epoll_serve(int listenfd, int nloops) {
+    pthread_t tid;
+    int i;
+
+    set_nonblocking(listenfd);
+    listen_fd = listenfd;
+
+    for (i = 1; i < nloops; i++)
+        Pthread_create(&tid, NULL, loop_thread, NULL);
+    loop_thread(NULL);
+}
+
+static void *loop_thread(void *vargp) {
+    struct epoll_event events[EV_MAXEVENTS];
+    loop_t loop;
+    conn_t *c;
+    int n, i;
+
+    (void)vargp;
+    if ((loop.epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    loop.dead = NULL;
+    loop.timers = NULL;
+    loop.ntimers = loop.timers_cap = 0;
+    watch_listener(&loop);
+
+    while (1) {
+        n = epoll_wait(loop.epfd, events, EV_MAXEVENTS, next_timeout(&loop));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_conns(&loop, listen_fd);
+            else
+                handle_event(&loop, events[i].data.ptr, events[i].events);
+        }
+        expire_conns(&loop);
+
+        /* Both ends of a connection may appear in one batch */
+        while ((c = loop.dead) != NULL) {
+            loop.dead = c->next_dead;
+            conn_free(c);
+        }
+        if (loop.resume && now_ms() >= loop.resume)
+            watch_listener(&loop);
+    }
+    return NULL;
+}
+
+static void accept_conns(loop_t *lp, int listenfd) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    conn_t *c;
+    int connfd;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+            /* Out of descriptors the listener stays readable, so stop
+               watching it for a while rather than spin on it */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+                || errno == ENOMEM) {
+                epoll_ctl(lp->epfd, EPOLL_CTL_DEL, listenfd, NULL);
+                lp->resume = now_ms() + ACCEPT_PAUSE;
+            }
+            return;         /* EAGAIN, or a transient accept error */
+        }
+        set_nonblocking(connfd);
+
+        c = Calloc(1, sizeof(conn_t));
+        c->state = ST_READ_REQ;
+        c->client.fd = connfd;
+        c->client.c = c;
+        c->server.fd = -1;
+        c->server.c = c;
+        c->timer_idx = -1;
+        http_parser_init(&c->hp);
+        ep_set(lp, &c->client, EPOLLIN);
+    }
+}
+
+static void watch_listener(loop_t *lp) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;     /* NULL marks the listening socket */
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    lp->resume = 0;
+}
+
+/*
+ * epoll_wait() timeout until the earliest deadline, or until the
+ * listener is watched again, -1 if neither
+ */
+static int next_timeout(loop_t *lp) {
+    unsigned long now, first = lp->resume;
+
+    if (lp->ntimers && (first == 0 || lp->timers[0]->timer_at < first))
+        first = lp->timers[0]->timer_at;
+    if (first == 0)
+        return -1;
+    now = now_ms();
+    return first > now ? (int)(first - now) : 0;
+}
+
+/*
+ * handle_event - Advance a connection's state machine after epoll
+ *     reported activity on one of its descriptors.
+ */
+static void handle_event(loop_t *lp, endpoint_t *ep, unsigned events) {
+    conn_t *c = ep->c;
+    int rc = 0;
+
+    if (c->closed)
+        return;
+    if (ep == &c->client && (events & (EPOLLERR | EPOLLHUP))) {
+        conn_close(lp, c);
+        return;
+    }
+
+    switch (c->state) {
+    case ST_READ_REQ:
+        rc = read_request(lp, c);
+        break;
+    case ST_WRITE_HIT:
+        rc = flush_client(c);
+        if (rc == 0 && c->out_off == c->out_len)
+            rc = -1;        /* Whole object written */
+        break;
+    case ST_RESOLVE:
+        rc = resolve(lp, c);
+        break;
+    case ST_CONNECT:
+        if (ep->fd >= 0)    /* Not an attempt given up earlier */
+            rc = finish_connect(lp, c, ep);
+        break;
+    case ST_SEND_REQ:
+        rc = send_request(lp, c);
+        break;
+    case ST_RELAY:
+        rc = relay(lp, c);
+        break;
+    }
+    if (rc < 0)
+        conn_close(lp, c);
+}
+
+/* ---------------- States ---------------- */
+
+/* READ_REQ: collect the request head up to the blank line */
+static int read_request(loop_t *lp, conn_t *c) {
+    ssize_t n;
+
+    while (1) {
+        if (c->in_len >= c->in_cap - 1) {
+            if (c->in_cap >= MAXLINE)
+                return -1;  /* Request head too large */
+            c->in_cap = c->in_cap ? 2 * c->in_cap : REQ_INITSIZE;
+            if (c->in_cap > MAXLINE)
+                c->in_cap = MAXLINE;
+            c->in = Realloc(c->in, c->in_cap);
+        }
+        n = read(c->client.fd, c->in + c->in_len, c->in_cap - 1 - c->in_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0)
+            return -1;
+        c->in_len += n;
+        switch (http_parse(&c->hp, c->in, c->in_len)) {
+        case 1:
+            return start_request(lp, c);
+        case -1:
+            return -1;
+        }
+    }
+}
+
+/*
+ * start_request - The request head is complete: serve it from the cache
+ *     or build the origin request and start connecting.
+ */
+static int start_request(loop_t *lp, conn_t *c) {
+    char uri[MAXLINE], hostname[MAXLINE], path[MAXLINE], portstr[16];
+    int port;
+
+    ep_set(lp, &c->client, 0);
+
+    if (!http_span_is(c->in, c->hp.method, "GET")) {
+        printf("Proxy only supports GET\n");
+        return -1;
+    }
+
+    c->uri = Malloc(c->hp.uri.len + 1);
+    memcpy(c->uri, c->in + c->hp.uri.off, c->hp.uri.len);
+    c->uri[c->hp.uri.len] = '\0';
+    if ((c->hit = cache_lookup(c->uri, &c->out, &c->out_len)) != NULL) {
+        c->state = ST_WRITE_HIT;
+        ep_set(lp, &c->client, EPOLLOUT);
+        return 0;
+    }
+
+    c->started = now_ms();
+    if (request_timeout >= 0) {
+        c->deadline = c->started + request_timeout;
+        timer_update(lp, c);
+    }
+    strcpy(uri, c->uri);            /* parse_uri() modifies its argument */
+    parse_uri(uri, hostname, path, &port);
+    c->req = Malloc(MAXLINE);
+    if (build_requesthdrs(c->req, c->in, &c->hp, hostname, path, 0) < 0)
+        return -1;
+    c->req_len = strlen(c->req);
+
+    Free(c->in);
+    c->in = NULL;
+
+    sprintf(portstr, "%d", port);
+    c->dns = dns_lookup(hostname, portstr);
+    return resolve(lp, c);
+}
+
+/*
+ * RESOLVE: connect once the name is resolved. While the lookup is in
+ *     flight, c->server watches the descriptor dns_fd() gave it.
+ */
+static int resolve(loop_t *lp, conn_t *c) {
+    switch (dns_result(c->dns, &c->ai_list)) {
+    case 0:
+        if (c->state != ST_RESOLVE) {
+            if ((c->server.fd = dns_fd(c->dns)) < 0)
+                return -1;
+            c->state = ST_RESOLVE;
+            ep_set(lp, &c->server, EPOLLIN);
+        }
+        return 0;
+    case -1:
+        return -1;
+    }
+    if (c->state == ST_RESOLVE)
+        stop_resolve(lp, c);
+    c->ai_next = c->ai_list;
+    c->state = ST_CONNECT;
+    wait_origin(lp, c, upstream_connect_timeout());
+    return start_connect(lp, c);
+}
+
+/* The entry stays readable and open, so unregister before closing */
+static void stop_resolve(loop_t *lp, conn_t *c) {
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->server.fd, NULL);
+    close(c->server.fd);
+    c->server.fd = -1;
+    c->server.registered = 0;
+}
+
+/*
+ * Start a non-blocking connect to the next candidate address, alongside
+ * those still pending, and set when to race the one after. Returns -1
+ * once every attempt has failed.
+ */
+static int start_connect(loop_t *lp, conn_t *c) {
+    struct addrinfo *p;
+    endpoint_t *ep;
+    int fd;
+
+    c->next_try = 0;
+    for (p = c->ai_next; p && c->ntries < CONNECT_MAXRACE; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        set_nonblocking(fd);
+        c->ai_next = p->ai_next;
+
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            return connected(lp, c, fd);
+        if (errno == EINPROGRESS) {
+            ep = &c->tries[c->ntries++];
+            ep->fd = fd;
+            ep->registered = 0;
+            ep->c = c;
+            ep_set(lp, ep, EPOLLOUT);
+            c->pending++;
+            if (c->ai_next && c->ntries < CONNECT_MAXRACE)
+                c->next_try = now_ms() + CONNECT_DELAY;
+            timer_update(lp, c);
+            return 0;
+        }
+        close(fd);
+    }
+    timer_update(lp, c);
+    return c->pending ? 0 : -1;
+}
+
+/* CONNECT: an attempt's socket became writable, see whether it connected */
+static int finish_connect(loop_t *lp, conn_t *c, endpoint_t *ep) {
+    int err = 0, fd = ep->fd;
+    socklen_t len = sizeof(err);
+
+    ep->fd = -1;
+    c->pending--;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        close(fd);
+        return start_connect(lp, c);    /* Failed: race the next now */
+    }
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, fd, NULL);
+    return connected(lp, c, fd);
+}
+
+/* fd connected: drop the other attempts and send the request on it */
+static int connected(loop_t *lp, conn_t *c, int fd) {
+    stop_tries(c);
+    c->next_try = 0;
+    wait_origin(lp, c, -1);
+    dns_release(c->dns);
+    c->dns = NULL;
+    c->ai_list = c->ai_next = NULL;
+    c->server.fd = fd;
+    c->server.registered = 0;
+    c->state = ST_SEND_REQ;
+    ep_set(lp, &c->server, EPOLLOUT);
+    return send_request(lp, c);
+}
+
+/* Give up the attempts still pending, which drops them from the epoll set */
+static void stop_tries(conn_t *c) {
+    int i;
+
+    for (i = 0; i < c->ntries; i++)
+        if (c->tries[i].fd >= 0) {
+            close(c->tries[i].fd);
+            c->tries[i].fd = -1;
+        }
+    c->pending = 0;
+}
+
+/* SEND_REQ: write the request to the origin */
+static int send_request(loop_t *lp, conn_t *c) {
+    ssize_t n;
+
+    while (c->req_off < c->req_len) {
+        n = send(c->server.fd, c->req + c->req_off, c->req_len - c->req_off,
+                 MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->req_off += n;
+    }
+    Free(c->req);
+    c->req = NULL;
+
+    c->state = ST_RELAY;
+    c->out = Malloc(MAXLINE);
+    ep_set(lp, &c->server, EPOLLIN);
+    wait_origin(lp, c, first_byte_timeout);
+    return 0;
+}
+
+/*
+ * RELAY: copy the response to the client. While the client cannot keep
+ *     up, stop reading from the origin and wait for EPOLLOUT instead.
+ */
+static int relay(loop_t *lp, conn_t *c) {
+    ssize_t n;
+    unsigned long cost;
+    long expires;
+
+    if (c->out_off < c->out_len) {
+        if (flush_client(c) < 0)
+            return -1;
+        if (c->out_off < c->out_len)
+            return 0;
+        ep_set(lp, &c->client, 0);
+        ep_set(lp, &c->server, EPOLLIN);
+    }
+
+    while (1) {
+        n = read(c->server.fd, c->out, MAXLINE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            wait_origin(lp, c, c->obj_size ? inter_byte_timeout
+                                           : first_byte_timeout);
+            return 0;
+        }
+        if (n == 0) {
+            cost = now_ms() - c->started;
+            if (c->obj_size < cache_max_object()
+                && (expires = cache_expiry(c->obj, c->obj_size, cost)) >= 0)
+                cache_insert(c->uri, c->obj, c->obj_size, cost, expires);
+            return -1;      /* Done */
+        }
+
+        cache_append(&c->obj, &c->obj_cap, &c->obj_size, c->out, n);
+
+        c->out_off = 0;
+        c->out_len = n;
+        if (flush_client(c) < 0)
+            return -1;
+        if (c->out_off < c->out_len) {
+            ep_set(lp, &c->server, 0);
+            ep_set(lp, &c->client, EPOLLOUT);
+            wait_origin(lp, c, -1);     /* Waiting on the client now */
+            return 0;
+        }
+    }
+}
+
+/* Write as much pending output as the client accepts; -1 on error */
+static int flush_client(conn_t *c) {
+    ssize_t n;
+
+    while (c->out_off < c->out_len) {
+        n = send(c->client.fd, c->out + c->out_off, c->out_len - c->out_off,
+                 MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->out_off += n;
+    }
+    return 0;
+}
+
+/* ---------------- Helpers ---------------- */
+static void ep_set(loop_t *lp, endpoint_t *ep, unsigned events) {
+    struct epoll_event ev;
+
+    if (ep->registered && ep->events == events)
+        return;
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(lp->epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  ep->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ep->registered = 1;
+    ep->events = events;
+}
+
+/* Closing the descriptors also drops them from the epoll set */
+static void conn_close(loop_t *lp, conn_t *c) {
+    if (c->timer_idx >= 0)
+        timer_del(lp, c);
+    if (c->state == ST_RESOLVE && c->server.fd >= 0)
+        stop_resolve(lp, c);
+    stop_tries(c);
+    close(c->client.fd);
+    if (c->server.fd >= 0)
+        close(c->server.fd);
+    c->closed = 1;
+    c->next_dead = lp->dead;
+    lp->dead = c;
+    if (lp->resume)
+        lp->resume = now_ms();  /* A descriptor is free again */
+}
+
+static void conn_free(conn_t *c) {
+    if (c->dns)
+        dns_release(c->dns);
+    free(c->in);
+    free(c->uri);
+    free(c->req);
+    if (c->hit)
+        cache_release(c->hit);
+    else
+        free(c->out);
+    free(c->obj);
+    Free(c);
+}
+
+static void set_nonblocking(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        unix_error("fcntl error");
+}
+
+/* ---------------- Timers ---------------- */
+
+/* Give the origin timeout ms more, or no limit but -t if < 0 */
+static void wait_origin(loop_t *lp, conn_t *c, int timeout) {
+    c->wait_by = timeout < 0 ? 0 : now_ms() + timeout;
+    timer_update(lp, c);
+}
+
+/* Put c in the heap at the earlier of its deadlines, or take it out */
+static void timer_update(loop_t *lp, conn_t *c) {
+    unsigned long at = c->deadline;
+
+    if (c->wait_by && (at == 0 || c->wait_by < at))
+        at = c->wait_by;
+    if (c->next_try && (at == 0 || c->next_try < at))
+        at = c->next_try;
+    if (at == 0) {
+        if (c->timer_idx >= 0)
+            timer_del(lp, c);
+        return;
+    }
+    c->timer_at = at;
+    if (c->timer_idx < 0) {
+        if (lp->ntimers == lp->timers_cap) {
+            lp->timers_cap = lp->timers_cap ? 2 * lp->timers_cap : 64;
+            lp->timers = Realloc(lp->timers,
+                                 lp->timers_cap * sizeof(conn_t *));
+        }
+        c->timer_idx = lp->ntimers;
+        lp->timers[lp->ntimers++] = c;
+    }
+    timer_sift(lp, c->timer_idx);
+}
+
+static void timer_del(loop_t *lp, conn_t *c) {
+    int i = c->timer_idx;
+
+    c->timer_idx = -1;
+    if (i == --lp->ntimers)
+        return;
+    lp->timers[i] = lp->timers[lp->ntimers];
+    lp->timers[i]->timer_idx = i;
+    timer_sift(lp, i);
+}
+
+/* Move the entry at i up or down to where it belongs */
+static void timer_sift(loop_t *lp, int i) {
+    conn_t **t = lp->timers;
+    int child;
+
+    while (i > 0 && t[i]->timer_at < t[(i - 1) / 2]->timer_at) {
+        timer_swap(lp, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < lp->ntimers) {
+        if (child + 1 < lp->ntimers
+            && t[child + 1]->timer_at < t[child]->timer_at)
+            child++;
+        if (t[i]->timer_at <= t[child]->timer_at)
+            break;
+        timer_swap(lp, i, child);
+        i = child;
+    }
+}
+
+static void timer_swap(loop_t *lp, int i, int j) {
+    conn_t *c = lp->timers[i];
+
+    lp->timers[i] = lp->timers[j];
+    lp->timers[j] = c;
+    lp->timers[i]->timer_idx = i;
+    lp->timers[j]->timer_idx = j;
+}
+
+/*
+ * Close the connections whose deadline passed, with a 504 first if the
+ * client has none of the response yet. It is short enough for the empty
+ * socket buffer, so it is sent without waiting.
+ */
+static void expire_conns(loop_t *lp) {
+    unsigned long now = now_ms();
+    conn_t *c;
+
+    while (lp->ntimers && (c = lp->timers[0])->timer_at <= now) {
+        if (c->next_try && c->next_try == c->timer_at
+            && c->next_try < c->wait_by
+            && (c->deadline == 0 || c->next_try < c->deadline)) {
+            /* Nothing connected for CONNECT_DELAY ms: race the next */
+            if (start_connect(lp, c) < 0)
+                conn_close(lp, c);
+            continue;
+        }
+        if (c->obj_size == 0)
+            send(c->client.fd, gateway_timeout_msg,
+                 strlen(gateway_timeout_msg), MSG_NOSIGNAL);
+        conn_close(lp, c);
+    }
+}
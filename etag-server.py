@@ -0,0 +1,65 @@
+#!/usr/bin/python
+
+# etag-server.py - This is a server that we use for the revalidation
+#                  test. Its objects go stale after a second and carry
+#                  a validator: /etag an ETag, /lm a Last-Modified date,
+#                  and /changing an ETag that changes on every request.
+#                  It answers a request that still matches with a 304,
+#                  and appends the status of each response to log.
+#
+# usage: etag-server.py <port> <log>
+#
+import socket
+import sys
+
+LAST_MODIFIED = 'Sun, 06 Nov 1994 08:49:37 GMT'
+
+serversocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+serversocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+serversocket.bind(('', int(sys.argv[1])))
+serversocket.listen(5)
+version = 0
+
+while 1:
+  channel, details = serversocket.accept()
+  request = b''
+  while b'\r\n\r\n' not in request:
+    data = channel.recv(4096)
+    if not data:
+      break
+    request += data
+  lines = request.decode('latin-1').split('\r\n')
+  path = lines[0].split(' ')[1] if len(lines[0].split(' ')) > 1 else '/'
+  path = path[path.find('/', path.find('//') + 2):] if '//' in path else path
+  headers = {}
+  for line in lines[1:]:
+    if ':' in line:
+      name, value = line.split(':', 1)
+      headers[name.strip().lower()] = value.strip()
+
+  version += 1
+  if path == '/etag':
+    validator = 'ETag: "v1"'
+    fresh = headers.get('if-none-match') == '"v1"'
+  elif path == '/lm':
+    validator = 'Last-Modified: ' + LAST_MODIFIED
+    fresh = headers.get('if-modified-since') == LAST_MODIFIED
+  else:
+    validator = 'ETag: "v%d"' % version
+    fresh = False
+
+  if fresh:
+    response = 'HTTP/1.0 304 Not Modified\r\n%s\r\n' \
+               'Cache-Control: max-age=60\r\n\r\n' % validator
+  else:
+    body = '%s version %d\n' % (path, version)
+    response = 'HTTP/1.0 200 OK\r\n%s\r\nCache-Control: max-age=1\r\n' \
+               'Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s' \
+               % (validator, len(body), body)
+  # Logged first, so the log is complete once the client has the response
+  log = open(sys.argv[2], 'a')
+  log.write('%s %s\n' % (path, response.split(' ')[1]))
+  log.close()
+
+  channel.sendall(response.encode('latin-1'))
+  channel.close()
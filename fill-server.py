@@ -0,0 +1,56 @@
+#!/usr/bin/python
+
+# fill-server.py - This is a server that we use for the collapsed
+#                  forwarding test. It takes a second to answer each
+#                  request, so that concurrent ones overlap, and
+#                  appends the path of each request to log. The first
+#                  request for a path that starts with /fail gets the
+#                  connection closed instead of a response.
+#
+# usage: fill-server.py <port> <log>
+#
+import socket
+import sys
+import threading
+import time
+
+failed = set()
+lock = threading.Lock()
+
+def serve(channel):
+  request = b''
+  while b'\r\n\r\n' not in request:
+    data = channel.recv(4096)
+    if not data:
+      break
+    request += data
+  line = request.decode('latin-1').split('\r\n')[0].split(' ')
+  path = line[1] if len(line) > 1 else '/'
+  path = path[path.find('/', path.find('//') + 2):] if '//' in path else path
+
+  lock.acquire()
+  log = open(sys.argv[2], 'a')
+  log.write('%s\n' % path)
+  log.close()
+  fail = path.startswith('/fail') and path not in failed
+  failed.add(path)
+  lock.release()
+
+  time.sleep(1)
+  if not fail:
+    body = '%s\n' % path
+    response = 'HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n' \
+               'Content-Length: %d\r\n\r\n%s' % (len(body), body)
+    channel.sendall(response.encode('latin-1'))
+  channel.close()
+
+serversocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+serversocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+serversocket.bind(('', int(sys.argv[1])))
+serversocket.listen(16)
+
+while 1:
+  channel, details = serversocket.accept()
+  thread = threading.Thread(target=serve, args=(channel,))
+  thread.daemon = True
+  thread.start()
@@ -0,0 +1,320 @@
+/*
+ * freshness.c - How long a response may be served from the cache
+ *
+ * Follows RFC 9111 for a shared cache.  A response whose Cache-Control
+ * says no-store or private is not stored, nor is a partial (206) or not
+ * modified (304) one.  Otherwise it stays fresh for its s-maxage, else
+ * its max-age, else until its Expires date, less the age it already had
+ * on arrival: the larger of its Age plus the time the fetch took, and how
+ * far its Date is behind our clock.  no-cache, or an Expires that is not
+ * a date, makes it stale at once.
+ *
+ * A response that gives none of these is fresh for a tenth of the time
+ * since its Last-Modified date, up to a day, or failing that for the
+ * default lifetime set with -x; but only if its status may be cached
+ * without being told so.
+ *
+ * A response that is stale on arrival is still kept if it has a
+ * validator, ETag or Last-Modified, to make the next request for it
+ * conditional.  A 304 to that request updates the stored headers that
+ * bear on freshness (cache_expiry_update()).
+ *
+ * Past its expiry, a response may still be served for its
+ * stale-while-revalidate seconds while it is fetched again, and for its
+ * stale-if-error seconds if the origin fails (RFC 5861), both -w seconds
+ * if it does not say.  must-revalidate, proxy-revalidate, s-maxage and
+ * no-cache rule both out.
+ */
+#include "cache.h"
+#include <time.h>
+
+#define CACHE_MAXHEURISTIC 86400    /* Seconds of Last-Modified heuristic */
+#define CACHE_MAXDELTA 2147483648L  /* Largest delta-seconds, 2^31 */
+
+/* What the response's headers say about its freshness */
+typedef struct {
+    int status;
+    int validators;             /* Has ETag or Last-Modified */
+    int has_cc;                 /* Has Cache-Control */
+    int no_store;               /* no-store or private */
+    int no_cache;
+    int must_revalidate;        /* Never served stale */
+    long smaxage, maxage;       /* -1 if not given */
+    long swr, sie;              /* stale-while-revalidate, stale-if-error */
+    int has_expires;
+    long expires, date, modified, age;  /* Dates are 0 if not given */
+} fresh_info;
+
+int cache_default_ttl;          /* 0: never expire them */
+int cache_default_grace;        /* Seconds stale responses may be served */
+
+static long expiry(fresh_info *f, unsigned long cost);
+static void parse_headers(char *buf, int size, fresh_info *f);
+static long next_line(char **p, char *end, char **line);
+static void cache_control(char *value, fresh_info *f);
+static long delta_seconds(char *s);
+static long http_date(char *s);
+static int heuristic_status(int status);
+
+/*
+ * cache_expiry - Given a response fetched in cost ms, return the time()
+ *     at which it goes stale, 0 if never, or -1 if it must not be cached
+ *     or is stale already without a validator.
+ */
+long cache_expiry(char *buf, int size, unsigned long cost) {
+    fresh_info f;
+
+    parse_headers(buf, size, &f);
+    return expiry(&f, cost);
+}
+
+/*
+ * cache_expiry_update - cache_expiry() for the stored response in buf
+ *     once the 304 in update, which took cost ms, has revalidated it.
+ */
+long cache_expiry_update(char *buf, int size, char *update, int usize,
+                         unsigned long cost) {
+    fresh_info f, u;
+
+    parse_headers(buf, size, &f);
+    parse_headers(update, usize, &u);
+    if (u.has_cc) {
+        f.no_store = u.no_store;
+        f.no_cache = u.no_cache;
+        f.smaxage = u.smaxage;
+        f.maxage = u.maxage;
+    }
+    if (u.has_expires) {
+        f.has_expires = 1;
+        f.expires = u.expires;
+    }
+    if (u.modified)
+        f.modified = u.modified;
+    f.date = u.date;
+    f.age = u.age;
+    return expiry(&f, cost);
+}
+
+/*
+ * cache_validator - Point *value at the value of the header called name
+ *     in the response in buf, and return its length, or 0 if it has none.
+ */
+int cache_validator(char *buf, int size, char *name, char **value) {
+    char *p = buf, *line, *v;
+    long n;
+    int len = strlen(name);
+
+    if (size < 5 || strncmp(buf, "HTTP/", 5))
+        return 0;
+    next_line(&p, buf + size, &line);     /* The status line */
+    while ((n = next_line(&p, buf + size, &line)) >= 0)
+        if (n > len && line[len] == ':' && !strncasecmp(line, name, len)) {
+            v = line + len + 1;
+            n -= len + 1;
+            while (n > 0 && (*v == ' ' || *v == '\t'))
+                v++, n--;
+            while (n > 0 && (v[n - 1] == ' ' || v[n - 1] == '\t'))
+                n--;
+            *value = v;
+            return n;
+        }
+    return 0;
+}
+
+/*
+ * cache_grace - Set *revalidate and *error to the seconds past its
+ *     expiry the response in buf may be served while it is fetched
+ *     again, and if the origin fails.
+ */
+void cache_grace(char *buf, int size, int *revalidate, int *error) {
+    fresh_info f;
+
+    parse_headers(buf, size, &f);
+    if (f.must_revalidate || f.no_cache || f.smaxage >= 0) {
+        *revalidate = *error = 0;
+        return;
+    }
+    *revalidate = f.swr >= 0 ? f.swr : cache_default_grace;
+    *error = f.sie >= 0 ? f.sie : cache_default_grace;
+}
+
+/* How long f stays fresh, as cache_expiry() */
+static long expiry(fresh_info *f, unsigned long cost) {
+    long now = time(NULL), lifetime, base, age;
+
+    if (f->no_store || f->status < 200 || f->status == 206
+        || f->status == 304)
+        return -1;
+    base = f->date ? f->date : now;
+
+    if (f->no_cache)
+        lifetime = 0;
+    else if (f->smaxage >= 0)
+        lifetime = f->smaxage;
+    else if (f->maxage >= 0)
+        lifetime = f->maxage;
+    else if (f->has_expires)
+        lifetime = f->expires ? f->expires - base : 0;
+    else if (!heuristic_status(f->status))
+        return -1;
+    else if (f->modified && f->modified < base) {
+        lifetime = (base - f->modified) / 10;
+        if (lifetime > CACHE_MAXHEURISTIC)
+            lifetime = CACHE_MAXHEURISTIC;
+    } else if (cache_default_ttl == 0)
+        return 0;
+    else
+        lifetime = cache_default_ttl;
+
+    /* Its age on arrival */
+    age = f->age + (long)(cost / 1000);
+    if (f->date && now - f->date > age)
+        age = now - f->date;
+    if (lifetime <= age)
+        return f->validators ? now : -1;
+    return now + lifetime - age;
+}
+
+/* ---------------- Headers ---------------- */
+static void parse_headers(char *buf, int size, fresh_info *f) {
+    char line[MAXLINE], *p = buf, *start;
+    long n;
+
+    memset(f, 0, sizeof(*f));
+    f->smaxage = f->maxage = f->swr = f->sie = -1;
+    if (size < 5 || strncmp(buf, "HTTP/", 5))
+        return;                 /* Not a response we can read */
+    while ((n = next_line(&p, buf + size, &start)) >= 0) {
+        if (n >= MAXLINE)
+            continue;
+        memcpy(line, start, n);
+        line[n] = '\0';
+
+        if (start == buf)
+            sscanf(line, "HTTP/%*s %d", &f->status);
+        else if (!strncasecmp(line, "Cache-Control:", 14)) {
+            f->has_cc = 1;
+            cache_control(line + 14, f);
+        } else if (!strncasecmp(line, "ETag:", 5))
+            f->validators = 1;
+        else if (!strncasecmp(line, "Expires:", 8)) {
+            f->has_expires = 1;
+            f->expires = http_date(line + 8);
+        } else if (!strncasecmp(line, "Date:", 5))
+            f->date = http_date(line + 5);
+        else if (!strncasecmp(line, "Last-Modified:", 14)) {
+            f->validators = 1;
+            f->modified = http_date(line + 14);
+        }
+        else if (!strncasecmp(line, "Age:", 4))
+            f->age = delta_seconds(line + 4);
+    }
+}
+
+/*
+ * next_line - Point *line at the header line at *p, in a response that
+ *     ends at end, and step *p past it. Returns its length less the line
+ *     ending, or -1 at the blank line that ends the headers.
+ */
+static long next_line(char **p, char *end, char **line) {
+    char *eol;
+    long n;
+
+    if (*p >= end || (eol = memchr(*p, '\n', end - *p)) == NULL)
+        return -1;
+    n = eol - *p;
+    if (n > 0 && (*p)[n - 1] == '\r')
+        n--;
+    *line = *p;
+    *p = eol + 1;
+    return n == 0 ? -1 : n;
+}
+
+/* Note the directives in a Cache-Control value */
+static void cache_control(char *value, fresh_info *f) {
+    char *tok, *save;
+
+    for (tok = strtok_r(value, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        tok += strspn(tok, " \t");
+        /* private="field" forbids less, but is rare enough to treat alike */
+        if (!strncasecmp(tok, "no-store", 8)
+            || !strncasecmp(tok, "private", 7))
+            f->no_store = 1;
+        else if (!strncasecmp(tok, "no-cache", 8))
+            f->no_cache = 1;
+        else if (!strncasecmp(tok, "must-revalidate", 15)
+                 || !strncasecmp(tok, "proxy-revalidate", 16))
+            f->must_revalidate = 1;
+        else if (!strncasecmp(tok, "stale-while-revalidate=", 23))
+            f->swr = delta_seconds(tok + 23);
+        else if (!strncasecmp(tok, "stale-if-error=", 15))
+            f->sie = delta_seconds(tok + 15);
+        else if (!strncasecmp(tok, "s-maxage=", 9))
+            f->smaxage = delta_seconds(tok + 9);
+        else if (!strncasecmp(tok, "max-age=", 8))
+            f->maxage = delta_seconds(tok + 8);
+    }
+}
+
+/*
+ * A number of seconds, maybe quoted; 0 if it is not one, signed ones
+ * included. Larger ones are taken as CACHE_MAXDELTA (RFC 9111 1.2.2).
+ */
+static long delta_seconds(char *s) {
+    long n = 0;
+
+    s += strspn(s, " \t\"");
+    while (isdigit((unsigned char)*s) && n < CACHE_MAXDELTA)
+        n = n * 10 + (*s++ - '0');
+    return n < CACHE_MAXDELTA ? n : CACHE_MAXDELTA;
+}
+
+/*
+ * http_date - Seconds since the epoch for an HTTP-date, in any of its
+ *     three forms, or 0 if s is not one:
+ *         Sun, 06 Nov 1994 08:49:37 GMT
+ *         Sunday, 06-Nov-94 08:49:37 GMT
+ *         Sun Nov  6 08:49:37 1994
+ */
+static long http_date(char *s) {
+    static char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    char mon[4], *comma, *m;
+    int year;
+    time_t t;
+
+    memset(&tm, 0, sizeof(tm));
+    s += strspn(s, " \t");
+    if ((comma = strchr(s, ',')) != NULL) {
+        if (sscanf(comma + 1, " %d %3s %d %d:%d:%d", &tm.tm_mday, mon, &year,
+                   &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6
+            && sscanf(comma + 1, " %d-%3s-%d %d:%d:%d", &tm.tm_mday, mon,
+                      &year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+            return 0;
+    } else if (sscanf(s, "%*s %3s %d %d:%d:%d %d", mon, &tm.tm_mday,
+                      &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &year) != 6)
+        return 0;
+
+    if (strlen(mon) != 3 || (m = strstr(months, mon)) == NULL
+        || (m - months) % 3 != 0)
+        return 0;
+    if (year < 100)             /* RFC 850's two digits */
+        year += year < 70 ? 2000 : 1900;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year = year - 1900;
+    if ((t = timegm(&tm)) <= 0)
+        return 0;
+    return t;
+}
+
+/* Statuses that may be cached without an explicit lifetime */
+static int heuristic_status(int status) {
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
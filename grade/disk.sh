@@ -0,0 +1,303 @@
+#!/bin/bash
+#
+# driver.sh - This is a simple autograder for the Proxy Lab. It does
+#     basic sanity checks that determine whether or not the code
+#     behaves like a concurrent caching proxy. 
+#
+#     David O'Hallaron, Carnegie Mellon University
+#     updated: 2/8/2016
+# 
+#     usage: ./driver.sh
+# 
+
+# Point values
+MAX_BASIC=40
+MAX_CONCURRENCY=15
+MAX_CACHE=15
+
+# Various constants
+HOME_DIR=`pwd`
+PROXY_DIR="./.proxy"
+NOPROXY_DIR="./.noproxy"
+TIMEOUT=5
+MAX_RAND=63000
+PORT_START=1024
+PORT_MAX=65000
+MAX_PORT_TRIES=10
+
+# List of text and binary files for the basic test
+BASIC_LIST="home.html
+            csapp.c
+            tiny.c
+            godzilla.jpg
+            tiny"
+
+# List of text files for the cache test
+CACHE_LIST="tiny.c
+            home.html
+            csapp.c"
+
+# The file we will fetch for various tests
+FETCH_FILE="home.html"
+
+#####
+# Helper functions
+#
+
+#
+# download_proxy - download a file from the origin server via the proxy
+# usage: download_proxy <testdir> <filename> <origin_url> <proxy_url>
+#
+function download_proxy {
+    cd $1
+    curl --max-time ${TIMEOUT} --silent --proxy $4 --output $2 $3
+    (( $? == 28 )) && echo "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# download_noproxy - download a file directly from the origin server
+# usage: download_noproxy <testdir> <filename> <origin_url>
+#
+function download_noproxy {
+    cd $1
+    curl --max-time ${TIMEOUT} --silent --output $2 $3 
+    (( $? == 28 )) && echo "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# clear_dirs - Clear the download directories
+#
+function clear_dirs {
+    rm -rf ${PROXY_DIR}/*
+    rm -rf ${NOPROXY_DIR}/*
+}
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Times out after 5 seconds.
+#
+function wait_for_port_use() {
+    timeout_count="0"
+    portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+    echo "${portsinuse}" | grep -wq "${1}"
+    while [ "$?" != "0" ]
+    do
+        timeout_count=`expr ${timeout_count} + 1`
+        if [ "${timeout_count}" == "${MAX_PORT_TRIES}" ]; then
+            kill -ALRM $$
+        fi
+
+        sleep 1
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+        echo "${portsinuse}" | grep -wq "${1}"
+    done
+}
+
+
+#
+# free_port - returns an available unused TCP port 
+#
+function free_port {
+    # Generate a random port in the range [PORT_START,
+    # PORT_START+MAX_RAND]. This is needed to avoid collisions when many
+    # students are running the driver on the same machine.
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ] 
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+
+#######
+# Main 
+#######
+
+######
+# Verify that we have all of the expected files with the right
+# permissions
+#
+
+# Kill any stray proxies or tiny servers owned by this user
+killall -q proxy tiny nop-server.py 2> /dev/null
+
+cd tiny/
+make clean
+make
+cd ..
+
+make clean
+make
+
+chmod +x proxy
+chmod +x nop-server.py
+chmod +x port-for-user.pl
+chmod +x tiny/tiny
+chmod +x free-port.sh
+
+# Make sure we have a Tiny directory
+if [ ! -d ./tiny ]
+then 
+    echo "Error: ./tiny directory not found."
+    exit
+fi
+
+# If there is no Tiny executable, then try to build it
+if [ ! -x ./tiny/tiny ]
+then 
+    echo "Building the tiny executable."
+    (cd ./tiny; make)
+    echo ""
+fi
+
+# Make sure we have all the Tiny files we need
+if [ ! -x ./tiny/tiny ]
+then 
+    echo "Error: ./tiny/tiny not found or not an executable file."
+    exit
+fi
+for file in ${BASIC_LIST}
+do
+    if [ ! -e ./tiny/${file} ]
+    then
+        echo "Error: ./tiny/${file} not found."
+        exit
+    fi
+done
+
+# Make sure we have an existing executable proxy
+if [ ! -x ./proxy ]
+then 
+    echo "Error: ./proxy not found or not an executable file. Please rebuild your proxy and try again."
+    exit
+fi
+
+# Make sure we have an existing executable nop-server.py file
+if [ ! -x ./nop-server.py ]
+then 
+    echo "Error: ./nop-server.py not found or not an executable file."
+    exit
+fi
+
+# Create the test directories if needed
+if [ ! -d ${PROXY_DIR} ]
+then
+    mkdir ${PROXY_DIR}
+fi
+
+if [ ! -d ${NOPROXY_DIR} ]
+then
+    mkdir ${NOPROXY_DIR}
+fi
+# Add a handler to generate a meaningful timeout message
+trap 'echo "Timeout waiting for the server to grab the port reserved for it"; kill $$' ALRM
+
+#####
+# Disk tier: objects evicted from memory, and one too large for it, are
+# still served from the proxy's disk cache once Tiny is gone
+#
+NUM_OBJS=12     # 97000 bytes each: more than the memory cache holds
+DISK_FILES="large.bin"
+for i in `seq 1 ${NUM_OBJS}`
+do
+    DISK_FILES="${DISK_FILES} obj${i}.bin"
+done
+DISK_DIR=`mktemp -d`
+
+echo ""
+echo "*** Disk tier ***"
+
+exit_code=0
+
+# Make the objects
+head -c 3000000 /dev/urandom > ./tiny/large.bin
+for i in `seq 1 ${NUM_OBJS}`
+do
+    head -c 97000 /dev/urandom > ./tiny/obj${i}.bin
+done
+
+# Run the Tiny Web server
+tiny_port=$(free_port)
+echo "Starting tiny on port ${tiny_port}"
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+
+# Wait for tiny to start in earnest
+wait_for_port_use "${tiny_port}"
+
+# Run the proxy
+proxy_port=$(free_port)
+echo "Starting proxy on port ${proxy_port} with -o ${DISK_DIR}"
+./proxy ${proxy_port} -o ${DISK_DIR} -O 16 &> /dev/null &
+proxy_pid=$!
+
+# Wait for the proxy to start in earnest
+wait_for_port_use "${proxy_port}"
+
+# Fetch the objects from tiny using the proxy
+clear_dirs
+for file in ${DISK_FILES}
+do
+    echo "Fetching ./tiny/${file} into ${PROXY_DIR} using the proxy"
+    download_proxy $PROXY_DIR ${file} "http://localhost:${tiny_port}/${file}" "http://localhost:${proxy_port}"
+done
+
+# Kill Tiny
+echo "Killing tiny"
+kill $tiny_pid 2> /dev/null
+wait $tiny_pid 2> /dev/null
+
+# Now fetch them all again, from memory or disk
+numRun=0
+numSucceeded=0
+for file in ${DISK_FILES}
+do
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: Fetching a cached copy of ./tiny/${file} into ${NOPROXY_DIR}"
+    download_proxy $NOPROXY_DIR ${file} "http://localhost:${tiny_port}/${file}" "http://localhost:${proxy_port}"
+    diff -q ./tiny/${file} ${NOPROXY_DIR}/${file} &> /dev/null
+    if [ $? -eq 0 ]; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: Fetched tiny/${file} from the cache."
+    else
+        echo "   Failure: Was not able to fetch tiny/${file} from the cache."
+        exit_code=11
+    fi
+done
+
+# Kill the proxy
+echo "Killing proxy"
+kill $proxy_pid 2> /dev/null
+wait $proxy_pid 2> /dev/null
+
+rm -f ./tiny/large.bin ./tiny/obj*.bin
+rm -rf ${DISK_DIR}
+
+echo "diskScore: ${numSucceeded}/${numRun}"
+
+exit ${exit_code}
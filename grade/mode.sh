@@ -0,0 +1,473 @@
+#!/bin/bash
+#
+# driver.sh - This is a simple autograder for the Proxy Lab. It does
+#     basic sanity checks that determine whether or not the code
+#     behaves like a concurrent caching proxy. 
+#
+#     David O'Hallaron, Carnegie Mellon University
+#     updated: 2/8/2016
+# 
+#     usage: ./driver.sh
+# 
+
+# Point values
+MAX_BASIC=40
+MAX_CONCURRENCY=15
+MAX_CACHE=15
+
+# Various constants
+HOME_DIR=`pwd`
+PROXY_DIR="./.proxy"
+NOPROXY_DIR="./.noproxy"
+TIMEOUT=5
+MAX_RAND=63000
+PORT_START=1024
+PORT_MAX=65000
+MAX_PORT_TRIES=10
+
+# List of text and binary files for the basic test
+BASIC_LIST="home.html
+            csapp.c
+            tiny.c
+            godzilla.jpg
+            tiny"
+
+# List of text files for the cache test
+CACHE_LIST="tiny.c
+            home.html
+            csapp.c"
+
+# The file we will fetch for various tests
+FETCH_FILE="home.html"
+
+#####
+# Helper functions
+#
+
+#
+# download_proxy - download a file from the origin server via the proxy
+# usage: download_proxy <testdir> <filename> <origin_url> <proxy_url>
+#
+function download_proxy {
+    cd $1
+    curl --max-time ${TIMEOUT} --silent --proxy $4 --output $2 $3
+    (( $? == 28 )) && echo "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# download_noproxy - download a file directly from the origin server
+# usage: download_noproxy <testdir> <filename> <origin_url>
+#
+function download_noproxy {
+    cd $1
+    curl --max-time ${TIMEOUT} --silent --output $2 $3 
+    (( $? == 28 )) && echo "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# clear_dirs - Clear the download directories
+#
+function clear_dirs {
+    rm -rf ${PROXY_DIR}/*
+    rm -rf ${NOPROXY_DIR}/*
+}
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Times out after 5 seconds.
+#
+function wait_for_port_use() {
+    timeout_count="0"
+    portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+    echo "${portsinuse}" | grep -wq "${1}"
+    while [ "$?" != "0" ]
+    do
+        timeout_count=`expr ${timeout_count} + 1`
+        if [ "${timeout_count}" == "${MAX_PORT_TRIES}" ]; then
+            kill -ALRM $$
+        fi
+
+        sleep 1
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+        echo "${portsinuse}" | grep -wq "${1}"
+    done
+}
+
+
+#
+# free_port - returns an available unused TCP port 
+#
+function free_port {
+    # Generate a random port in the range [PORT_START,
+    # PORT_START+MAX_RAND]. This is needed to avoid collisions when many
+    # students are running the driver on the same machine.
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ] 
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+
+#######
+# Main 
+#######
+
+######
+# Verify that we have all of the expected files with the right
+# permissions
+#
+
+# Kill any stray proxies or tiny servers owned by this user
+killall -q proxy tiny nop-server.py 2> /dev/null
+
+cd tiny/
+make clean
+make
+cd ..
+
+make clean
+make
+
+chmod +x proxy
+chmod +x nop-server.py
+chmod +x port-for-user.pl
+chmod +x tiny/tiny
+chmod +x free-port.sh
+
+# Make sure we have a Tiny directory
+if [ ! -d ./tiny ]
+then 
+    echo "Error: ./tiny directory not found."
+    exit
+fi
+
+# If there is no Tiny executable, then try to build it
+if [ ! -x ./tiny/tiny ]
+then 
+    echo "Building the tiny executable."
+    (cd ./tiny; make)
+    echo ""
+fi
+
+# Make sure we have all the Tiny files we need
+if [ ! -x ./tiny/tiny ]
+then 
+    echo "Error: ./tiny/tiny not found or not an executable file."
+    exit
+fi
+for file in ${BASIC_LIST}
+do
+    if [ ! -e ./tiny/${file} ]
+    then
+        echo "Error: ./tiny/${file} not found."
+        exit
+    fi
+done
+
+# Make sure we have an existing executable proxy
+if [ ! -x ./proxy ]
+then 
+    echo "Error: ./proxy not found or not an executable file. Please rebuild your proxy and try again."
+    exit
+fi
+
+# Make sure we have an existing executable nop-server.py file
+if [ ! -x ./nop-server.py ]
+then 
+    echo "Error: ./nop-server.py not found or not an executable file."
+    exit
+fi
+
+# Create the test directories if needed
+if [ ! -d ${PROXY_DIR} ]
+then
+    mkdir ${PROXY_DIR}
+fi
+
+if [ ! -d ${NOPROXY_DIR} ]
+then
+    mkdir ${NOPROXY_DIR}
+fi
+
+# Add a handler to generate a meaningful timeout message
+trap 'echo "Timeout waiting for the server to grab the port reserved for it"; kill $$' ALRM
+
+#####
+# Server modes: for each mode named on the command line (all of them by
+# default), the basic, concurrency and cache checks against one proxy
+# started with the mode's arguments, and a check of what the mode is for
+#
+# usage: grade/mode.sh [epoll|pool|shard|uring|coro|keepalive ...]
+#
+MODES=${*:-"epoll pool shard uring coro keepalive"}
+ORIGIN_LOG=`mktemp`
+PROXY_LOG=`mktemp`
+
+#
+# mode_args - Print the proxy's arguments for a mode
+# usage: mode_args <mode>
+#
+function mode_args {
+    case $1 in
+        epoll|uring|coro) echo "-m $1 -n 2" ;;
+        pool)             echo "-m pool -n 4 -q 2" ;;
+        shard)            echo "-m shard -n 2 -q 4" ;;
+        keepalive)        echo "-m pool -n 4 -k 4 -K 2" ;;
+    esac
+}
+
+#
+# check_threads - Hold ten requests on the blocking nop-server and check
+#     that the proxy serves tiny meanwhile without starting any thread
+#
+function check_threads {
+    local threads i
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: Holding 10 requests on the nop-server"
+    threads=`grep Threads /proc/${proxy_pid}/status`
+    for i in `seq 1 10`
+    do
+        curl --max-time ${TIMEOUT} --silent --output /dev/null --proxy http://localhost:${proxy_port} http://localhost:${nop_port}/nop-$i.txt &
+    done
+    sleep 1
+    clear_dirs
+    download_proxy $PROXY_DIR ${FETCH_FILE} "http://localhost:${tiny_port}/${FETCH_FILE}" "http://localhost:${proxy_port}"
+    if [ "`grep Threads /proc/${proxy_pid}/status`" != "${threads}" ]; then
+        echo "   Failure: The proxy started threads for them."
+        exit_code=11
+    elif ! diff -q ./tiny/${FETCH_FILE} ${PROXY_DIR}/${FETCH_FILE} &> /dev/null; then
+        echo "   Failure: Could not fetch ./tiny/${FETCH_FILE} meanwhile."
+        exit_code=11
+    else
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: Served on the same threads."
+    fi
+}
+
+#
+# check_queue - Fill the queue of a proxy with one worker and a queue of
+#     one, and check that SIGUSR1 reports the accept thread waited
+#
+function check_queue {
+    local port pid pids i
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: Filling the queue of a proxy started with -n 1 -q 1"
+    port=$(free_port)
+    ./proxy ${port} -m pool -n 1 -q 1 -f 2 > ${PROXY_LOG} 2> /dev/null &
+    pid=$!
+    wait_for_port_use "${port}"
+
+    # The worker waits on the nop-server until the 504, the next
+    # connection fills the queue and the one after waits for room
+    curl --max-time ${TIMEOUT} --silent --output /dev/null --proxy http://localhost:${port} http://localhost:${nop_port}/nop-file.txt &
+    pids=$!
+    sleep 0.5
+    clear_dirs
+    for i in 1 2 3
+    do
+        curl --max-time ${TIMEOUT} --silent --output ${PROXY_DIR}/$i --proxy http://localhost:${port} http://localhost:${tiny_port}/${FETCH_FILE} &
+        pids="${pids} $!"
+    done
+    wait ${pids}
+    kill -USR1 ${pid}
+    sleep 0.5
+    kill ${pid} 2> /dev/null
+    wait ${pid} 2> /dev/null
+
+    if ! grep -q "full [1-9]" ${PROXY_LOG}; then
+        echo "   Failure: No full queue reported: `grep full ${PROXY_LOG}`"
+        exit_code=11
+    elif ! cat ${PROXY_DIR}/1 ${PROXY_DIR}/2 ${PROXY_DIR}/3 | cmp -s - <(cat ./tiny/${FETCH_FILE} ./tiny/${FETCH_FILE} ./tiny/${FETCH_FILE}); then
+        echo "   Failure: The queued requests were not served."
+        exit_code=11
+    else
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: `grep full ${PROXY_LOG}`"
+    fi
+}
+
+#
+# check_listeners - Check that the proxy listens on its port once per
+#     CPU we may run on
+#
+function check_listeners {
+    local listeners
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: Counting the listeners on port ${proxy_port}"
+    listeners=`cat /proc/net/tcp /proc/net/tcp6 2> /dev/null \
+        | awk -v port=$(printf ":%04X" ${proxy_port}) '$2 ~ port"$" && $4 == "0A"' \
+        | wc -l`
+    if [ "${listeners}" -eq "`nproc`" ]; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: ${listeners} listeners for `nproc` CPUs."
+    else
+        echo "   Failure: ${listeners} listeners for `nproc` CPUs."
+        exit_code=11
+    fi
+}
+
+#
+# check_reuse - Fetch five objects from an HTTP/1.1 origin one after
+#     the other, and check that they all came over one connection
+#
+function check_reuse {
+    local origin_port origin_pid i accepts
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: Fetching 5 objects from a keep-alive origin"
+    > ${ORIGIN_LOG}
+    origin_port=$(free_port)
+    python keepalive-server.py ${origin_port} ${ORIGIN_LOG} &> /dev/null &
+    origin_pid=$!
+    wait_for_port_use "${origin_port}"
+
+    clear_dirs
+    for i in 1 2 3 4 5
+    do
+        download_proxy $PROXY_DIR $i "http://localhost:${origin_port}/$i" "http://localhost:${proxy_port}"
+        echo "/$i" | diff -q - ${PROXY_DIR}/$i &> /dev/null || accepts=bad
+    done
+    kill $origin_pid 2> /dev/null
+    wait $origin_pid 2> /dev/null
+
+    if [ "${accepts}" == "bad" ]; then
+        echo "   Failure: Wrong objects."
+        exit_code=11
+    elif [ "`wc -l < ${ORIGIN_LOG}`" -ne 1 ]; then
+        echo "   Failure: The origin accepted `wc -l < ${ORIGIN_LOG}` connections."
+        exit_code=11
+    else
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: The origin accepted one connection."
+    fi
+}
+
+exit_code=0
+numRun=0
+numSucceeded=0
+
+for mode in ${MODES}; do
+
+PROXY_ARGS=`mode_args ${mode}`
+echo ""
+echo "*** Mode ${mode}: ${PROXY_ARGS} ***"
+
+# Run the Tiny Web server
+tiny_port=$(free_port)
+echo "Starting tiny on port ${tiny_port}"
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+
+# Wait for tiny to start in earnest
+wait_for_port_use "${tiny_port}"
+
+# Run the proxy
+proxy_port=$(free_port)
+echo "Starting proxy on port ${proxy_port}"
+./proxy ${proxy_port} ${PROXY_ARGS} &> /dev/null &
+proxy_pid=$!
+
+# Wait for the proxy to start in earnest
+wait_for_port_use "${proxy_port}"
+
+# Run a special blocking nop-server that never responds to requests
+nop_port=$(free_port)
+echo "Starting the blocking NOP server on port ${nop_port}"
+python nop-server.py ${nop_port} &> /dev/null &
+nop_pid=$!
+
+# Wait for the nop server to start in earnest
+wait_for_port_use "${nop_port}"
+
+# Leave a request hanging on the nop-server for the whole test
+clear_dirs
+echo "Trying to fetch a file from the blocking nop-server"
+download_proxy $PROXY_DIR "nop-file.txt" "http://localhost:${nop_port}/nop-file.txt" "http://localhost:${proxy_port}" &
+hang_pid=$!
+
+for file in ${BASIC_LIST}
+do
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: ${file}"
+
+    echo "   Fetching ./tiny/${file} into ${PROXY_DIR} using the proxy"
+    download_proxy $PROXY_DIR ${file} "http://localhost:${tiny_port}/${file}" "http://localhost:${proxy_port}"
+
+    echo "   Fetching ./tiny/${file} into ${NOPROXY_DIR} directly from Tiny"
+    download_noproxy $NOPROXY_DIR ${file} "http://localhost:${tiny_port}/${file}"
+
+    echo "   Comparing the two files"
+    diff -q ${PROXY_DIR}/${file} ${NOPROXY_DIR}/${file} &> /dev/null
+    if [ $? -eq 0 ]; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: Files are identical."
+    else
+        echo "   Failure: Files differ."
+        exit_code=11
+    fi
+done
+
+# What the mode is for
+case ${mode} in
+    epoll|uring|coro) check_threads ;;
+    pool)             check_queue ;;
+    shard)            check_listeners ;;
+    keepalive)        check_reuse ;;
+esac
+
+# Kill Tiny, then fetch a cached copy
+echo "Killing tiny"
+kill $tiny_pid 2> /dev/null
+wait $tiny_pid 2> /dev/null
+
+clear_dirs
+echo "Fetching a cached copy of ./tiny/${FETCH_FILE} into ${NOPROXY_DIR}"
+download_proxy $NOPROXY_DIR ${FETCH_FILE} "http://localhost:${tiny_port}/${FETCH_FILE}" "http://localhost:${proxy_port}"
+numRun=`expr $numRun + 1`
+diff -q ./tiny/${FETCH_FILE} ${NOPROXY_DIR}/${FETCH_FILE}  &> /dev/null
+if [ $? -eq 0 ]; then
+    numSucceeded=`expr ${numSucceeded} + 1`
+    echo "Success: Was able to fetch tiny/${FETCH_FILE} from the cache."
+else
+    echo "Failure: Was not able to fetch tiny/${FETCH_FILE} from the proxy cache."
+    exit_code=11
+fi
+
+# Clean up
+echo "Killing proxy and nop-server"
+kill $proxy_pid 2> /dev/null
+wait $proxy_pid 2> /dev/null
+kill $nop_pid 2> /dev/null
+wait $nop_pid 2> /dev/null
+wait $hang_pid 2> /dev/null
+done
+
+rm -f ${ORIGIN_LOG} ${PROXY_LOG}
+echo "modeScore: ${numSucceeded}/${numRun}"
+
+exit ${exit_code}
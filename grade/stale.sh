@@ -0,0 +1,332 @@
+#!/bin/bash
+#
+# driver.sh - This is a simple autograder for the Proxy Lab. It does
+#     basic sanity checks that determine whether or not the code
+#     behaves like a concurrent caching proxy. 
+#
+#     David O'Hallaron, Carnegie Mellon University
+#     updated: 2/8/2016
+# 
+#     usage: ./driver.sh
+# 
+
+# Point values
+MAX_BASIC=40
+MAX_CONCURRENCY=15
+MAX_CACHE=15
+
+# Various constants
+HOME_DIR=`pwd`
+PROXY_DIR="./.proxy"
+NOPROXY_DIR="./.noproxy"
+TIMEOUT=5
+MAX_RAND=63000
+PORT_START=1024
+PORT_MAX=65000
+MAX_PORT_TRIES=10
+
+# List of text and binary files for the basic test
+BASIC_LIST="home.html
+            csapp.c
+            tiny.c
+            godzilla.jpg
+            tiny"
+
+# List of text files for the cache test
+CACHE_LIST="tiny.c
+            home.html
+            csapp.c"
+
+# The file we will fetch for various tests
+FETCH_FILE="home.html"
+
+#####
+# Helper functions
+#
+
+#
+# download_proxy - download a file from the origin server via the proxy
+# usage: download_proxy <testdir> <filename> <origin_url> <proxy_url>
+#
+function download_proxy {
+    cd $1
+    curl --max-time ${TIMEOUT} --silent --proxy $4 --output $2 $3
+    (( $? == 28 )) && echo "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# download_noproxy - download a file directly from the origin server
+# usage: download_noproxy <testdir> <filename> <origin_url>
+#
+function download_noproxy {
+    cd $1
+    curl --max-time ${TIMEOUT} --silent --output $2 $3 
+    (( $? == 28 )) && echo "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# clear_dirs - Clear the download directories
+#
+function clear_dirs {
+    rm -rf ${PROXY_DIR}/*
+    rm -rf ${NOPROXY_DIR}/*
+}
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Times out after 5 seconds.
+#
+function wait_for_port_use() {
+    timeout_count="0"
+    portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+    echo "${portsinuse}" | grep -wq "${1}"
+    while [ "$?" != "0" ]
+    do
+        timeout_count=`expr ${timeout_count} + 1`
+        if [ "${timeout_count}" == "${MAX_PORT_TRIES}" ]; then
+            kill -ALRM $$
+        fi
+
+        sleep 1
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+        echo "${portsinuse}" | grep -wq "${1}"
+    done
+}
+
+
+#
+# free_port - returns an available unused TCP port 
+#
+function free_port {
+    # Generate a random port in the range [PORT_START,
+    # PORT_START+MAX_RAND]. This is needed to avoid collisions when many
+    # students are running the driver on the same machine.
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ] 
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+
+#######
+# Main 
+#######
+
+######
+# Verify that we have all of the expected files with the right
+# permissions
+#
+
+# Kill any stray proxies or tiny servers owned by this user
+killall -q proxy tiny nop-server.py 2> /dev/null
+
+cd tiny/
+make clean
+make
+cd ..
+
+make clean
+make
+
+chmod +x proxy
+chmod +x nop-server.py
+chmod +x port-for-user.pl
+chmod +x tiny/tiny
+chmod +x free-port.sh
+
+# Make sure we have a Tiny directory
+if [ ! -d ./tiny ]
+then 
+    echo "Error: ./tiny directory not found."
+    exit
+fi
+
+# If there is no Tiny executable, then try to build it
+if [ ! -x ./tiny/tiny ]
+then 
+    echo "Building the tiny executable."
+    (cd ./tiny; make)
+    echo ""
+fi
+
+# Make sure we have all the Tiny files we need
+if [ ! -x ./tiny/tiny ]
+then 
+    echo "Error: ./tiny/tiny not found or not an executable file."
+    exit
+fi
+for file in ${BASIC_LIST}
+do
+    if [ ! -e ./tiny/${file} ]
+    then
+        echo "Error: ./tiny/${file} not found."
+        exit
+    fi
+done
+
+# Make sure we have an existing executable proxy
+if [ ! -x ./proxy ]
+then 
+    echo "Error: ./proxy not found or not an executable file. Please rebuild your proxy and try again."
+    exit
+fi
+
+# Make sure we have an existing executable nop-server.py file
+if [ ! -x ./nop-server.py ]
+then 
+    echo "Error: ./nop-server.py not found or not an executable file."
+    exit
+fi
+
+# Create the test directories if needed
+if [ ! -d ${PROXY_DIR} ]
+then
+    mkdir ${PROXY_DIR}
+fi
+
+if [ ! -d ${NOPROXY_DIR} ]
+then
+    mkdir ${NOPROXY_DIR}
+fi
+# Add a handler to generate a meaningful timeout message
+trap 'echo "Timeout waiting for the server to grab the port reserved for it"; kill $$' ALRM
+
+#####
+# Serving stale: a stale copy is served at once while it is refreshed
+# (stale-while-revalidate), and in place of an origin that is down
+# (stale-if-error), unless its Cache-Control rules that out
+#
+STAMP=./tiny/cgi-bin/stamp
+
+#
+# fetch - Print the stamp, fetched with Cache-Control: <query> via the
+#     proxy on <port>
+# usage: fetch <query> <port>
+#
+function fetch {
+    curl --max-time ${TIMEOUT} --silent --proxy http://localhost:$2 "http://localhost:${tiny_port}/cgi-bin/stamp?$1"
+}
+
+#
+# check - Record a check passed if <test> is true
+# usage: check <message> <test...>
+#
+function check {
+    local msg=$1
+    shift
+    numRun=`expr $numRun + 1`
+    echo "${numRun}: ${msg}"
+    if "$@"; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success"
+    else
+        echo "   Failure"
+        exit_code=11
+    fi
+}
+
+echo ""
+echo "*** Serving stale ***"
+
+exit_code=0
+
+# A CGI program that sends its query as Cache-Control, and a new body
+# every time
+cat > ${STAMP} <<'STAMP_EOF'
+#!/bin/sh
+printf 'Cache-Control: %s\r\n' "$QUERY_STRING"
+printf 'Content-type: text/plain\r\n\r\n'
+date +%s%N
+STAMP_EOF
+chmod +x ${STAMP}
+
+# Run the Tiny Web server
+tiny_port=$(free_port)
+echo "Starting tiny on port ${tiny_port}"
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use "${tiny_port}"
+
+# Run two proxies, the second giving every response 30 seconds' grace
+proxy_port=$(free_port)
+echo "Starting proxy on port ${proxy_port}"
+./proxy ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use "${proxy_port}"
+grace_port=$(free_port)
+echo "Starting proxy on port ${grace_port} with -w 30"
+./proxy ${grace_port} -w 30 &> /dev/null &
+grace_pid=$!
+wait_for_port_use "${grace_port}"
+
+numRun=0
+numSucceeded=0
+
+SWR="max-age=1,stale-while-revalidate=30"
+first=`fetch ${SWR} ${proxy_port}`
+sleep 2
+second=`fetch ${SWR} ${proxy_port}`
+sleep 1
+third=`fetch ${SWR} ${proxy_port}`
+check "${SWR}: the stale copy is served once" \
+    [ -n "${first}" -a "${first}" == "${second}" ]
+check "${SWR}: then the refreshed one" \
+    [ -n "${third}" -a "${third}" != "${first}" ]
+
+# Cache copies, then take the origin away once they are stale
+SIE="max-age=1,stale-if-error=30"
+MUST="max-age=1,stale-if-error=30,must-revalidate"
+sie=`fetch ${SIE} ${proxy_port}`
+must=`fetch ${MUST} ${proxy_port}`
+plain=`fetch max-age=1 ${proxy_port}`
+grace=`fetch max-age=1 ${grace_port}`
+echo "Killing tiny"
+kill $tiny_pid 2> /dev/null
+wait $tiny_pid 2> /dev/null
+sleep 2
+
+check "${SIE}: the stale copy stands in for the origin" \
+    [ -n "${sie}" -a "`fetch ${SIE} ${proxy_port}`" == "${sie}" ]
+check "${MUST}: no stale copy" \
+    [ -n "${must}" -a "`fetch ${MUST} ${proxy_port}`" != "${must}" ]
+check "max-age=1: no stale copy without grace" \
+    [ -n "${plain}" -a "`fetch max-age=1 ${proxy_port}`" != "${plain}" ]
+check "max-age=1: a stale copy with -w 30" \
+    [ -n "${grace}" -a "`fetch max-age=1 ${grace_port}`" == "${grace}" ]
+
+# Kill the proxies
+echo "Killing the proxies"
+kill $proxy_pid $grace_pid 2> /dev/null
+wait $proxy_pid $grace_pid 2> /dev/null
+
+rm -f ${STAMP}
+
+echo "staleScore: ${numSucceeded}/${numRun}"
+
+exit ${exit_code}
@@ -0,0 +1,136 @@
+/*
+ * http.c - Incremental parser for request heads
+ *
+ * Parses a request head where it was read, without copying it: the
+ * method, URI, version and each header's name and value come out as
+ * spans, offsets and lengths into the head.  Offsets rather than
+ * pointers, so that the head may be moved or grown between calls.
+ *
+ * The parser works a line at a time.  http_parse() is handed everything
+ * read so far and picks up where it stopped, searching only the bytes it
+ * has not searched before for the end of the line it is on, so feeding
+ * it a head one read() at a time costs no more than handing it over
+ * whole.  doit() runs it over the Rio buffer, and the event loops over
+ * the bytes each readiness event brings in.
+ *
+ * Lines may end in CRLF or a bare LF, and empty lines before the request
+ * line are skipped (RFC 9112).  Folded header lines, whitespace before a
+ * header's colon, stray CRs and NULs are rejected, as is a head with
+ * more than HTTP_MAXHEADERS headers.  So is a request line without an
+ * HTTP-version: an HTTP/0.9 client sends no headers and no blank line,
+ * and would wait for a response while the proxy waited for the rest.
+ */
+#include "proxy.h"
+
+enum { HP_REQUEST_LINE, HP_HEADER, HP_DONE, HP_ERROR };
+
+static int request_line(http_parser *hp, char *buf, int start, int end);
+static int header_line(http_parser *hp, char *buf, int start, int end);
+
+void http_parser_init(http_parser *hp) {
+    hp->state = HP_REQUEST_LINE;
+    hp->off = 0;
+    hp->scanned = 0;
+    hp->nheaders = 0;
+}
+
+/*
+ * http_parse - Parse more of the request head in buf, of which len bytes
+ *     have been read, resuming where the last call on hp stopped. Returns
+ *     1 once it is complete, with hp->off its length, 0 if it needs more
+ *     bytes, or -1 if it is malformed.
+ */
+int http_parse(http_parser *hp, char *buf, int len) {
+    char *nl;
+    int end, rc;
+
+    while (hp->state < HP_DONE) {
+        nl = memchr(buf + hp->scanned, '\n', len - hp->scanned);
+        if (nl == NULL) {
+            hp->scanned = len;
+            return 0;
+        }
+        end = nl - buf;
+        if (end > hp->off && buf[end - 1] == '\r')
+            end--;
+        if (memchr(buf + hp->off, '\r', end - hp->off)
+            || memchr(buf + hp->off, '\0', end - hp->off))
+            rc = -1;
+        else if (hp->state == HP_REQUEST_LINE)
+            rc = request_line(hp, buf, hp->off, end);
+        else
+            rc = header_line(hp, buf, hp->off, end);
+        if (rc < 0) {
+            hp->state = HP_ERROR;
+            break;
+        }
+        hp->off = hp->scanned = nl - buf + 1;
+    }
+    return hp->state == HP_DONE ? 1 : -1;
+}
+
+/* Whether span s of buf is str, ignoring case */
+int http_span_is(char *buf, http_span s, char *str) {
+    return s.len == (int)strlen(str) && !strncasecmp(buf + s.off, str, s.len);
+}
+
+/* ---------------- Lines ---------------- */
+
+/* Method SP URI SP HTTP/x.y; empty lines before it are skipped */
+static int request_line(http_parser *hp, char *buf, int start, int end) {
+    char *sp;
+
+    if (start == end)
+        return 0;
+    if ((sp = memchr(buf + start, ' ', end - start)) == NULL
+        || sp == buf + start)
+        return -1;
+    hp->method.off = start;
+    hp->method.len = sp - buf - start;
+
+    start = sp - buf + 1;
+    if ((sp = memchr(buf + start, ' ', end - start)) == NULL
+        || sp == buf + start)
+        return -1;
+    hp->uri.off = start;
+    hp->uri.len = sp - buf - start;
+    hp->version.off = sp - buf + 1;
+    hp->version.len = end - hp->version.off;
+    sp++;
+    if (hp->version.len != 8 || strncmp(sp, "HTTP/", 5)
+        || !isdigit((unsigned char)sp[5]) || sp[6] != '.'
+        || !isdigit((unsigned char)sp[7]))
+        return -1;
+    hp->state = HP_HEADER;
+    return 0;
+}
+
+/* Name ":" OWS value OWS, or the empty line that ends the head */
+static int header_line(http_parser *hp, char *buf, int start, int end) {
+    http_header *h;
+    char *colon;
+
+    if (start == end) {
+        hp->state = HP_DONE;
+        return 0;
+    }
+    if (buf[start] == ' ' || buf[start] == '\t'     /* Obsolete folding */
+        || (colon = memchr(buf + start, ':', end - start)) == NULL
+        || colon == buf + start
+        || memchr(buf + start, ' ', colon - buf - start)
+        || memchr(buf + start, '\t', colon - buf - start)
+        || hp->nheaders == HTTP_MAXHEADERS)
+        return -1;
+
+    h = &hp->headers[hp->nheaders++];
+    h->name.off = start;
+    h->name.len = colon - buf - start;
+    start = colon - buf + 1;
+    while (start < end && (buf[start] == ' ' || buf[start] == '\t'))
+        start++;
+    while (end > start && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+        end--;
+    h->value.off = start;
+    h->value.len = end - start;
+    return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * inflight.c - Collapsed forwarding of concurrent cache misses
+ *
+ * The first request that misses on a URL becomes the leader of a fill
+ * and fetches it from the origin; requests that miss on the same URL
+ * while that fetch is in flight attach to the fill as followers instead
+ * of opening connections of their own.  The leader appends each piece
+ * of the response to the fill as it passes it on to its own client, and
+ * followers copy those bytes to their clients as soon as they arrive.
+ *
+ * The bytes are kept in fixed-size blocks that never move once written,
+ * so followers write from them without holding the lock.  Each follower
+ * waits on an eventfd of its own that the leader bumps after every
+ * append, which works for threads (poll) and coroutines (rio_wait)
+ * alike.
+ *
+ * A fill stops taking followers once it outgrows MAX_OBJECT_SIZE.  From
+ * then on it frees each block as soon as every follower has sent it on,
+ * and once none are attached it stops keeping bytes at all, so a large
+ * download costs no more memory than the slowest follower's lag.
+ */
+#include "proxy.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define FILL_BUCKETS   64
+#define FILL_BLOCKSIZE 16384
+
+typedef struct fill_block {
+    struct fill_block *next;
+    int len;
+    char data[FILL_BLOCKSIZE];
+} fill_block;
+
+typedef struct fill_waiter {
+    int efd;
+    long pos;               /* Bytes it has sent */
+    struct fill_waiter *next;
+} fill_waiter;
+
+struct fill {
+    char *url;
+    fill_block *head, *tail;
+    long len;               /* Bytes appended so far */
+    long base;              /* Offset of head's first byte */
+    int done;               /* The leader has finished */
+    int ok;                 /* ... with a complete response */
+    int dropped;            /* Bytes are no longer kept */
+    int linked;             /* In the table, taking followers */
+    int nfollowers;
+    int refcnt;             /* The leader's and followers' */
+    fill_waiter *waiters;
+    struct fill *next;
+};
+
+static struct {
+    fill_t *buckets[FILL_BUCKETS];
+    sem_t mutex;
+} inflight;
+
+fill_stats_t fill_stats;
+
+static unsigned long fill_hash(char *url);
+static fill_t *find_fill(char *url, unsigned long h);
+static fill_t *new_fill(char *url, unsigned long h);
+static void unlink_fill(fill_t *fl);
+static void wake(fill_t *fl);
+static void free_blocks(fill_t *fl);
+static void trim_blocks(fill_t *fl);
+static void put_fill(fill_t *fl);
+static int wait_waiter(fill_waiter *w);
+
+void fill_init(void) {
+    memset(inflight.buckets, 0, sizeof(inflight.buckets));
+    Sem_init(&inflight.mutex, 0, 1);
+}
+
+/*
+ * fill_join - Attach to the fill in flight for url, or start one.
+ *     Sets *leader to 1 if the caller must fetch url and feed the fill
+ *     with fill_append() and fill_finish(), or to 0 if it should stream
+ *     it with fill_follow() and drop it with fill_release().
+ */
+fill_t *fill_join(char *url, int *leader) {
+    unsigned long h = fill_hash(url);
+    fill_t *fl;
+
+    P(&inflight.mutex);
+    if ((fl = find_fill(url, h)) != NULL) {
+        fl->refcnt++;
+        fl->nfollowers++;
+        fill_stats.followers++;
+        V(&inflight.mutex);
+        *leader = 0;
+        return fl;
+    }
+    fl = new_fill(url, h);
+    V(&inflight.mutex);
+    *leader = 1;
+    return fl;
+}
+
+/*
+ * fill_lead - Start a fill for url, for the caller to lead as fill_join()
+ *     describes, or return NULL if one is in flight already.
+ */
+fill_t *fill_lead(char *url) {
+    unsigned long h = fill_hash(url);
+    fill_t *fl;
+
+    P(&inflight.mutex);
+    fl = find_fill(url, h) ? NULL : new_fill(url, h);
+    V(&inflight.mutex);
+    return fl;
+}
+
+/* Append n bytes of the leader's response and wake the followers */
+void fill_append(fill_t *fl, char *data, int n) {
+    fill_block *b;
+    int m;
+
+    P(&inflight.mutex);
+    if (fl->dropped) {
+        V(&inflight.mutex);
+        return;
+    }
+    fl->len += n;
+    while (n > 0) {
+        if ((b = fl->tail) == NULL || b->len == FILL_BLOCKSIZE) {
+            b = Malloc(sizeof(fill_block));
+            b->next = NULL;
+            b->len = 0;
+            if (fl->tail)
+                fl->tail->next = b;
+            else
+                fl->head = b;
+            fl->tail = b;
+        }
+        m = FILL_BLOCKSIZE - b->len < n ? FILL_BLOCKSIZE - b->len : n;
+        memcpy(b->data + b->len, data, m);
+        b->len += m;
+        data += m;
+        n -= m;
+    }
+
+    /* Too big to cache: later misses fetch on their own */
+    if (fl->len > MAX_OBJECT_SIZE) {
+        if (fl->linked)
+            unlink_fill(fl);
+        if (fl->nfollowers == 0) {
+            free_blocks(fl);
+            fl->dropped = 1;
+        } else
+            trim_blocks(fl);
+    }
+    wake(fl);
+    V(&inflight.mutex);
+}
+
+/* Does anyone besides the leader want the bytes? */
+int fill_followed(fill_t *fl) {
+    int n;
+
+    P(&inflight.mutex);
+    n = fl->nfollowers;
+    V(&inflight.mutex);
+    return n > 0;
+}
+
+/* The leader is done, with a complete response if ok; drops its reference */
+void fill_finish(fill_t *fl, int ok) {
+    P(&inflight.mutex);
+    if (fl->linked)
+        unlink_fill(fl);
+    fl->done = 1;
+    fl->ok = ok;
+    wake(fl);
+    put_fill(fl);
+    V(&inflight.mutex);
+}
+
+/*
+ * fill_follow - Copy the fill to connfd as the leader produces it.
+ *     Returns the number of bytes sent, or -1 if the leader failed
+ *     before producing any, in which case the caller may fetch the URL
+ *     itself. Does not drop the caller's reference.
+ */
+long fill_follow(fill_t *fl, int connfd) {
+    fill_waiter w, **pp;
+    fill_block *b = NULL;
+    int off = 0, n, done, ok, failed = 0;
+    long sent = 0;
+
+    if ((w.efd = eventfd(0, EFD_NONBLOCK)) < 0)
+        return -1;
+    w.pos = 0;
+    P(&inflight.mutex);
+    w.next = fl->waiters;
+    fl->waiters = &w;
+    V(&inflight.mutex);
+
+    while (1) {
+        P(&inflight.mutex);
+        w.pos = sent;
+        if (b == NULL)
+            b = fl->head;
+        while (b && off == b->len && b->next) {
+            b = b->next;
+            off = 0;
+        }
+        n = b ? b->len - off : 0;
+        done = fl->done;
+        V(&inflight.mutex);
+
+        if (n > 0) {
+            if (rio_writen(connfd, b->data + off, n) != n) {
+                failed = 1;
+                break;
+            }
+            off += n;
+            sent += n;
+        } else if (done)
+            break;
+        else if (wait_waiter(&w) < 0) {
+            failed = 1;
+            break;
+        }
+    }
+
+    P(&inflight.mutex);
+    for (pp = &fl->waiters; *pp != &w; pp = &(*pp)->next)
+        ;
+    *pp = w.next;
+    fl->nfollowers--;
+    ok = fl->ok;
+    V(&inflight.mutex);
+    close(w.efd);
+    return (!failed && sent == 0 && !ok) ? -1 : sent;
+}
+
+/* Drop a follower's reference */
+void fill_release(fill_t *fl) {
+    P(&inflight.mutex);
+    put_fill(fl);
+    V(&inflight.mutex);
+}
+
+/* ---------------- Helpers ---------------- */
+static unsigned long fill_hash(char *url) {
+    unsigned long h = 5381;
+
+    while (*url)
+        h = h * 33 + (unsigned char)*url++;
+    return h % FILL_BUCKETS;
+}
+
+/* The fill in flight for url, if any; call with the mutex held */
+static fill_t *find_fill(char *url, unsigned long h) {
+    fill_t *fl;
+
+    for (fl = inflight.buckets[h]; fl; fl = fl->next)
+        if (!strcmp(fl->url, url))
+            return fl;
+    return NULL;
+}
+
+/* Start a fill for url, with the caller as leader, under the mutex */
+static fill_t *new_fill(char *url, unsigned long h) {
+    fill_t *fl;
+
+    fill_stats.leaders++;
+    fl = Calloc(1, sizeof(fill_t));
+    fl->url = Malloc(strlen(url) + 1);
+    strcpy(fl->url, url);
+    fl->refcnt = 1;
+    fl->linked = 1;
+    fl->next = inflight.buckets[h];
+    inflight.buckets[h] = fl;
+    return fl;
+}
+
+/* Take fl out of the table; caller holds inflight.mutex */
+static void unlink_fill(fill_t *fl) {
+    fill_t **pp;
+
+    for (pp = &inflight.buckets[fill_hash(fl->url)]; *pp != fl;
+         pp = &(*pp)->next)
+        ;
+    *pp = fl->next;
+    fl->linked = 0;
+}
+
+static void wake(fill_t *fl) {
+    fill_waiter *w;
+    uint64_t one = 1;
+
+    for (w = fl->waiters; w; w = w->next)
+        if (write(w->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            unix_error("eventfd write error");
+}
+
+static void free_blocks(fill_t *fl) {
+    fill_block *b, *next;
+
+    for (b = fl->head; b; b = next) {
+        next = b->next;
+        Free(b);
+    }
+    fl->head = fl->tail = NULL;
+}
+
+/* Drop one reference; caller holds inflight.mutex */
+static void put_fill(fill_t *fl) {
+    if (--fl->refcnt > 0)
+        return;
+    free_blocks(fl);
+    Free(fl->url);
+    Free(fl);
+}
+
+/* Wait for the leader to append or finish, then reset the eventfd */
+static int wait_waiter(fill_waiter *w) {
+    struct pollfd pfd;
+    uint64_t cnt;
+    int rc;
+
+    if (!rio_wait || rio_wait(w->efd, 0, -1) < 0) {
+        /* Not in a coroutine: block this thread */
+        pfd.fd = w->efd;
+        pfd.events = POLLIN;
+        while ((rc = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+            ;
+        if (rc < 0)
+            return -1;
+    }
+    if (read(w->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+/*
+ * Free the blocks before the one every follower is sending from; caller
+ * holds the mutex. A block a follower has just finished stays until it
+ * moves on, as it may still hold a pointer to it.
+ */
+static void trim_blocks(fill_t *fl) {
+    fill_waiter *w;
+    fill_block *b;
+    long min = fl->len;
+    int n = 0;
+
+    for (w = fl->waiters; w; w = w->next, n++)
+        if (w->pos < min)
+            min = w->pos;
+    if (n < fl->nfollowers)
+        return;             /* One has joined but not said where it is */
+    while ((b = fl->head) != fl->tail && fl->base + b->len < min) {
+        fl->head = b->next;
+        fl->base += b->len;
+        Free(b);
+    }
+}
@@ -0,0 +1,45 @@
+#!/usr/bin/python
+
+# keepalive-server.py - This is a server that we use for the upstream
+#                       keep-alive test. It answers any number of
+#                       requests on each connection, with HTTP/1.1 and
+#                       a Content-Length, and appends a line to log for
+#                       each connection it accepts.
+#
+# usage: keepalive-server.py <port> <log>
+#
+import socket
+import sys
+import threading
+
+def serve(channel):
+  request = b''
+  while 1:
+    while b'\r\n\r\n' not in request:
+      data = channel.recv(4096)
+      if not data:
+        channel.close()
+        return
+      request += data
+    head, request = request.split(b'\r\n\r\n', 1)
+    line = head.decode('latin-1').split('\r\n')[0].split(' ')
+    path = line[1] if len(line) > 1 else '/'
+    path = path[path.find('/', path.find('//') + 2):] if '//' in path else path
+    body = '%s\n' % path
+    response = 'HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n' \
+               'Content-Length: %d\r\n\r\n%s' % (len(body), body)
+    channel.sendall(response.encode('latin-1'))
+
+serversocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+serversocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+serversocket.bind(('', int(sys.argv[1])))
+serversocket.listen(5)
+
+while 1:
+  channel, details = serversocket.accept()
+  log = open(sys.argv[2], 'a')
+  log.write('accept\n')
+  log.close()
+  thread = threading.Thread(target=serve, args=(channel,))
+  thread.daemon = True
+  thread.start()
@@ -0,0 +1,519 @@
+/*
+ * policy.c - Eviction policies for the cache, chosen with -e
+ *
+ * clock    CLOCK, or second chance: hits only set a bit (the default)
+ * lru      Least recently used
+ * s3fifo   S3-FIFO: new entries go through a small FIFO; those hit while
+ *          there move on to the main FIFO, the rest are dropped and
+ *          remembered in a ghost FIFO, and come back straight into the
+ *          main one if requested again soon (Yang et al., SOSP 2023)
+ * arc      Adaptive Replacement Cache, which balances a recency list
+ *          against a frequency list using ghosts of what each evicted
+ *          (Megiddo and Modha, FAST 2003)
+ * tinylfu  W-TinyLFU: a small LRU window in front of a segmented LRU
+ *          main area, which admits the window's victim only if a
+ *          count-min sketch rates it more popular than its own victim
+ *          (Einziger et al., ACM TOS 2017)
+ * gdsf     Greedy-Dual-Size-Frequency: keeps the entries that save the
+ *          most fetch time per byte, going by how often each was hit and
+ *          how long the origin took to supply it (Cherkasova, HP Labs
+ *          TR 98-69)
+ *
+ * The cache charges entries by memory, so every limit here is in bytes;
+ * ARC's target and ghost lists included.  clock and s3fifo count hits
+ * with atomic stores under the shard's read lock; the others reorder
+ * lists or a heap on a hit and take the write lock.
+ */
+#include "cache.h"
+
+#define GHOST_SLOTBYTES 1024    /* One ghost slot per KB of budget */
+#define S3_SMALL(c)     ((c)->budget / 10)
+#define S3_MAXFREQ      3
+#define TLFU_WINDOW(c)  ((c)->budget / 100)
+#define TLFU_PROTECTED(c) (((c)->budget - TLFU_WINDOW(c)) * 8 / 10)
+#define SKETCH_ROWS     4
+#define SKETCH_MAX      15      /* Counters saturate like 4-bit ones */
+#define HEAP_MINSIZE    64
+
+/* ---------------- Queues ---------------- */
+static void q_push(cache_list *c, int i, cache_block *p) {
+    cache_queue *q = &c->q[i];
+
+    p->queue = i;
+    p->prev = NULL;
+    p->next = q->head;
+    if (q->head)
+        q->head->prev = p;
+    else
+        q->tail = p;
+    q->head = p;
+    q->bytes += p->charge;
+}
+
+static void q_remove(cache_list *c, cache_block *p) {
+    cache_queue *q = &c->q[p->queue];
+
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        q->head = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        q->tail = p->prev;
+    q->bytes -= p->charge;
+}
+
+/* To the head of queue i */
+static void q_move(cache_list *c, int i, cache_block *p) {
+    q_remove(c, p);
+    q_push(c, i, p);
+}
+
+/* ---------------- Ghosts ---------------- */
+
+/*
+ * A FIFO of the hashes and charges of evicted entries, with a hash
+ * index on top. Entries taken back out leave a hole (charge 0) that
+ * is skipped when the FIFO reaches it.
+ */
+typedef struct {
+    uint64_t hash;
+    int charge;
+    int next;               /* Bucket chain, -1 ends it */
+} ghost_slot;
+
+struct ghost {
+    ghost_slot *slots;      /* Ring, oldest at first */
+    int cap, first, count;
+    int *buckets;
+    int nbuckets;           /* A power of two */
+    long bytes;
+};
+
+static ghost *ghost_new(cache_list *c) {
+    ghost *g = Calloc(1, sizeof(ghost));
+    int i;
+
+    g->cap = c->budget / GHOST_SLOTBYTES + 1;
+    g->slots = Calloc(g->cap, sizeof(ghost_slot));
+    for (g->nbuckets = 1; g->nbuckets < g->cap; g->nbuckets *= 2)
+        ;
+    g->buckets = Malloc(g->nbuckets * sizeof(int));
+    for (i = 0; i < g->nbuckets; i++)
+        g->buckets[i] = -1;
+    c->total_size += cache_charge(g) + cache_charge(g->slots)
+                     + cache_charge(g->buckets);
+    return g;
+}
+
+static void ghost_unlink(ghost *g, int i) {
+    int *ip;
+
+    for (ip = &g->buckets[g->slots[i].hash & (g->nbuckets - 1)]; *ip != i;
+         ip = &g->slots[*ip].next)
+        ;
+    *ip = g->slots[i].next;
+    g->bytes -= g->slots[i].charge;
+    g->slots[i].charge = 0;
+}
+
+static void ghost_pop(ghost *g) {
+    if (g->slots[g->first].charge)
+        ghost_unlink(g, g->first);
+    g->first = (g->first + 1) % g->cap;
+    g->count--;
+}
+
+/* Forget the oldest until at most max bytes are remembered */
+static void ghost_trim(ghost *g, long max) {
+    while (g->bytes > max && g->count > 0)
+        ghost_pop(g);
+}
+
+/* Remember p, within max bytes */
+static void ghost_add(ghost *g, cache_block *p, long max) {
+    ghost_slot *s;
+    int i;
+
+    if (g->count == g->cap)
+        ghost_pop(g);
+    i = (g->first + g->count++) % g->cap;
+    s = &g->slots[i];
+    s->hash = p->hash;
+    s->charge = p->charge;
+    s->next = g->buckets[p->hash & (g->nbuckets - 1)];
+    g->buckets[p->hash & (g->nbuckets - 1)] = i;
+    g->bytes += p->charge;
+    ghost_trim(g, max);
+}
+
+/* Forget hash if it is remembered; returns whether it was */
+static int ghost_take(ghost *g, uint64_t hash) {
+    int i;
+
+    for (i = g->buckets[hash & (g->nbuckets - 1)]; i >= 0;
+         i = g->slots[i].next)
+        if (g->slots[i].hash == hash && g->slots[i].charge) {
+            ghost_unlink(g, i);
+            return 1;
+        }
+    return 0;
+}
+
+/* ---------------- CLOCK ---------------- */
+static void clock_hit(cache_list *c, cache_block *p) {
+    (void)c;
+    if (!__atomic_load_n(&p->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&p->referenced, 1, __ATOMIC_RELAXED);
+}
+
+/* Just behind the hand: the last to be looked at */
+static void clock_insert(cache_list *c, cache_block *p) {
+    p->referenced = 0;
+    if (c->hand == NULL) {
+        p->prev = p->next = p;
+        c->hand = p;
+    } else {
+        p->next = c->hand;
+        p->prev = c->hand->prev;
+        c->hand->prev->next = p;
+        c->hand->prev = p;
+    }
+}
+
+/*
+ * Advance the hand past entries hit since it last came by, clearing
+ * their bits. Ends within one turn of the ring, as hits cannot set bits
+ * under the write lock.
+ */
+static cache_block *clock_victim(cache_list *c) {
+    if (c->hand == NULL)
+        return NULL;
+    while (c->hand->referenced) {
+        c->hand->referenced = 0;
+        c->hand = c->hand->next;
+    }
+    return c->hand;
+}
+
+static void clock_remove(cache_list *c, cache_block *p) {
+    if (p->next == p)
+        c->hand = NULL;
+    else {
+        p->prev->next = p->next;
+        p->next->prev = p->prev;
+        if (c->hand == p)
+            c->hand = p->next;
+    }
+}
+
+/* ---------------- LRU ---------------- */
+static void lru_hit(cache_list *c, cache_block *p) {
+    q_move(c, 0, p);
+}
+
+static void lru_insert(cache_list *c, cache_block *p) {
+    q_push(c, 0, p);
+}
+
+static cache_block *lru_victim(cache_list *c) {
+    return c->q[0].tail;
+}
+
+/* ---------------- S3-FIFO ---------------- */
+
+/* q[0] is the small FIFO, q[1] the main one, ghosts[0] the ghost */
+static void s3_init(cache_list *c) {
+    c->ghosts[0] = ghost_new(c);
+}
+
+static void s3_hit(cache_list *c, cache_block *p) {
+    int freq = __atomic_load_n(&p->referenced, __ATOMIC_RELAXED);
+
+    (void)c;
+    if (freq < S3_MAXFREQ)
+        __atomic_store_n(&p->referenced, freq + 1, __ATOMIC_RELAXED);
+}
+
+static void s3_insert(cache_list *c, cache_block *p) {
+    p->referenced = 0;
+    q_push(c, ghost_take(c->ghosts[0], p->hash) ? 1 : 0, p);
+}
+
+static cache_block *s3_victim(cache_list *c) {
+    cache_block *p;
+
+    while (1) {
+        if (c->q[0].tail && (c->q[0].bytes > S3_SMALL(c) || !c->q[1].tail)) {
+            p = c->q[0].tail;
+            if (p->referenced) {        /* Hit while on probation */
+                p->referenced = 0;
+                q_move(c, 1, p);
+                continue;
+            }
+            ghost_add(c->ghosts[0], p, c->budget - S3_SMALL(c));
+            return p;
+        }
+        if ((p = c->q[1].tail) == NULL)
+            return NULL;
+        if (p->referenced) {            /* Reinsert, one hit poorer */
+            p->referenced--;
+            q_move(c, 1, p);
+            continue;
+        }
+        return p;
+    }
+}
+
+/* ---------------- ARC ---------------- */
+
+/*
+ * q[0] is T1 (seen once recently), q[1] T2 (seen at least twice),
+ * ghosts[0] and [1] are B1 and B2, and c->target is T1's share.
+ */
+static void arc_init(cache_list *c) {
+    c->ghosts[0] = ghost_new(c);
+    c->ghosts[1] = ghost_new(c);
+    c->target = 0;
+}
+
+static void arc_hit(cache_list *c, cache_block *p) {
+    q_move(c, 1, p);
+}
+
+static void arc_insert(cache_list *c, cache_block *p) {
+    long b1 = c->ghosts[0]->bytes, b2 = c->ghosts[1]->bytes;
+    long size = p->charge;
+
+    c->ghost_hit = 0;
+    if (ghost_take(c->ghosts[0], p->hash)) {
+        /* Evicted from T1 too soon: give T1 more room */
+        c->target += b2 > b1 ? size * b2 / b1 : size;
+        if (c->target > c->budget)
+            c->target = c->budget;
+        c->ghost_hit = 1;
+        q_push(c, 1, p);
+    } else if (ghost_take(c->ghosts[1], p->hash)) {
+        /* Evicted from T2 too soon: give T2 more room */
+        c->target -= b1 > b2 ? size * b1 / b2 : size;
+        if (c->target < 0)
+            c->target = 0;
+        c->ghost_hit = 2;
+        q_push(c, 1, p);
+    } else
+        q_push(c, 0, p);
+}
+
+static cache_block *arc_victim(cache_list *c) {
+    cache_block *p;
+    long t1 = c->q[0].bytes;
+
+    if (c->q[0].tail && (t1 > c->target
+                         || (c->ghost_hit == 2 && t1 >= c->target)
+                         || !c->q[1].tail)) {
+        p = c->q[0].tail;
+        ghost_add(c->ghosts[0], p, c->budget - (t1 - p->charge));
+        return p;
+    }
+    if ((p = c->q[1].tail) == NULL)
+        return NULL;
+    ghost_add(c->ghosts[1], p, c->budget - c->ghosts[0]->bytes);
+    return p;
+}
+
+/* ---------------- W-TinyLFU ---------------- */
+
+/* q[0] is the window, q[1] the main area's probation, q[2] protected */
+static void tlfu_init(cache_list *c) {
+    for (c->width = 64; c->width * 1024 < (unsigned long)c->budget;
+         c->width *= 2)
+        ;
+    c->sketch = Calloc(SKETCH_ROWS * c->width, 1);
+    c->samples = 0;
+    c->total_size += cache_charge(c->sketch);
+}
+
+static unsigned char *sketch_counter(cache_list *c, uint64_t hash, int row) {
+    static const uint64_t seeds[SKETCH_ROWS] = {
+        0x9e3779b97f4a7c15UL, 0xbf58476d1ce4e5b9UL,
+        0x94d049bb133111ebUL, 0xc2b2ae3d27d4eb4fUL
+    };
+
+    hash = (hash ^ (hash >> 32)) * seeds[row];
+    return &c->sketch[row * c->width + ((hash >> 32) & (c->width - 1))];
+}
+
+/* Count an access; halve every counter once per 10 accesses a counter */
+static void sketch_add(cache_list *c, uint64_t hash) {
+    unsigned char *p;
+    unsigned long i;
+    int row;
+
+    for (row = 0; row < SKETCH_ROWS; row++)
+        if (*(p = sketch_counter(c, hash, row)) < SKETCH_MAX)
+            (*p)++;
+    if (++c->samples >= 10 * c->width) {
+        for (i = 0; i < SKETCH_ROWS * c->width; i++)
+            c->sketch[i] >>= 1;
+        c->samples /= 2;
+    }
+}
+
+static int sketch_estimate(cache_list *c, uint64_t hash) {
+    int row, n, min = SKETCH_MAX;
+
+    for (row = 0; row < SKETCH_ROWS; row++)
+        if ((n = *sketch_counter(c, hash, row)) < min)
+            min = n;
+    return min;
+}
+
+static void tlfu_hit(cache_list *c, cache_block *p) {
+    sketch_add(c, p->hash);
+    if (p->queue != 1) {
+        q_move(c, p->queue, p);
+        return;
+    }
+    q_move(c, 2, p);            /* Promote, demoting protected overflow */
+    while (c->q[2].bytes > TLFU_PROTECTED(c) && c->q[2].tail != p)
+        q_move(c, 1, c->q[2].tail);
+}
+
+static void tlfu_insert(cache_list *c, cache_block *p) {
+    sketch_add(c, p->hash);
+    q_push(c, 0, p);
+}
+
+static cache_block *tlfu_victim(cache_list *c) {
+    cache_block *cand, *v;
+
+    while (c->q[0].tail && c->q[0].bytes > TLFU_WINDOW(c)) {
+        cand = c->q[0].tail;
+        if (c->q[1].bytes + c->q[2].bytes + cand->charge
+            <= c->budget - TLFU_WINDOW(c)) {
+            q_move(c, 1, cand);         /* The main area has room */
+            continue;
+        }
+        if ((v = c->q[1].tail ? c->q[1].tail : c->q[2].tail) == NULL)
+            return cand;
+        /* Admit cand, once v is gone, only if it is the more popular */
+        return sketch_estimate(c, cand->hash) > sketch_estimate(c, v->hash)
+               ? v : cand;
+    }
+    if (c->q[1].tail)
+        return c->q[1].tail;
+    return c->q[2].tail ? c->q[2].tail : c->q[0].tail;
+}
+
+/* ---------------- GDSF ---------------- */
+
+/*
+ * An entry's priority is L + hits * cost / charge, and the lowest is
+ * evicted first. L, the inflation, rises to each victim's priority, so
+ * entries that are not hit age against newly inserted ones. The heap of
+ * entries keeps each one's place in it in p->queue, and p->referenced
+ * counts its hits.
+ */
+static void heap_set(cache_list *c, unsigned long i, cache_block *p) {
+    c->heap[i] = p;
+    p->queue = i;
+}
+
+static void sift_up(cache_list *c, unsigned long i) {
+    cache_block *p = c->heap[i];
+
+    for (; i > 0 && c->heap[(i - 1) / 2]->priority > p->priority;
+         i = (i - 1) / 2)
+        heap_set(c, i, c->heap[(i - 1) / 2]);
+    heap_set(c, i, p);
+}
+
+static void sift_down(cache_list *c, unsigned long i) {
+    cache_block *p = c->heap[i];
+    unsigned long child;
+
+    while ((child = 2 * i + 1) < c->heapsize) {
+        if (child + 1 < c->heapsize
+            && c->heap[child + 1]->priority < c->heap[child]->priority)
+            child++;
+        if (c->heap[child]->priority >= p->priority)
+            break;
+        heap_set(c, i, c->heap[child]);
+        i = child;
+    }
+    heap_set(c, i, p);
+}
+
+/* Fetches that took under a millisecond still cost something */
+static void gdsf_prioritize(cache_list *c, cache_block *p) {
+    p->priority = c->inflation + (double)p->referenced
+                  * (p->cost ? p->cost : 1) / p->charge;
+}
+
+static void gdsf_init(cache_list *c) {
+    c->heapcap = HEAP_MINSIZE;
+    c->heap = Malloc(c->heapcap * sizeof(cache_block *));
+    c->heapsize = 0;
+    c->inflation = 0;
+    c->total_size += cache_charge(c->heap);
+}
+
+static void gdsf_hit(cache_list *c, cache_block *p) {
+    p->referenced++;
+    gdsf_prioritize(c, p);
+    sift_down(c, p->queue);     /* Priorities only rise */
+}
+
+static void gdsf_insert(cache_list *c, cache_block *p) {
+    int old;
+
+    if (c->heapsize == c->heapcap) {
+        old = cache_charge(c->heap);
+        c->heapcap *= 2;
+        c->heap = Realloc(c->heap, c->heapcap * sizeof(cache_block *));
+        __atomic_add_fetch(&c->total_size, cache_charge(c->heap) - old,
+                           __ATOMIC_RELAXED);
+    }
+    p->referenced = 1;
+    gdsf_prioritize(c, p);
+    heap_set(c, c->heapsize++, p);
+    sift_up(c, p->queue);
+}
+
+static cache_block *gdsf_victim(cache_list *c) {
+    if (c->heapsize == 0)
+        return NULL;
+    c->inflation = c->heap[0]->priority;
+    return c->heap[0];
+}
+
+static void gdsf_remove(cache_list *c, cache_block *p) {
+    cache_block *last = c->heap[--c->heapsize];
+
+    if (last == p)
+        return;
+    heap_set(c, p->queue, last);   /* Fill the hole with the last entry */
+    sift_up(c, last->queue);
+    sift_down(c, last->queue);
+}
+
+/* ---------------- Table ---------------- */
+static cache_policy policies[] = {
+    { "clock", 0, NULL, clock_hit, clock_insert, clock_victim, clock_remove },
+    { "lru", 1, NULL, lru_hit, lru_insert, lru_victim, q_remove },
+    { "s3fifo", 0, s3_init, s3_hit, s3_insert, s3_victim, q_remove },
+    { "arc", 1, arc_init, arc_hit, arc_insert, arc_victim, q_remove },
+    { "tinylfu", 1, tlfu_init, tlfu_hit, tlfu_insert, tlfu_victim, q_remove },
+    { "gdsf", 1, gdsf_init, gdsf_hit, gdsf_insert, gdsf_victim, gdsf_remove }
+};
+
+/* The policy called name, or NULL */
+cache_policy *cache_policy_find(char *name) {
+    unsigned i;
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if (!strcmp(policies[i].name, name))
+            return &policies[i];
+    return NULL;
+}
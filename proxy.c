@@ -8,53 +8,265 @@
  * proxy.c - CS:APP Proxy Lab
  * C89 style: all variable declarations at beginning of block
  */
-//
-#include "csapp.h"
+#include "proxy.h"
+#include "sbuf.h"
 
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+sbuf_t sbuf; /* Shared buffer of connected descriptors (pool mode) */
 
-/* cache node struct */
-typedef struct cache_block {
-    char url[MAXLINE];
-    char data[MAX_OBJECT_SIZE];
-    int size;
-    struct cache_block *prev;
-    struct cache_block *next;
-} cache_block;
-
-typedef struct {
-    cache_block *head;
-    cache_block *tail;
-    int total_size;
-    sem_t mutex;
-} cache_list;
+/* Limits on waiting for an origin's response, in ms; -1 for none */
+int first_byte_timeout, inter_byte_timeout, request_timeout;
 
-cache_list cache;
+/* What the client gets when the origin does not answer in time */
+char gateway_timeout_msg[] = "HTTP/1.0 504 Gateway Timeout\r\n"
+                             "Content-Type: text/plain\r\n"
+                             "Content-Length: 24\r\n"
+                             "Connection: close\r\n\r\n"
+                             "Origin did not respond\r\n";
 
 /* Function prototypes */
 void *thread(void *vargp);
-void doit(int connfd);
-void parse_uri(char *uri, char *hostname, char *path, int *port);
-void build_requesthdrs(rio_t *client_rio, char *req_hdrs, char *hostname);
-int cache_find(char *url, int connfd);
-void cache_insert(char *url, char *buf, int size);
-void cache_init();
+void thread_serve(int listenfd);
+void pool_serve(int listenfd, int nthreads, int qdepth);
+void *report_thread(void *vargp);
+void usage(char *prog);
 
 /* ---------------- Main ---------------- */
 int main(int argc, char **argv) {
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int listenfd, opt, nthreads = 0, qdepth = SBUFSIZE;
+    sigset_t mask;
     pthread_t tid;
+    int max_idle = 0, max_active = 0, idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+    int connect_timeout = CONNECT_TIMEOUT;
+    int first_byte = FIRST_BYTE_TIMEOUT, inter_byte = INTER_BYTE_TIMEOUT;
+    int total = REQUEST_TIMEOUT;
+    int dns_ttl = DNS_TTL, dns_neg_ttl = DNS_NEG_TTL;
+    int dns_timeout = DNS_TIMEOUT, nresolvers = DNS_NRESOLVERS;
+    int ncache_shards = 0, disk_size = DISK_CACHE_SIZE;
+    int default_ttl = CACHE_DEFAULT_TTL, grace = CACHE_STALE_GRACE;
+    int refresh_budget = 0;
+    char *mode = "thread", *eviction = "clock", *disk_dir = NULL;
+    char *snapshot = NULL;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
+    while ((opt = getopt(argc, argv, "m:n:q:k:l:K:c:f:i:t:d:D:r:R:s:e:o:O:p:x:w:a:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'n':
+            if ((nthreads = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'q':
+            if ((qdepth = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'k':
+            if ((max_idle = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            if ((max_active = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'K':
+            if ((idle_timeout = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'c':
+            if ((connect_timeout = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'f':
+            if ((first_byte = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'i':
+            if ((inter_byte = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 't':
+            if ((total = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((dns_ttl = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'D':
+            if ((dns_neg_ttl = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if ((nresolvers = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'R':
+            if ((dns_timeout = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 's':
+            if ((ncache_shards = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'e':
+            eviction = optarg;
+            break;
+        case 'o':
+            disk_dir = optarg;
+            break;
+        case 'O':
+            if ((disk_size = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'p':
+            snapshot = optarg;
+            break;
+        case 'x':
+            if ((default_ttl = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if ((grace = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'a':
+            if ((refresh_budget = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (optind != argc - 1)
+        usage(argv[0]);
 
-    listenfd = Open_listenfd(argv[1]);
-    cache_init();
+    Signal(SIGPIPE, SIG_IGN);   /* Peers may close pooled connections */
+    /* SIGUSR1 prints statistics in every mode.  Only report_thread takes
+       it: it would make P() fail with EINTR in the other threads */
+    Signal(SIGUSR1, sigusr1_handler);
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    first_byte_timeout = first_byte ? first_byte * 1000 : -1;
+    inter_byte_timeout = inter_byte ? inter_byte * 1000 : -1;
+    request_timeout = total ? total * 1000 : -1;
+    if (cache_init(ncache_shards, eviction) < 0)
+        usage(argv[0]);
+    if (disk_dir)
+        disk_init(disk_dir, (long)disk_size << 20);
+    if (snapshot)
+        cache_persist(snapshot);    /* Before any thread starts */
+    Pthread_create(&tid, NULL, report_thread, NULL);
+    cache_expire_init(default_ttl, grace);
+    frame_pool_init();
+    upstream_init(max_idle, max_active, idle_timeout, connect_timeout * 1000);
+    dns_init(dns_ttl, dns_neg_ttl, dns_timeout * 1000, nresolvers);
+    fill_init();
+    if (refresh_budget)
+        refresh_ahead_init(refresh_budget);
+    if (!strcmp(mode, "shard")) {
+        shard_serve(argv[optind], nthreads ? nthreads : SHARD_NTHREADS,
+                    qdepth);
+        return 0;
+    }
+
+    listenfd = Open_listenfd(argv[optind]);
+    if (!strcmp(mode, "thread"))
+        thread_serve(listenfd);
+    else if (!strcmp(mode, "pool"))
+        pool_serve(listenfd, nthreads ? nthreads : NTHREADS, qdepth);
+    else if (!strcmp(mode, "epoll"))
+        epoll_serve(listenfd, nthreads ? nthreads : 1);
+    else if (!strcmp(mode, "uring"))
+        uring_serve(listenfd, nthreads ? nthreads : 1);
+    else if (!strcmp(mode, "coro"))
+        coro_serve(listenfd, nthreads ? nthreads : 1);
+    else
+        usage(argv[0]);
+    return 0;
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s <port> [-m thread|pool|shard|epoll|uring|coro]"
+            " [-n nthreads] [-q depth]\n"
+            "       [-k idle] [-l num] [-K secs] [-c secs] [-f secs] [-i secs]"
+            " [-t secs]\n"
+            "       [-d secs] [-D secs] [-r num] [-R secs] [-s shards]"
+            " [-e policy]\n"
+            "       [-o dir] [-O mb] [-p file] [-x secs] [-w secs]"
+            " [-a num]\n",
+            prog);
+    fprintf(stderr, "  -m mode   thread: one thread per connection (default)\n");
+    fprintf(stderr, "            pool:   prethreaded workers fed by a queue\n");
+    fprintf(stderr, "            shard:  per-core SO_REUSEPORT listeners, each "
+            "with its own pool\n");
+    fprintf(stderr, "            epoll:  non-blocking event loops\n");
+    fprintf(stderr, "            uring:  io_uring completion loops\n");
+    fprintf(stderr, "            coro:   doit() in coroutines on event loops\n");
+    fprintf(stderr, "  -n num    worker threads (pool, default %d; shard, per "
+            "core, default %d)\n", NTHREADS, SHARD_NTHREADS);
+    fprintf(stderr, "            or event loops (epoll, uring and coro, "
+            "default 1)\n");
+    fprintf(stderr, "  -q depth  connection queue depth (pool and shard, "
+            "default %d)\n", SBUFSIZE);
+    fprintf(stderr, "  -k idle   keep up to idle persistent connections per "
+            "origin (default 0:\n"
+            "            one connection per request; not in epoll and uring)\n");
+    fprintf(stderr, "  -l num    open at most num connections at once per "
+            "origin, queueing other\n"
+            "            requests up to -c (default 0: no limit; not in "
+            "epoll and uring)\n");
+    fprintf(stderr, "  -K secs   close pooled connections idle this long "
+            "(default %d)\n", UPSTREAM_IDLE_TIMEOUT);
+    fprintf(stderr, "  -c secs   give up connecting to an origin after this "
+            "long (default %d)\n", CONNECT_TIMEOUT);
+    fprintf(stderr, "  -f secs   answer 504 if the origin sends nothing for "
+            "this long (default %d)\n", FIRST_BYTE_TIMEOUT);
+    fprintf(stderr, "  -i secs   drop a response that stalls for this long "
+            "(default %d)\n", INTER_BYTE_TIMEOUT);
+    fprintf(stderr, "  -t secs   and one that takes longer than this "
+            "overall (default %d;\n"
+            "            0 turns off any of -f, -i and -t)\n",
+            REQUEST_TIMEOUT);
+    fprintf(stderr, "  -d secs   cache resolved origin names this long "
+            "(default %d, 0: off)\n", DNS_TTL);
+    fprintf(stderr, "  -D secs   cache failed lookups this long "
+            "(default %d, 0: off)\n", DNS_NEG_TTL);
+    fprintf(stderr, "  -r num    resolver threads (default %d)\n",
+            DNS_NRESOLVERS);
+    fprintf(stderr, "  -R secs   give up on a lookup after this long "
+            "(default %d)\n", DNS_TIMEOUT);
+    fprintf(stderr, "  -s num    cache shards, each with its own lock "
+            "(default: one per core,\n"
+            "            at most %d)\n", CACHE_MAXSHARDS);
+    fprintf(stderr, "  -e policy cache eviction: clock (default), lru, "
+            "s3fifo, arc, tinylfu\n"
+            "            or gdsf (by fetch time saved per byte)\n");
+    fprintf(stderr, "  -o dir    keep evicted and large objects in a disk "
+            "cache in dir\n");
+    fprintf(stderr, "  -O mb     size of the disk cache (default %d, in "
+            "segments of %d MB)\n", DISK_CACHE_SIZE, DISK_SEGSIZE >> 20);
+    fprintf(stderr, "  -p file   save the cache to file on SIGTERM, and "
+            "start from it\n");
+    fprintf(stderr, "  -x secs   keep responses that give no lifetime this "
+            "long (default %d,\n"
+            "            0: until evicted)\n", CACHE_DEFAULT_TTL);
+    fprintf(stderr, "  -w secs   serve stale responses this long while "
+            "refreshing them, or if\n"
+            "            the origin fails, unless they say (default %d)\n",
+            CACHE_STALE_GRACE);
+    fprintf(stderr, "  -a num    refresh up to num of the most hit cached "
+            "responses at once\n"
+            "            before they go stale (default 0: off)\n");
+    exit(1);
+}
+
+/* ---------------- Thread ---------------- */
+void thread_serve(int listenfd) {
+    int *connfdp;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid;
 
     while (1) {
         clientlen = sizeof(clientaddr);
@@ -64,7 +276,6 @@ int main(int argc, char **argv) {
     }
 }
 
-/* ---------------- Thread ---------------- */
 void *thread(void *vargp) {
     int connfd = *((int *)vargp);
     Pthread_detach(pthread_self());
@@ -74,52 +285,809 @@ void *thread(void *vargp) {
     return NULL;
 }
 
+/* ---------------- Pool ---------------- */
+
+/*
+ * pool_serve - Prethreaded server: the main thread only accepts and
+ *     queues descriptors, nthreads workers take them off the queue.
+ *     kill -USR1 prints the queue statistics.
+ */
+void pool_serve(int listenfd, int nthreads, int qdepth) {
+    int i, connfd;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid;
+
+    sbuf_init(&sbuf, qdepth);
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, worker, &sbuf);
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        sbuf_insert(&sbuf, connfd);
+    }
+}
+
+/* Serve descriptors from the sbuf_t passed in vargp, forever */
+void *worker(void *vargp) {
+    sbuf_t *sp = vargp;
+    int connfd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        connfd = sbuf_remove(sp);
+        doit(connfd);
+        Close(connfd);
+    }
+    return NULL;
+}
+
+/* Wait for SIGUSR1, the one thread that does not block it */
+void *report_thread(void *vargp) {
+    sigset_t mask;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    while (1)
+        pause();
+    return NULL;
+}
+
+/* Report statistics using only async-signal-safe calls */
+void sigusr1_handler(int sig) {
+    int olderrno = errno;
+
+    (void)sig;
+    if (sbuf.n) {           /* Pool mode */
+        sio_puts("pool: queued ");
+        sio_putl(sbuf.inserted);
+        sio_puts(" depth ");
+        sio_putl(sbuf.depth);
+        sio_puts("/");
+        sio_putl(sbuf.n);
+        sio_puts(" max ");
+        sio_putl(sbuf.max_depth);
+        sio_puts(" full ");
+        sio_putl(sbuf.full);
+        sio_puts("\n");
+    }
+    sio_puts("dns: hits ");
+    sio_putl(dns_stats.hits);
+    sio_puts(" failures ");
+    sio_putl(dns_stats.neg_hits);
+    sio_puts(" joined ");
+    sio_putl(dns_stats.joined);
+    sio_puts(" misses ");
+    sio_putl(dns_stats.misses);
+    sio_puts(" timeouts ");
+    sio_putl(dns_stats.timeouts);
+    sio_puts("\nfills: leaders ");
+    sio_putl(fill_stats.leaders);
+    sio_puts(" followers ");
+    sio_putl(fill_stats.followers);
+    sio_puts("\n");
+    cache_report();
+    errno = olderrno;
+}
+
 /* ---------------- doit ---------------- */
-void doit(int connfd) {
-    int clientfd;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char hostname[MAXLINE], path[MAXLINE];
+
+/*
+ * Per-request working storage. It lives on the heap rather than on
+ * doit()'s stack so that doit() fits in a small coroutine stack, and
+ * finished frames are recycled through frame_pool.
+ */
+typedef struct req_frame {
+    char buf[MAXLINE], uri[MAXLINE];
+    char hostname[MAXLINE], path[MAXLINE], req_hdrs[MAXLINE];
     int port;
     rio_t rio, server_rio;
-    char req_hdrs[MAXLINE], response_buf[MAX_OBJECT_SIZE];
-    int n, total_size;
+    http_parser hp;         /* The client's head, in place in rio */
+    int read_timeout;       /* first_byte_timeout, then inter_byte_timeout */
+    unsigned long started;  /* now_ms() when the fetch began */
+    unsigned long deadline; /* now_ms() the response must be done by */
+    char *response_buf;     /* Grown as the response arrives */
+    int response_cap;
+    fill_t *fill;           /* Followers of this fetch, if leading one */
+    int client_gone;        /* Fetching on for the followers only */
+    cache_block *stale;     /* A stale cached copy, if any */
+    char *stale_data;
+    int stale_size;
+    int revalidating;       /* The request is conditional on it */
+    int ahead;              /* Refreshing a hot entry before it expires */
+    struct req_frame *next;
+} req_frame;
 
-    Rio_readinitb(&rio, connfd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return;
+static struct {
+    req_frame *free;
+    int nfree;
+    sem_t mutex;
+} frame_pool;
+
+/* Refreshes of hot entries ahead of expiry */
+static struct {
+    int budget;             /* Most at once */
+    int running;
+} ahead;
+
+static req_frame *frame_alloc(void);
+static void frame_free(req_frame *f);
+static void serve_request(int connfd, req_frame *f);
+static int read_head(req_frame *f);
+static int serve_while_revalidating(int connfd, req_frame *f);
+static void refresh(req_frame *f);
+static int start_refresh(req_frame *r);
+static void *refresh_thread(void *vargp);
+static void *ahead_thread(void *vargp);
+static void refresh_ahead(char *url);
+static int fetch(int connfd, req_frame *f);
+static int request(int connfd, req_frame *f);
+static int exchange(int connfd, req_frame *f, char *portstr);
+static int serve_stale(int connfd, req_frame *f);
+static void send_stale(int connfd, req_frame *f);
+static int start_response(int serverfd, req_frame *f);
+static int relay_response(int connfd, req_frame *f, int *complete);
+static int relay_revalidated(int connfd, req_frame *f, int *complete,
+                             int keepalive);
+static int add_validators(req_frame *f, char *etag, char *modified);
+static int relay_bytes(int connfd, req_frame *f, long len, int *total);
+static int relay_chunked(int connfd, req_frame *f, int *total);
+static int forward(int connfd, req_frame *f, char *data, int n, int *total);
+static int has_token(char *value, char *token);
+static int drop_token(char *value, char *token);
+static ssize_t server_readline(req_frame *f);
+static ssize_t server_readb(req_frame *f, int n);
+static int arm_timeout(req_frame *f);
+static void gateway_timeout(int connfd, req_frame *f);
+
+void doit(int connfd) {
+    req_frame *f = frame_alloc();
+
+    serve_request(connfd, f);
+    frame_free(f);
+}
+
+static void serve_request(int connfd, req_frame *f) {
+    int leader, complete;
+    long sent;
+    char *head;
 
-    sscanf(buf, "%s %s %s", method, uri, version);
+    Rio_readinitb(&f->rio, connfd);
+    if (!read_head(f))
+        return;
+    head = f->rio.rio_bufptr;
 
-    if (strcasecmp(method, "GET")) {
+    if (!http_span_is(head, f->hp.method, "GET")) {
         printf("Proxy only supports GET\n");
         return;
     }
 
-    if (cache_find(uri, connfd))
+    /* The cache key outlives the head */
+    memcpy(f->uri, head + f->hp.uri.off, f->hp.uri.len);
+    f->uri[f->hp.uri.len] = '\0';
+    if (cache_find(f->uri, connfd))
         return;
 
-    parse_uri(uri, hostname, path, &port);
-    build_requesthdrs(&rio, req_hdrs, hostname);
+    strcpy(f->buf, f->uri);         /* parse_uri() modifies its argument */
+    parse_uri(f->buf, f->hostname, f->path, &f->port);
+    if (build_requesthdrs(f->req_hdrs, head, &f->hp, f->hostname, f->path,
+                          upstream_keepalive) < 0)
+        return;
+    if (serve_while_revalidating(connfd, f))
+        return;
 
-    clientfd = Open_clientfd(hostname, port);
-    if (clientfd < 0) return;
+    /* Concurrent misses on one URL share a single fetch */
+    f->client_gone = 0;
+    f->fill = fill_join(f->uri, &leader);
+    if (!leader) {
+        sent = fill_follow(f->fill, connfd);
+        fill_release(f->fill);
+        f->fill = NULL;
+        if (sent >= 0)
+            return;
+        /* The leader got nothing at all: try ourselves */
+    }
 
-    Rio_readinitb(&server_rio, clientfd);
-    Rio_writen(clientfd, req_hdrs, strlen(req_hdrs));
+    complete = fetch(connfd, f);
+    if (f->fill) {
+        fill_finish(f->fill, complete);
+        f->fill = NULL;
+    }
+}
+
+/*
+ * read_head - Read the client's request head into f->rio's buffer and
+ *     parse it there. Returns 1 once it is complete, at f->rio.rio_bufptr,
+ *     or 0 if the client went away first or sent a head that is malformed
+ *     or larger than the buffer.
+ */
+static int read_head(req_frame *f) {
+    int rc;
+
+    http_parser_init(&f->hp);
+    while ((rc = http_parse(&f->hp, f->rio.rio_bufptr, f->rio.rio_cnt)) == 0)
+        if (rio_fillb(&f->rio) <= 0)
+            return 0;
+    return rc > 0;
+}
+
+/*
+ * serve_while_revalidating - Serve a stale copy of f->uri that is still
+ *     within its stale-while-revalidate grace, and refresh it in the
+ *     background. Returns 1 if one was served.
+ */
+static int serve_while_revalidating(int connfd, req_frame *f) {
+    cache_block *p;
+    char *data, *etag, *modified;
+    int size;
+
+    if ((p = cache_stale(f->uri, &data, &size, &etag, &modified)) == NULL)
+        return 0;
+    if (!cache_use_stale(p, 0)) {
+        cache_release(p);
+        return 0;
+    }
+    rio_writen(connfd, data, size);
+    cache_release(p);
+    refresh(f);
+    return 1;
+}
+
+/*
+ * refresh - Fetch f->uri for the cache alone, in a thread of its own,
+ *     unless a fetch of it is under way. Misses on it meanwhile follow
+ *     the refresh.
+ */
+static void refresh(req_frame *f) {
+    req_frame *r = frame_alloc();
+
+    strcpy(r->uri, f->uri);
+    strcpy(r->hostname, f->hostname);
+    strcpy(r->path, f->path);
+    strcpy(r->req_hdrs, f->req_hdrs);
+    r->port = f->port;
+    r->ahead = 0;
+    start_refresh(r);
+}
+
+/*
+ * start_refresh - Start refreshing r->uri, or free r if a fetch of it is
+ *     under way. Returns 1 if it started.
+ */
+static int start_refresh(req_frame *r) {
+    pthread_t tid;
+
+    if ((r->fill = fill_lead(r->uri)) == NULL) {
+        frame_free(r);
+        return 0;
+    }
+    if (r->ahead)
+        __atomic_add_fetch(&ahead.running, 1, __ATOMIC_RELAXED);
+    r->client_gone = 1;
+    Pthread_create(&tid, NULL, refresh_thread, r);
+    return 1;
+}
+
+static void *refresh_thread(void *vargp) {
+    req_frame *f = vargp;
+
+    Pthread_detach(pthread_self());
+    fill_finish(f->fill, fetch(-1, f));
+    f->fill = NULL;
+    if (f->ahead)
+        __atomic_sub_fetch(&ahead.running, 1, __ATOMIC_RELAXED);
+    frame_free(f);
+    return NULL;
+}
+
+/*
+ * refresh_ahead_init - Every second, refresh the hottest cached entries
+ *     that are about to go stale (cache_hot()), up to budget at once, so
+ *     that clients of popular objects never wait on a miss.
+ */
+void refresh_ahead_init(int budget) {
+    pthread_t tid;
+
+    ahead.budget = budget;
+    ahead.running = 0;
+    Pthread_create(&tid, NULL, ahead_thread, NULL);
+}
+
+static void *ahead_thread(void *vargp) {
+    char (*urls)[MAXLINE] = Malloc(ahead.budget * MAXLINE);
+    int i, n;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1) {
+        Sleep(1);
+        n = cache_hot(urls, ahead.budget
+                      - __atomic_load_n(&ahead.running, __ATOMIC_RELAXED));
+        for (i = 0; i < n; i++)
+            refresh_ahead(urls[i]);
+    }
+    return NULL;
+}
+
+/* Refresh url with a request of our own, no client's headers to hand */
+static void refresh_ahead(char *url) {
+    req_frame *r = frame_alloc();
+
+    strcpy(r->uri, url);
+    strcpy(r->buf, url);            /* parse_uri() modifies its argument */
+    parse_uri(r->buf, r->hostname, r->path, &r->port);
+    snprintf(r->req_hdrs, MAXLINE, "GET %s %s\r\n", r->path,
+             upstream_keepalive ? "HTTP/1.1" : "HTTP/1.0");
+    finish_requesthdrs(r->req_hdrs, r->hostname, 0, upstream_keepalive);
+    r->ahead = 1;
+    if (start_refresh(r))
+        cache_count_ahead(url);
+}
+
+/*
+ * fetch - Send the request in f->req_hdrs to the origin and relay the
+ *     response to the client and any followers. Returns 1 if the whole
+ *     response was relayed. If a stale copy is cached with a validator,
+ *     the request is made conditional on it, and the copy is served if
+ *     the origin answers 304, or if it fails within the copy's
+ *     stale-if-error grace.
+ */
+static int fetch(int connfd, req_frame *f) {
+    int complete;
+    char *etag, *modified;
+
+    f->stale = cache_stale(f->uri, &f->stale_data, &f->stale_size, &etag,
+                           &modified);
+    f->revalidating = f->stale && (etag || modified)
+                      && add_validators(f, etag, modified);
+    complete = request(connfd, f);
+    if (f->stale) {
+        cache_release(f->stale);
+        f->stale = NULL;
+    }
+    return complete;
+}
+
+/*
+ * request - Fetch f's URL for connfd, holding one of the origin's -l
+ *     connection slots meanwhile. Returns whether the response was
+ *     read in full.
+ */
+static int request(int connfd, req_frame *f) {
+    char portstr[16];
+    int complete;
+
+    f->started = now_ms();
+    f->deadline = request_timeout < 0 ? 0 : f->started + request_timeout;
+    sprintf(portstr, "%d", f->port);
+    if (upstream_acquire(f->hostname, portstr) < 0) {
+        if (serve_stale(connfd, f))
+            return 1;
+        gateway_timeout(connfd, f);
+        return 0;
+    }
+    complete = exchange(connfd, f, portstr);
+    upstream_release(f->hostname, portstr);
+    return complete;
+}
+
+static int exchange(int connfd, req_frame *f, char *portstr) {
+    int serverfd;
+    int rc = 0, complete;
+
+    /* A pooled connection may have been closed by the origin since it
+       was checked, so if it fails (but not if it is slow) retry once on
+       a new connection */
+    if ((serverfd = upstream_get(f->hostname, portstr)) >= 0
+        && (rc = start_response(serverfd, f)) == 0) {
+        Close(serverfd);
+        serverfd = -1;
+    }
+    if (serverfd < 0) {
+        if ((serverfd = upstream_connect(f->hostname, portstr)) < 0)
+            return serve_stale(connfd, f);
+        rc = start_response(serverfd, f);
+    }
+    if (rc <= 0) {
+        Close(serverfd);
+        if (serve_stale(connfd, f))
+            return 1;
+        if (rc < 0)
+            gateway_timeout(connfd, f);
+        return 0;
+    }
 
-    total_size = 0;
-    while ((n = Rio_readnb(&server_rio, buf, MAXLINE)) > 0) {
-        Rio_writen(connfd, buf, n);
-        if (total_size + n < MAX_OBJECT_SIZE) {
-            memcpy(response_buf + total_size, buf, n);
+    if (relay_response(connfd, f, &complete))
+        upstream_put(f->hostname, portstr, serverfd);
+    else
+        Close(serverfd);
+    return complete;
+}
+
+/*
+ * start_response - Send the request and read the status line into
+ *     f->buf. Returns 1 on success, 0 if the connection failed, and -1
+ *     if the origin did not answer in time.
+ */
+static int start_response(int serverfd, req_frame *f) {
+    int len = strlen(f->req_hdrs);
+    ssize_t n;
+
+    if (rio_writen(serverfd, f->req_hdrs, len) != len)
+        return 0;
+    Rio_readinitb(&f->server_rio, serverfd);
+    f->read_timeout = first_byte_timeout;
+    if ((n = server_readline(f)) <= 0)
+        return n < 0 && errno == ETIMEDOUT ? -1 : 0;
+    f->read_timeout = inter_byte_timeout;
+    return 1;
+}
+
+/*
+ * relay_response - Pass the response whose status line is in f->buf on
+ *     to the client as HTTP/1.0, a chunked body decoded, and cache it,
+ *     with the time it took to fetch, if it is complete, small enough and
+ *     its headers allow. Sets *complete if it was read in full. Returns 1
+ *     if the body was delimited by
+ *     Content-Length or chunked coding, was read in full, and the origin
+ *     keeps the connection open, i.e. if the connection can be reused.
+ */
+static int relay_response(int connfd, req_frame *f, int *complete) {
+    char version[16], lengthname[16];
+    int status = 0, keepalive, chunked = 0, nobody, total = 0;
+    long length = -1, expires;
+    unsigned long cost;
+
+    *complete = 0;
+    version[0] = '\0';
+    sscanf(f->buf, "%15s %d", version, &status);
+    keepalive = !strcmp(version, "HTTP/1.1");
+    nobody = (status >= 100 && status < 200) || status == 204
+             || status == 304;
+    if (status == 304 && f->revalidating)
+        return relay_revalidated(connfd, f, complete, keepalive);
+    if (status >= 500 && serve_stale(connfd, f)) {
+        *complete = 1;
+        return 0;               /* Leaving the error's body unread */
+    }
+    if (!strncmp(f->buf, "HTTP/1.1 ", 9))
+        f->buf[7] = '0';        /* Clients and the cache get HTTP/1.0 */
+    if (!forward(connfd, f, f->buf, strlen(f->buf), &total))
+        return 0;
+
+    while (1) {
+        if (server_readline(f) <= 0)
+            return 0;
+        if (!strcmp(f->buf, "\r\n"))
+            break;
+        if (!strncasecmp(f->buf, "Content-Length:", 15)) {
+            memcpy(lengthname, f->buf, 15);
+            lengthname[15] = '\0';
+            length = atol(f->buf + 15);
+            continue;           /* Sent below, unless chunked */
+        } else if (!strncasecmp(f->buf, "Transfer-Encoding:", 18)) {
+            /* Decoded below; other codings stay, e.g. gzip */
+            if ((chunked = has_token(f->buf + 18, "chunked"))
+                && !drop_token(f->buf + 18, "chunked"))
+                continue;
+        } else if (!strncasecmp(f->buf, "Connection:", 11)) {
+            if (has_token(f->buf + 11, "close"))
+                keepalive = 0;
+            else if (has_token(f->buf + 11, "keep-alive"))
+                keepalive = 1;
+        }
+
+        /* The client connection is still closed after one response */
+        if (upstream_keepalive && (!strncasecmp(f->buf, "Connection:", 11)
+                                   || !strncasecmp(f->buf, "Keep-Alive:", 11)))
+            continue;
+        if (!forward(connfd, f, f->buf, strlen(f->buf), &total))
+            return 0;
+    }
+    if (length >= 0 && !chunked) {
+        sprintf(f->buf, "%s %ld\r\n", lengthname, length);
+        if (!forward(connfd, f, f->buf, strlen(f->buf), &total))
+            return 0;
+    }
+    if (upstream_keepalive
+        && !forward(connfd, f, "Connection: close\r\n", 19, &total))
+        return 0;
+    if (!forward(connfd, f, "\r\n", 2, &total))
+        return 0;
+
+    if (nobody)
+        *complete = 1;
+    else if (chunked)
+        *complete = relay_chunked(connfd, f, &total);
+    else
+        *complete = relay_bytes(connfd, f, length, &total);
+
+    cost = now_ms() - f->started;
+    if (*complete && total < cache_max_object()
+        && (expires = cache_expiry(f->response_buf, total, cost)) >= 0)
+        cache_insert(f->uri, f->response_buf, total, cost, expires);
+
+    return *complete && keepalive && (nobody || chunked || length >= 0)
+           && f->server_rio.rio_cnt == 0;
+}
+
+/*
+ * relay_revalidated - Read the rest of a 304 to a request made conditional
+ *     on f->stale, refresh the stale copy from it, and send the client and
+ *     any followers the copy. Returns 1 if the connection can be reused.
+ */
+static int relay_revalidated(int connfd, req_frame *f, int *complete,
+                             int keepalive) {
+    int total = 0;
+    long expires;
+
+    /* Keep the headers only to work out the copy's new lifetime */
+    cache_append(&f->response_buf, &f->response_cap, &total, f->buf,
+                 strlen(f->buf));
+    while (1) {
+        if (server_readline(f) <= 0)
+            return 0;
+        if (!strcmp(f->buf, "\r\n"))
+            break;
+        if (!strncasecmp(f->buf, "Connection:", 11)) {
+            if (has_token(f->buf + 11, "close"))
+                keepalive = 0;
+            else if (has_token(f->buf + 11, "keep-alive"))
+                keepalive = 1;
+        }
+        cache_append(&f->response_buf, &f->response_cap, &total, f->buf,
+                     strlen(f->buf));
+    }
+
+    expires = cache_expiry_update(f->stale_data, f->stale_size,
+                                  f->response_buf, total,
+                                  now_ms() - f->started);
+    if (expires >= 0)
+        cache_refresh(f->stale, expires);
+
+    send_stale(connfd, f);
+    *complete = 1;
+    return keepalive && f->server_rio.rio_cnt == 0;
+}
+
+/*
+ * serve_stale - Send the client and any followers the stale copy in
+ *     place of a response the origin failed to give, if it is within its
+ *     stale-if-error grace. Returns 1 if it was sent.
+ */
+static int serve_stale(int connfd, req_frame *f) {
+    if (f->stale == NULL || !cache_use_stale(f->stale, 1))
+        return 0;
+    send_stale(connfd, f);
+    return 1;
+}
+
+static void send_stale(int connfd, req_frame *f) {
+    if (f->fill)
+        fill_append(f->fill, f->stale_data, f->stale_size);
+    if (!f->client_gone)
+        rio_writen(connfd, f->stale_data, f->stale_size);
+}
+
+/*
+ * add_validators - Make the request in f->req_hdrs conditional on a
+ *     cached copy's validators, in place of any conditions the client
+ *     set. Returns 0 if they do not fit.
+ */
+static int add_validators(req_frame *f, char *etag, char *modified) {
+    char *line, *eol;
+    int n = 0;
+
+    /* Every line ends in CRLF, the last one empty */
+    for (line = f->req_hdrs; strcmp(line, "\r\n"); line = eol + 1) {
+        eol = strchr(line, '\n');
+        if (strncasecmp(line, "If-None-Match:", 14)
+            && strncasecmp(line, "If-Modified-Since:", 18)) {
+            memcpy(f->buf + n, line, eol + 1 - line);
+            n += eol + 1 - line;
+        }
+    }
+    if (n + (etag ? strlen(etag) + 17 : 0)
+        + (modified ? strlen(modified) + 21 : 0) + 3 > MAXLINE)
+        return 0;
+    if (etag)
+        n += sprintf(f->buf + n, "If-None-Match: %s\r\n", etag);
+    if (modified)
+        n += sprintf(f->buf + n, "If-Modified-Since: %s\r\n", modified);
+    strcpy(f->buf + n, "\r\n");
+    strcpy(f->req_hdrs, f->buf);
+    return 1;
+}
+
+/* Relay len bytes of body, or everything up to EOF if len < 0 */
+static int relay_bytes(int connfd, req_frame *f, long len, int *total) {
+    int n, want;
+
+    while (len != 0) {
+        want = (len < 0 || len > MAXLINE) ? MAXLINE : len;
+        if ((n = server_readb(f, want)) < 0)
+            return 0;
+        if (n == 0)
+            return len < 0;
+        if (!forward(connfd, f, f->buf, n, total))
+            return 0;
+        if (len > 0)
+            len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Relay the data of a chunked body, which the client reads up to EOF as
+ * an HTTP/1.0 one. Chunk sizes and trailers are dropped.
+ */
+static int relay_chunked(int connfd, req_frame *f, int *total) {
+    long size;
+
+    while (1) {
+        if (server_readline(f) <= 0
+            || (size = strtol(f->buf, NULL, 16)) < 0)
+            return 0;
+        if (size == 0)
+            break;
+        if (!relay_bytes(connfd, f, size, total)
+            || server_readline(f) <= 0 || strcmp(f->buf, "\r\n"))
+            return 0;
+    }
+
+    do {
+        if (server_readline(f) <= 0)
+            return 0;
+    } while (strcmp(f->buf, "\r\n"));
+    return 1;
+}
+
+/*
+ * Write n bytes to the client and its followers and keep a copy for the
+ * cache. A leader whose client has gone carries on for its followers.
+ */
+static int forward(int connfd, req_frame *f, char *data, int n, int *total) {
+    if (f->fill)
+        fill_append(f->fill, data, n);
+    if (!f->client_gone && rio_writen(connfd, data, n) != n) {
+        if (f->fill == NULL || !fill_followed(f->fill))
+            return 0;
+        f->client_gone = 1;
+    }
+    cache_append(&f->response_buf, &f->response_cap, total, data, n);
+    return 1;
+}
+
+/*
+ * server_readline, server_readb - Read from the origin into f->buf,
+ *     waiting at most f->read_timeout ms for more data and never past
+ *     f->deadline. On timeout they fail with errno ETIMEDOUT.
+ */
+static ssize_t server_readline(req_frame *f) {
+    if (arm_timeout(f) < 0)
+        return -1;
+    return rio_readlineb(&f->server_rio, f->buf, MAXLINE);
+}
+
+static ssize_t server_readb(req_frame *f, int n) {
+    if (arm_timeout(f) < 0)
+        return -1;
+    return rio_readb(&f->server_rio, f->buf, n);
+}
+
+static int arm_timeout(req_frame *f) {
+    unsigned long now;
+    int timeout = f->read_timeout;
+
+    if (f->deadline) {
+        if ((now = now_ms()) >= f->deadline) {
+            errno = ETIMEDOUT;
+            return -1;
         }
-        total_size += n;
+        if (timeout < 0 || f->deadline - now < (unsigned long)timeout)
+            timeout = f->deadline - now;
     }
+    f->server_rio.rio_timeout = timeout;
+    return 0;
+}
+
+static void gateway_timeout(int connfd, req_frame *f) {
+    int total = 0;
 
-    if (total_size < MAX_OBJECT_SIZE)
-        cache_insert(uri, response_buf, total_size);
+    forward(connfd, f, gateway_timeout_msg, strlen(gateway_timeout_msg),
+            &total);
+}
+
+/* Does the comma-separated header value contain token? */
+static int has_token(char *value, char *token) {
+    int len = strlen(token);
+    char *p;
+
+    for (p = value; *p; p++)
+        if (!strncasecmp(p, token, len)
+            && (p == value || p[-1] == ' ' || p[-1] == ',' || p[-1] == '\t')
+            && (p[len] == '\0' || strchr(" ,;\t\r\n", p[len])))
+            return 1;
+    return 0;
+}
+
+/*
+ * Remove token from the comma-separated header value, which ends with
+ * CRLF, in place and without making it longer. Returns how many other
+ * elements are left.
+ */
+static int drop_token(char *value, char *token) {
+    char out[MAXLINE], *p = value, *start, *end;
+    int len = strlen(token), room = strlen(value) - 2, n = 0, outlen = 0;
+
+    while (*p && *p != '\r' && *p != '\n') {
+        for (start = p; *p && !strchr(",\r\n", *p); p++)
+            ;
+        end = p;
+        if (*p == ',')
+            p++;
+        while (start < end && (*start == ' ' || *start == '\t'))
+            start++;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        if (end == start || (end - start == len
+                             && !strncasecmp(start, token, len)))
+            continue;
+        if (outlen + 2 + (end - start) > room)
+            break;
+        outlen += sprintf(out + outlen, "%s%.*s", n++ ? ", " : " ",
+                          (int)(end - start), start);
+    }
+    sprintf(value, "%.*s\r\n", outlen, out);
+    return n;
+}
+
+static req_frame *frame_alloc(void) {
+    req_frame *f;
+
+    P(&frame_pool.mutex);
+    if ((f = frame_pool.free) != NULL) {
+        frame_pool.free = f->next;
+        frame_pool.nfree--;
+    }
+    V(&frame_pool.mutex);
+
+    if (f == NULL)
+        f = Calloc(1, sizeof(req_frame));
+    return f;
+}
+
+static void frame_free(req_frame *f) {
+    /* Idle frames keep no buffer grown for an object bound for disk */
+    if (f->response_cap > MAX_OBJECT_SIZE) {
+        free(f->response_buf);
+        f->response_buf = NULL;
+        f->response_cap = 0;
+    }
+
+    P(&frame_pool.mutex);
+    if (frame_pool.nfree < FRAME_POOLMAX) {
+        f->next = frame_pool.free;
+        frame_pool.free = f;
+        frame_pool.nfree++;
+        f = NULL;
+    }
+    V(&frame_pool.mutex);
+
+    if (f) {
+        free(f->response_buf);
+        Free(f);
+    }
+}
 
-    Close(clientfd);
+void frame_pool_init() {
+    frame_pool.free = NULL;
+    frame_pool.nfree = 0;
+    Sem_init(&frame_pool.mutex, 0, 1);
 }
 
 /* ---------------- parse_uri ---------------- */
@@ -135,12 +1103,6 @@ void parse_uri(char *uri, char *hostname, char *path, int *port) {
     else
         hostbegin = uri;
 
-    portpos = strchr(hostbegin, ':');
-    if (portpos != NULL) {
-        *port = atoi(portpos + 1);
-        *portpos = '\0';
-    }
-
     pathpos = strchr(hostbegin, '/');
     if (pathpos != NULL) {
         strcpy(path, pathpos);
@@ -149,85 +1111,77 @@ void parse_uri(char *uri, char *hostname, char *path, int *port) {
         strcpy(path, "/");
     }
 
+    portpos = strchr(hostbegin, ':');
+    if (portpos != NULL) {
+        *port = atoi(portpos + 1);
+        *portpos = '\0';
+    }
+
     strcpy(hostname, hostbegin);
 }
 
 /* ---------------- build_requesthdrs ---------------- */
-void build_requesthdrs(rio_t *client_rio, char *req_hdrs, char *hostname) {
-    char buf[MAXLINE];
-    int has_host = 0;
-
-    sprintf(req_hdrs, "GET %s HTTP/1.0\r\n", "/");
-    while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
-        if (strcmp(buf, "\r\n") == 0) break;
-        if (!strncasecmp(buf, "Host:", 5)) has_host = 1;
-        if (strncasecmp(buf, "Connection:", 11)
-            && strncasecmp(buf, "Proxy-Connection:", 17)
-            && strncasecmp(buf, "User-Agent:", 11)) {
-            strcat(req_hdrs, buf);
-        }
-    }
-    if (!has_host)
-        sprintf(req_hdrs + strlen(req_hdrs), "Host: %s\r\n", hostname);
 
-    strcat(req_hdrs, "Connection: close\r\n");
-    strcat(req_hdrs, "Proxy-Connection: close\r\n");
-    strcat(req_hdrs, "User-Agent: Mozilla/5.0\r\n\r\n");
-}
-
-/* ---------------- Cache Implementation ---------------- */
-void cache_init() {
-    cache.head = NULL;
-    cache.tail = NULL;
-    cache.total_size = 0;
-    Sem_init(&cache.mutex, 0, 1);
-}
+/*
+ * build_requesthdrs - Write into req_hdrs, of MAXLINE bytes, the request
+ *     for path to send hostname: the client's headers in the head hp
+ *     parsed, less those the proxy sets itself, then ours. Returns -1 if
+ *     they do not fit.
+ */
+int build_requesthdrs(char *req_hdrs, char *head, http_parser *hp,
+                      char *hostname, char *path, int keepalive) {
+    /* Leave room for finish_requesthdrs() */
+    int room = MAXLINE - strlen(hostname) - 128;
+    int i, n, has_host = 0;
+    http_header *h;
 
-int cache_find(char *url, int connfd) {
-    cache_block *p;
-    P(&cache.mutex);
-    p = cache.head;
-    while (p) {
-        if (strcmp(url, p->url) == 0) {
-            Rio_writen(connfd, p->data, p->size);
-            V(&cache.mutex);
-            return 1;
-        }
-        p = p->next;
+    if ((int)strlen(path) + 16 > room)
+        return -1;
+    n = sprintf(req_hdrs, "GET %s %s\r\n", path,
+                keepalive ? "HTTP/1.1" : "HTTP/1.0");
+    for (i = 0; i < hp->nheaders; i++) {
+        h = &hp->headers[i];
+        if (http_span_is(head, h->name, "Connection")
+            || http_span_is(head, h->name, "Proxy-Connection")
+            || http_span_is(head, h->name, "User-Agent"))
+            continue;
+        has_host |= http_span_is(head, h->name, "Host");
+        if (n + h->name.len + h->value.len + 4 > room)
+            return -1;
+        memcpy(req_hdrs + n, head + h->name.off, h->name.len);
+        n += h->name.len;
+        req_hdrs[n++] = ':';
+        req_hdrs[n++] = ' ';
+        memcpy(req_hdrs + n, head + h->value.off, h->value.len);
+        n += h->value.len;
+        req_hdrs[n++] = '\r';
+        req_hdrs[n++] = '\n';
     }
-    V(&cache.mutex);
+    req_hdrs[n] = '\0';
+    finish_requesthdrs(req_hdrs, hostname, has_host, keepalive);
     return 0;
 }
 
-void cache_insert(char *url, char *buf, int size) {
-    cache_block *new_block;
-
-    if (size > MAX_OBJECT_SIZE) return;
+/* Ask for a persistent connection if keepalive, else for close */
+void finish_requesthdrs(char *req_hdrs, char *hostname, int has_host,
+                        int keepalive) {
+    if (!has_host)
+        sprintf(req_hdrs + strlen(req_hdrs), "Host: %s\r\n", hostname);
 
-    P(&cache.mutex);
-    while (cache.total_size + size > MAX_CACHE_SIZE) {
-        cache_block *victim = cache.tail;
-        if (victim == NULL) break;
-        if (victim->prev)
-            victim->prev->next = NULL;
-        cache.tail = victim->prev;
-        cache.total_size -= victim->size;
-        Free(victim);
+    if (keepalive) {
+        strcat(req_hdrs, "Connection: keep-alive\r\n");
+        strcat(req_hdrs, "Proxy-Connection: keep-alive\r\n");
+    } else {
+        strcat(req_hdrs, "Connection: close\r\n");
+        strcat(req_hdrs, "Proxy-Connection: close\r\n");
     }
+    strcat(req_hdrs, "User-Agent: Mozilla/5.0\r\n\r\n");
+}
 
-    new_block = Malloc(sizeof(cache_block));
-    strcpy(new_block->url, url);
-    memcpy(new_block->data, buf, size);
-    new_block->size = size;
-    new_block->prev = NULL;
-    new_block->next = cache.head;
-
-    if (cache.head)
-        cache.head->prev = new_block;
-    cache.head = new_block;
-    if (cache.tail == NULL)
-        cache.tail = new_block;
+/* Milliseconds on the monotonic clock, for deadlines */
+unsigned long now_ms(void) {
+    struct timespec ts;
 
-    cache.total_size += size;
-    V(&cache.mutex);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
 }
@@ -0,0 +1,159 @@
+/*
+ * proxy.h - Declarations shared by the proxy's server modes
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+/* Shards whose budgets still fit the largest entry and some bookkeeping */
+#define CACHE_MAXSHARDS (MAX_CACHE_SIZE / (MAX_OBJECT_SIZE + MAXLINE + 1024))
+#define DISK_SEGSIZE (8 << 20) /* Bytes per disk segment, and largest object */
+#define DISK_CACHE_SIZE 64 /* Default MB for the disk tier */
+#define CACHE_DEFAULT_TTL 300 /* Default seconds fresh, for responses that
+                                 give no lifetime */
+#define CACHE_STALE_GRACE 0 /* Default seconds a stale response may be
+                               served, while refreshed or on errors */
+
+#define NTHREADS 16     /* Default worker threads in pool mode */
+#define SBUFSIZE 64     /* Default connection queue depth in pool mode */
+#define SHARD_NTHREADS 4 /* Default workers per core in shard mode */
+#define FRAME_POOLMAX 256 /* Idle request frames kept for reuse */
+#define UPSTREAM_IDLE_TIMEOUT 10 /* Default idle seconds for pooled conns */
+#define CONNECT_TIMEOUT 5 /* Default seconds to connect to an origin */
+#define CONNECT_MAXRACE 16 /* Connect attempts in flight per origin */
+#define CONNECT_DELAY 250 /* ms before racing the origin's next address */
+#define FIRST_BYTE_TIMEOUT 30 /* Default seconds to wait for a response */
+#define INTER_BYTE_TIMEOUT 30 /* Default seconds a response may stall */
+#define REQUEST_TIMEOUT 120 /* Default seconds for a whole response */
+#define DNS_TTL 60      /* Default seconds to cache a resolved name */
+#define DNS_NEG_TTL 5   /* Default seconds to cache a failed lookup */
+#define DNS_TIMEOUT 5   /* Default seconds doit() waits for a lookup */
+#define DNS_NRESOLVERS 4 /* Default resolver threads */
+
+/* Request head parser (http.c) */
+#define HTTP_MAXHEADERS 100
+typedef struct {
+    int off, len;           /* Bytes of the head they span */
+} http_span;
+typedef struct {
+    http_span name, value;
+} http_header;
+typedef struct {
+    int state;
+    int off;                /* Start of the line being parsed; once the
+                               head is complete, its length */
+    int scanned;            /* Bytes searched for the end of that line */
+    http_span method, uri, version;
+    http_header headers[HTTP_MAXHEADERS];
+    int nheaders;
+} http_parser;
+void http_parser_init(http_parser *hp);
+int http_parse(http_parser *hp, char *buf, int len);
+int http_span_is(char *buf, http_span s, char *str);
+
+/* Request handling (proxy.c) */
+void frame_pool_init();
+void doit(int connfd);
+void parse_uri(char *uri, char *hostname, char *path, int *port);
+int build_requesthdrs(char *req_hdrs, char *head, http_parser *hp,
+                      char *hostname, char *path, int keepalive);
+void finish_requesthdrs(char *req_hdrs, char *hostname, int has_host,
+                        int keepalive);
+unsigned long now_ms(void);
+void refresh_ahead_init(int budget);
+extern int first_byte_timeout, inter_byte_timeout, request_timeout;
+extern char gateway_timeout_msg[];
+
+/* Server modes (proxy.c) */
+void *worker(void *vargp);
+void sigusr1_handler(int sig);
+
+/* Cache (cache.c) */
+typedef struct cache_block cache_block;
+int cache_init(int nshards, char *policy);
+uint64_t cache_hash(char *url);
+int cache_find(char *url, int connfd);
+cache_block *cache_lookup(char *url, char **data, int *size);
+void cache_release(cache_block *p);
+void cache_insert(char *url, char *buf, int size, unsigned long cost,
+                  long expires);
+cache_block *cache_stale(char *url, char **data, int *size, char **etag,
+                        char **modified);
+void cache_refresh(cache_block *p, long expires);
+int cache_use_stale(cache_block *p, int error);
+long cache_expiry(char *buf, int size, unsigned long cost);
+long cache_expiry_update(char *buf, int size, char *update, int usize,
+                         unsigned long cost);
+void cache_expire_init(int default_ttl, int grace);
+int cache_hot(char (*urls)[MAXLINE], int n);
+void cache_count_ahead(char *url);
+int cache_max_object(void);
+void cache_append(char **buf, int *cap, int *size, char *data, int n);
+void cache_report(void);
+long cache_blocks(void);
+void disk_init(char *dir, long budget);
+void cache_persist(char *path);
+int cache_load(char *path);
+int cache_save(char *path);
+
+/* Upstream connection pool (upstream.c) */
+extern int upstream_keepalive;
+void upstream_init(int max_idle, int max_active, int idle_timeout,
+                   int connect_timeout);
+int upstream_acquire(char *host, char *port);
+void upstream_release(char *host, char *port);
+int upstream_connect(char *host, char *port);
+int upstream_connect_timeout(void);
+int upstream_get(char *host, char *port);
+void upstream_put(char *host, char *port, int fd);
+
+/* Name resolution cache and resolver pool (dns.c) */
+typedef struct dns_entry dns_entry;
+typedef struct {
+    unsigned long hits;     /* Lookups answered from the cache */
+    unsigned long neg_hits; /* Lookups answered by a cached failure */
+    unsigned long joined;   /* Lookups that waited for the same name */
+    unsigned long misses;   /* Lookups queued to the resolvers */
+    unsigned long timeouts; /* dns_resolve() calls that gave up */
+} dns_stats_t;
+extern dns_stats_t dns_stats;
+void dns_init(int ttl, int neg_ttl, int timeout, int nresolvers);
+dns_entry *dns_lookup(char *hostname, char *port);
+int dns_fd(dns_entry *e);
+int dns_result(dns_entry *e, struct addrinfo **list);
+dns_entry *dns_resolve(char *hostname, char *port, struct addrinfo **list,
+                       int timeout);
+void dns_release(dns_entry *e);
+
+/* Collapsed forwarding of concurrent misses (inflight.c) */
+typedef struct fill fill_t;
+typedef struct {
+    unsigned long leaders;      /* Misses that fetched from the origin */
+    unsigned long followers;    /* Misses that shared a leader's fetch */
+} fill_stats_t;
+extern fill_stats_t fill_stats;
+void fill_init(void);
+fill_t *fill_join(char *url, int *leader);
+fill_t *fill_lead(char *url);
+void fill_append(fill_t *fl, char *data, int n);
+int fill_followed(fill_t *fl);
+void fill_finish(fill_t *fl, int ok);
+long fill_follow(fill_t *fl, int connfd);
+void fill_release(fill_t *fl);
+
+/* Per-core sharded listeners (shard.c) */
+void shard_serve(char *port, int nthreads, int qdepth);
+
+/* Event-loop server mode (epoll.c) */
+void epoll_serve(int listenfd, int nloops);
+
+/* io_uring server mode (uring.c) */
+void uring_serve(int listenfd, int nrings);
+
+/* Coroutine server mode (coro.c) */
+void coro_serve(int listenfd, int nscheds);
+
+#endif /* __PROXY_H__ */
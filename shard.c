@@ -0,0 +1,128 @@
+/*
+ * shard.c - Per-core sharded listeners (-m shard)
+ *
+ * Every CPU the proxy may run on gets its own SO_REUSEPORT listening
+ * socket, accept thread, sbuf and set of workers, all pinned to that
+ * CPU.  There is no shared accept queue, so accepting scales with the
+ * number of cores and a connection is served on the core that accepted
+ * it.  When the CPUs are numbered 0..n-1, a classic BPF program on the
+ * reuseport group also hands each new connection to the listener of the
+ * CPU whose softirq received it.
+ */
+#include "proxy.h"
+#include "sbuf.h"
+#include <sys/syscall.h>
+#include <linux/filter.h>
+
+#define MAX_CPUS 1024
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+typedef struct {
+    int cpu;
+    int listenfd;
+    sbuf_t sbuf;
+} shard_t;
+
+static void *acceptor(void *vargp);
+static void *shard_worker(void *vargp);
+static void pin_to_cpu(int cpu);
+static void steer_by_cpu(int listenfd);
+
+void shard_serve(char *port, int nthreads, int qdepth) {
+    unsigned long mask[MAX_CPUS / LONG_BITS];
+    shard_t *shards;
+    pthread_t tid;
+    int ncpus, cpu, i, j;
+
+    /* One shard per CPU in our affinity mask */
+    memset(mask, 0, sizeof(mask));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0)
+        unix_error("sched_getaffinity error");
+    ncpus = 0;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++)
+        if (mask[cpu / LONG_BITS] & (1UL << (cpu % LONG_BITS)))
+            ncpus++;
+
+    shards = Calloc(ncpus, sizeof(shard_t));
+    for (cpu = 0, i = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(mask[cpu / LONG_BITS] & (1UL << (cpu % LONG_BITS))))
+            continue;
+        shards[i].cpu = cpu;
+        shards[i].listenfd = Open_listenfd_reuseport(port);
+        sbuf_init(&shards[i].sbuf, qdepth);
+        i++;
+    }
+
+    /* The BPF program returns a CPU number, used as the listener index */
+    if (shards[ncpus - 1].cpu == ncpus - 1)
+        steer_by_cpu(shards[0].listenfd);
+
+    for (i = 0; i < ncpus; i++) {
+        for (j = 0; j < nthreads; j++)
+            Pthread_create(&tid, NULL, shard_worker, &shards[i]);
+        Pthread_create(&tid, NULL, acceptor, &shards[i]);
+    }
+    fprintf(stderr, "shard: %d listeners, %d workers each\n", ncpus,
+            nthreads);
+
+    while (1)
+        pause();
+}
+
+static void *acceptor(void *vargp) {
+    shard_t *sh = vargp;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    int connfd;
+
+    Pthread_detach(pthread_self());
+    pin_to_cpu(sh->cpu);
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(sh->listenfd, (SA *)&clientaddr, &clientlen);
+        sbuf_insert(&sh->sbuf, connfd);
+    }
+    return NULL;
+}
+
+static void *shard_worker(void *vargp) {
+    shard_t *sh = vargp;
+
+    pin_to_cpu(sh->cpu);
+    return worker(&sh->sbuf);
+}
+
+/* Pin the calling thread; failure only costs locality, so just warn */
+static void pin_to_cpu(int cpu) {
+    unsigned long mask[MAX_CPUS / LONG_BITS];
+
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / LONG_BITS] |= 1UL << (cpu % LONG_BITS);
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+        fprintf(stderr, "shard: cannot pin to cpu %d: %s\n",
+                cpu, strerror(errno));
+}
+
+/*
+ * steer_by_cpu - Attach "return the current CPU" to the reuseport group
+ *     of listenfd, so the kernel picks the listener created for the CPU
+ *     that handled the incoming SYN.
+ */
+static void steer_by_cpu(int listenfd) {
+    struct sock_filter code[2];
+    struct sock_fprog prog;
+
+    code[0].code = BPF_LD | BPF_W | BPF_ABS;
+    code[0].jt = code[0].jf = 0;
+    code[0].k = SKF_AD_OFF + SKF_AD_CPU;
+    code[1].code = BPF_RET | BPF_A;
+    code[1].jt = code[1].jf = 0;
+    code[1].k = 0;
+    prog.len = 2;
+    prog.filter = code;
+
+    if (setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) < 0)
+        fprintf(stderr, "shard: cannot attach reuseport program: %s\n",
+                strerror(errno));
+}
@@ -0,0 +1,303 @@
+/*
+ * snapshot.c - Saving the cache on shutdown and loading it on startup
+ *
+ * With -p file, SIGTERM makes the proxy write every fresh entry in memory
+ * to file before exiting: its URL, object, fetch cost, expiry and hit
+ * count, whose hits are replayed to the eviction policy when it comes
+ * back.  SIGTERM is blocked in every thread and taken by one that waits
+ * for it, so the snapshot is written outside signal context, under the
+ * shards' read locks, to a temporary file that is then renamed over the
+ * old one.
+ *
+ * On startup the file is mapped rather than read, and only the record
+ * headers are walked, to index the entries by URL hash.  An entry is
+ * copied into the cache the first time it is asked for, so bodies that
+ * are never requested again are never read from disk, and startup does
+ * not wait on the size of the file.  Entries still waiting to be asked
+ * for at the next SIGTERM are saved again, after those in memory, as
+ * long as the objects saved add up to no more than MAX_CACHE_SIZE.
+ *
+ * The file is a snap_header, then for each entry a snap_record, the URL
+ * and its NUL, and the object, padded to 8 bytes.
+ */
+#include "cache.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAP_MAGIC      "PXYSNAP2"
+#define SNAP_ALIGN(n)   (((n) + 7) & ~7UL)
+
+typedef struct {
+    char magic[8];
+    char policy[16];            /* The policy the hit counts were under */
+    unsigned int count;
+    unsigned int pad;
+} snap_header;
+
+typedef struct {
+    uint64_t hash;
+    unsigned int urllen;
+    unsigned int size;
+    unsigned int cost;
+    unsigned int hits;
+    int64_t expires;            /* As cache_block's */
+} snap_record;
+
+/* Where cache_save() is writing to */
+typedef struct {
+    FILE *fp;
+    unsigned int count;
+    long bytes;                 /* Object bytes written */
+    long now;                   /* Stale entries are left out */
+} snap_writer;
+
+/* An entry not yet taken back into the cache */
+typedef struct snap_entry {
+    snap_record *rec;
+    struct snap_entry *next;
+} snap_entry;
+
+static struct {
+    char *map;
+    size_t len;
+    snap_entry *entries;        /* One allocation for all of them */
+    snap_entry **buckets;
+    unsigned long nbuckets;     /* A power of two */
+    int same_policy;            /* Hit counts are worth replaying */
+    sem_t mutex;
+} snap;
+
+int snapshot_pending;           /* Entries not yet taken */
+
+static char *snapshot_path;
+
+static void *snapshot_thread(void *vargp);
+static void save_record(cache_block *p, void *arg);
+static void write_record(snap_writer *w, snap_record *r, char *url,
+                         char *data);
+static snap_entry *unlink_entry(char *url, uint64_t hash);
+
+/*
+ * cache_persist - Load the snapshot in path, if there is one, and save
+ *     the cache there on SIGTERM. Call before starting any thread.
+ */
+void cache_persist(char *path) {
+    sigset_t set;
+    pthread_t tid;
+    int rc;
+
+    snapshot_path = path;
+    cache_load(path);
+
+    Sigemptyset(&set);
+    Sigaddset(&set, SIGTERM);
+    if ((rc = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0)
+        posix_error(rc, "pthread_sigmask error");
+    Pthread_create(&tid, NULL, snapshot_thread, NULL);
+}
+
+/*
+ * cache_load - Map the snapshot in path and index its entries. Returns
+ *     how many, or -1 if there is no usable snapshot.
+ */
+int cache_load(char *path) {
+    snap_header *h;
+    snap_record *r;
+    snap_entry *e;
+    struct stat st;
+    size_t off;
+    unsigned i, n;
+    int fd;
+
+    Sem_init(&snap.mutex, 0, 1);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header)) {
+        close(fd);
+        return -1;
+    }
+    snap.len = st.st_size;
+    snap.map = Mmap(NULL, snap.len, PROT_READ, MAP_PRIVATE, fd, 0);
+    Close(fd);
+
+    h = (snap_header *)snap.map;
+    if (memcmp(h->magic, SNAP_MAGIC, 8)) {
+        Munmap(snap.map, snap.len);
+        snap.map = NULL;
+        return -1;
+    }
+    snap.same_policy = !strncmp(h->policy, cache_policy_name(),
+                                sizeof(h->policy));
+    for (snap.nbuckets = 64; snap.nbuckets < h->count; snap.nbuckets *= 2)
+        ;
+    snap.buckets = Calloc(snap.nbuckets, sizeof(snap_entry *));
+    snap.entries = Malloc((h->count ? h->count : 1) * sizeof(snap_entry));
+
+    /* Stop at the first record that runs past the end, whose URL is not
+       the length it says, or too large for memory: cache_max_object()
+       is the disk tier's limit with -o, and snapshots hold only entries
+       from memory */
+    off = sizeof(snap_header);
+    for (n = i = 0; i < h->count; i++) {
+        r = (snap_record *)(snap.map + off);
+        if (off + sizeof(snap_record) > snap.len
+            || r->size > MAX_OBJECT_SIZE
+            || r->urllen >= MAXLINE
+            || off + sizeof(snap_record) + r->urllen + 1 + r->size
+               > snap.len
+            || strnlen((char *)(r + 1), r->urllen + 1) != r->urllen)
+            break;
+        off += SNAP_ALIGN(sizeof(snap_record) + r->urllen + 1 + r->size);
+        e = &snap.entries[n++];
+        e->rec = r;
+        e->next = snap.buckets[r->hash & (snap.nbuckets - 1)];
+        snap.buckets[r->hash & (snap.nbuckets - 1)] = e;
+    }
+    __atomic_store_n(&snapshot_pending, n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * cache_save - Write every entry in the cache to path. Returns how many,
+ *     or -1 on error.
+ */
+int cache_save(char *path) {
+    char tmp[MAXLINE];
+    snap_header h;
+    snap_writer w;
+    snap_entry *e;
+    snap_record r;
+    unsigned long i;
+    int failed;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((w.fp = fopen(tmp, "w")) == NULL)
+        return -1;
+    w.count = 0;
+    w.bytes = 0;
+    w.now = time(NULL);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, 8);
+    strncpy(h.policy, cache_policy_name(), sizeof(h.policy));
+    fwrite(&h, sizeof(h), 1, w.fp);
+
+    cache_walk(save_record, &w);
+
+    /* Carry over what was loaded and not asked for since, as room allows */
+    if (snap.buckets) {
+        P(&snap.mutex);
+        for (i = 0; i < snap.nbuckets; i++)
+            for (e = snap.buckets[i]; e; e = e->next) {
+                r = *e->rec;
+                if (w.bytes + r.size > MAX_CACHE_SIZE
+                    || CACHE_EXPIRED(r.expires, w.now))
+                    continue;
+                if (!snap.same_policy)
+                    r.hits = 0;
+                write_record(&w, &r, (char *)(e->rec + 1),
+                             (char *)(e->rec + 1) + r.urllen + 1);
+            }
+        V(&snap.mutex);
+    }
+
+    /* The count goes in last, once it is known */
+    h.count = w.count;
+    rewind(w.fp);
+    fwrite(&h, sizeof(h), 1, w.fp);
+    failed = ferror(w.fp);
+    if (fclose(w.fp) != 0 || failed || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return h.count;
+}
+
+/*
+ * snapshot_take - Move the snapshot's copy of url into the cache and
+ *     return it pinned, or return NULL if there is none or it is stale.
+ */
+cache_block *snapshot_take(char *url, uint64_t hash) {
+    snap_entry *e;
+    snap_record *r;
+
+    P(&snap.mutex);
+    e = unlink_entry(url, hash);
+    V(&snap.mutex);
+    if (e == NULL || CACHE_EXPIRED(e->rec->expires, time(NULL)))
+        return NULL;
+    r = e->rec;
+    return cache_restore(url, hash, (char *)(r + 1) + r->urllen + 1,
+                         r->size, r->cost, r->expires,
+                         snap.same_policy ? r->hits : 0);
+}
+
+/* Drop the snapshot's copy of url, once a newer one is fetched */
+void snapshot_forget(char *url, uint64_t hash) {
+    P(&snap.mutex);
+    unlink_entry(url, hash);
+    V(&snap.mutex);
+}
+
+/* ---------------- Internals ---------------- */
+static void *snapshot_thread(void *vargp) {
+    sigset_t set;
+    int sig, n;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    Sigemptyset(&set);
+    Sigaddset(&set, SIGTERM);
+    sigwait(&set, &sig);
+
+    if ((n = cache_save(snapshot_path)) < 0)
+        fprintf(stderr, "Could not save the cache to %s: %s\n",
+                snapshot_path, strerror(errno));
+    else
+        printf("Saved %d cached objects to %s\n", n, snapshot_path);
+    exit(0);
+}
+
+static void save_record(cache_block *p, void *arg) {
+    snap_writer *w = arg;
+    snap_record r;
+
+    if (CACHE_EXPIRED(CACHE_EXPIRES(p), w->now))
+        return;
+    r.hash = p->hash;
+    r.urllen = strlen(p->url);
+    r.size = p->size;
+    r.cost = p->cost;
+    r.hits = p->hits;
+    r.expires = CACHE_EXPIRES(p);
+    write_record(w, &r, p->url, p->data);
+}
+
+static void write_record(snap_writer *w, snap_record *r, char *url,
+                         char *data) {
+    static char zeros[8];
+    size_t len = sizeof(*r) + r->urllen + 1 + r->size;
+
+    fwrite(r, sizeof(*r), 1, w->fp);
+    fwrite(url, r->urllen + 1, 1, w->fp);
+    fwrite(data, r->size, 1, w->fp);
+    fwrite(zeros, SNAP_ALIGN(len) - len, 1, w->fp);
+    w->count++;
+    w->bytes += r->size;
+}
+
+/* Take url's entry out of the index, if it is there */
+static snap_entry *unlink_entry(char *url, uint64_t hash) {
+    snap_entry *e, **ep;
+
+    if (snap.buckets == NULL)
+        return NULL;
+    for (ep = &snap.buckets[hash & (snap.nbuckets - 1)]; (e = *ep) != NULL;
+         ep = &e->next)
+        if (e->rec->hash == hash && !strcmp((char *)(e->rec + 1), url)) {
+            *ep = e->next;
+            __atomic_sub_fetch(&snapshot_pending, 1, __ATOMIC_RELAXED);
+            return e;
+        }
+    return NULL;
+}
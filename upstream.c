@@ -0,0 +1,414 @@
+/*
+ * upstream.c - Pool of idle persistent connections to origin servers
+ *
+ * doit() asks upstream_get() for a warm connection to host:port before
+ * opening a new one, and hands the connection back with upstream_put()
+ * once a response has been read completely.  At most max_idle
+ * connections are kept per origin; connections idle for longer than
+ * idle_timeout seconds, or closed by the origin, are dropped lazily on
+ * access and by a reaper thread.
+ *
+ * With max_active set, doit() also takes one of an origin's max_active
+ * slots with upstream_acquire() for as long as it uses a connection to
+ * it, so that a burst of misses cannot open any number of connections
+ * to one host.  Requests beyond the limit queue, first come first
+ * served, each slot passing straight to the oldest waiter when it is
+ * released, and give up after the connect timeout.
+ *
+ * New connections are opened by upstream_connect(), which races the
+ * origin's addresses in the manner of RFC 8305 ("Happy Eyeballs").
+ */
+#include "proxy.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#define UPSTREAM_BUCKETS 256
+
+typedef struct idle_conn {
+    int fd;
+    time_t since;           /* When it went idle */
+    struct idle_conn *next;
+} idle_conn;
+
+/* A request waiting for a slot, woken through efd when it is given one */
+typedef struct slot_waiter {
+    int efd;
+    int granted;
+    struct slot_waiter *next;
+} slot_waiter;
+
+typedef struct origin {
+    char *key;              /* "host:port" */
+    idle_conn *idle;        /* Most recently used first */
+    int nidle;
+    int nactive;            /* Slots taken with upstream_acquire() */
+    slot_waiter *waiters;   /* Oldest first */
+    struct origin *next;
+} origin;
+
+static struct {
+    origin *buckets[UPSTREAM_BUCKETS];
+    int max_idle;
+    int max_active;         /* 0: no limit */
+    int idle_timeout;
+    int connect_timeout;    /* ms */
+    sem_t mutex;
+} pool;
+
+int upstream_keepalive = 0;
+
+static origin *find_origin(char *host, char *port, int create);
+static void drop_expired(origin *o, time_t now);
+static int conn_alive(int fd);
+static void *reaper(void *vargp);
+static int start_attempt(int epfd, struct addrinfo *p, int *done);
+static int wait_attempts(int epfd, struct epoll_event *events, int timeout);
+static void wait_slot(slot_waiter *w, int timeout);
+
+void upstream_init(int max_idle, int max_active, int idle_timeout,
+                   int connect_timeout) {
+    pthread_t tid;
+
+    memset(pool.buckets, 0, sizeof(pool.buckets));
+    pool.max_idle = max_idle;
+    pool.max_active = max_active;
+    pool.idle_timeout = idle_timeout;
+    pool.connect_timeout = connect_timeout;
+    Sem_init(&pool.mutex, 0, 1);
+    upstream_keepalive = max_idle > 0;
+    if (upstream_keepalive)
+        Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/*
+ * upstream_get - Return an idle connection to host:port that still
+ *     looks usable, or -1 if there is none.
+ */
+int upstream_get(char *host, char *port) {
+    origin *o;
+    idle_conn *ic;
+    int fd;
+
+    if (!upstream_keepalive)
+        return -1;
+
+    while (1) {
+        P(&pool.mutex);
+        o = find_origin(host, port, 0);
+        if (o) drop_expired(o, time(NULL));
+        if (o == NULL || (ic = o->idle) == NULL) {
+            V(&pool.mutex);
+            return -1;
+        }
+        o->idle = ic->next;
+        o->nidle--;
+        V(&pool.mutex);
+
+        fd = ic->fd;
+        Free(ic);
+        if (conn_alive(fd))
+            return fd;
+        close(fd);          /* Closed by the origin meanwhile */
+    }
+}
+
+/* Keep fd for reuse, or close it if the origin already has enough */
+void upstream_put(char *host, char *port, int fd) {
+    origin *o;
+    idle_conn *ic;
+
+    if (!upstream_keepalive) {
+        close(fd);
+        return;
+    }
+
+    P(&pool.mutex);
+    o = find_origin(host, port, 1);
+    if (o->nidle >= pool.max_idle) {
+        V(&pool.mutex);
+        close(fd);
+        return;
+    }
+    ic = Malloc(sizeof(idle_conn));
+    ic->fd = fd;
+    ic->since = time(NULL);
+    ic->next = o->idle;
+    o->idle = ic;
+    o->nidle++;
+    V(&pool.mutex);
+}
+
+/*
+ * upstream_acquire - Take one of host:port's slots, waiting up to the
+ *     connect timeout for one to be released if all are taken. Returns
+ *     0 once it has one, -1 if it timed out.
+ */
+int upstream_acquire(char *host, char *port) {
+    slot_waiter w, **pp;
+    origin *o;
+    int rc;
+
+    if (!pool.max_active)
+        return 0;
+
+    P(&pool.mutex);
+    o = find_origin(host, port, 1);
+    if (o->nactive < pool.max_active) {
+        o->nactive++;
+        V(&pool.mutex);
+        return 0;
+    }
+    if ((w.efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        V(&pool.mutex);
+        return -1;
+    }
+    w.granted = 0;
+    w.next = NULL;
+    for (pp = &o->waiters; *pp; pp = &(*pp)->next)
+        ;
+    *pp = &w;
+    V(&pool.mutex);
+
+    wait_slot(&w, pool.connect_timeout);
+
+    P(&pool.mutex);
+    if ((rc = w.granted ? 0 : -1) < 0) {
+        for (pp = &o->waiters; *pp != &w; pp = &(*pp)->next)
+            ;
+        *pp = w.next;           /* Timed out, still queued */
+    }
+    V(&pool.mutex);
+    close(w.efd);
+    return rc;
+}
+
+/* Give back a slot taken with upstream_acquire(), to the oldest waiter */
+void upstream_release(char *host, char *port) {
+    slot_waiter *w;
+    uint64_t one = 1;
+    origin *o;
+
+    if (!pool.max_active)
+        return;
+
+    P(&pool.mutex);
+    o = find_origin(host, port, 1);
+    if ((w = o->waiters) != NULL) {
+        o->waiters = w->next;
+        w->granted = 1;         /* The slot passes on: nactive stays */
+        if (write(w->efd, &one, sizeof(one)) < 0)
+            unix_error("eventfd write error");
+    } else {
+        o->nactive--;
+    }
+    V(&pool.mutex);
+}
+
+/* The connect timeout in ms, for the event loops' own connects */
+int upstream_connect_timeout(void) {
+    return pool.connect_timeout;
+}
+
+/*
+ * upstream_connect - Open a new connection to host:port. The addresses
+ *     are tried in dns.c's order; whenever no attempt has succeeded for
+ *     CONNECT_DELAY ms, or the last one failed, the next one starts
+ *     alongside those still pending. The first to connect wins. Returns
+ *     -2 if the name did not resolve, -1 if nothing connected within
+ *     the connect timeout.
+ */
+int upstream_connect(char *host, char *port) {
+    struct epoll_event events[CONNECT_MAXRACE];
+    int fds[CONNECT_MAXRACE];
+    struct addrinfo *list, *next;
+    unsigned long now, deadline, next_start;
+    int epfd, fd = -1, nfds = 0, pending = 0, err, i, n, timeout;
+    socklen_t len;
+    dns_entry *e;
+
+    if ((e = dns_resolve(host, port, &list, -1)) == NULL)
+        return -2;
+    if ((epfd = epoll_create1(0)) < 0) {
+        dns_release(e);
+        return -1;
+    }
+
+    now = now_ms();
+    deadline = now + pool.connect_timeout;
+    next_start = now;
+    next = list;
+    while (fd < 0 && now < deadline && (next || pending)) {
+        if (next && now >= next_start && nfds < CONNECT_MAXRACE) {
+            if ((fds[nfds] = start_attempt(epfd, next, &n)) >= 0) {
+                if (n) {
+                    fd = fds[nfds++];   /* Connected at once */
+                    break;
+                }
+                nfds++;
+                pending++;
+                next_start = now + CONNECT_DELAY;
+            }
+            next = next->ai_next;
+            continue;
+        }
+
+        /* Here next_start > now, unless no attempt can be added */
+        timeout = deadline - now;
+        if (next && nfds < CONNECT_MAXRACE && next_start < deadline)
+            timeout = next_start - now;
+        n = wait_attempts(epfd, events, timeout);
+        for (i = 0; i < n && fd < 0; i++) {
+            err = 0;
+            len = sizeof(err);
+            if (getsockopt(events[i].data.fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+                && err == 0) {
+                fd = events[i].data.fd;
+            } else {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+                pending--;
+                next_start = now_ms();  /* Failed: start the next now */
+            }
+        }
+        now = now_ms();
+    }
+
+    for (i = 0; i < nfds; i++)
+        if (fds[i] != fd)
+            close(fds[i]);
+    close(epfd);
+    dns_release(e);
+    if (fd < 0) {
+        fprintf(stderr, "upstream: cannot connect to %s:%s\n", host, port);
+        return -1;
+    }
+    if (!rio_wait)          /* Coroutines keep non-blocking sockets */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return fd;
+}
+
+/*
+ * start_attempt - Start a non-blocking connect to p and watch it on
+ *     epfd. Sets *done if it connected at once. Returns -1 if the
+ *     attempt failed right away.
+ */
+static int start_attempt(int epfd, struct addrinfo *p, int *done) {
+    struct epoll_event ev;
+    int fd;
+
+    *done = 0;
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+        *done = 1;
+        return fd;
+    }
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    if (errno != EINPROGRESS || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* epoll_wait() on the attempts, from a coroutine without blocking */
+static int wait_attempts(int epfd, struct epoll_event *events, int timeout) {
+    int n;
+
+    if (rio_wait) {
+        if (rio_wait(epfd, 0, timeout) < 0)
+            return 0;
+        timeout = 0;
+    }
+    while ((n = epoll_wait(epfd, events, CONNECT_MAXRACE, timeout)) < 0
+           && errno == EINTR)
+        ;
+    return n < 0 ? 0 : n;
+}
+
+/* Wait up to timeout ms for w's eventfd, from a coroutine without blocking */
+static void wait_slot(slot_waiter *w, int timeout) {
+    struct pollfd pfd;
+
+    if (rio_wait) {
+        rio_wait(w->efd, 0, timeout);
+        return;
+    }
+    pfd.fd = w->efd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, timeout) < 0 && errno == EINTR)
+        ;
+}
+
+/* Look up the pool entry for host:port; caller holds pool.mutex */
+static origin *find_origin(char *host, char *port, int create) {
+    char key[MAXLINE];
+    unsigned long h = 5381;
+    origin *o;
+    char *p;
+
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    for (p = key; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    h %= UPSTREAM_BUCKETS;
+
+    for (o = pool.buckets[h]; o; o = o->next)
+        if (!strcmp(o->key, key))
+            return o;
+    if (!create)
+        return NULL;
+
+    o = Calloc(1, sizeof(origin));
+    o->key = Malloc(strlen(key) + 1);
+    strcpy(o->key, key);
+    o->next = pool.buckets[h];
+    pool.buckets[h] = o;
+    return o;
+}
+
+/* Close connections that sat idle too long; caller holds pool.mutex */
+static void drop_expired(origin *o, time_t now) {
+    idle_conn **pp, *ic;
+
+    pp = &o->idle;
+    while ((ic = *pp) != NULL) {
+        if (now - ic->since >= pool.idle_timeout) {
+            *pp = ic->next;
+            close(ic->fd);
+            Free(ic);
+            o->nidle--;
+        } else {
+            pp = &ic->next;
+        }
+    }
+}
+
+/* An idle HTTP connection must have nothing to read and no EOF pending */
+static int conn_alive(int fd) {
+    char c;
+    ssize_t n;
+
+    n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void *reaper(void *vargp) {
+    origin *o;
+    time_t now;
+    int i;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1) {
+        Sleep(1);
+        now = time(NULL);
+        P(&pool.mutex);
+        for (i = 0; i < UPSTREAM_BUCKETS; i++)
+            for (o = pool.buckets[i]; o; o = o->next)
+                drop_expired(o, now);
+        V(&pool.mutex);
+    }
+    return NULL;
+}
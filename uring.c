@@ -0,0 +1,801 @@
+/*
+ * uring.c - io_uring server mode (-m uring)
+ *
+ * The completion-based twin of the epoll mode.  Each ring drives every
+ * connection through the same state machine, but queues the I/O itself
+ * and reacts to its completion instead of waiting for readiness:
+ *
+ *   (multishot ACCEPT) -> RECV_REQ --hit--> SEND_HIT
+ *                                  --miss-> [RESOLVE] -> CONNECT -> SEND_REQ
+ *                                           -> RELAY_RECV <-> RELAY_SEND
+ *
+ * Every operation queued while handling one batch of completions goes to
+ * the kernel with the io_uring_enter() that waits for the next batch, so
+ * a busy ring moves many operations per system call.  The relay copies
+ * through buffers registered with IORING_REGISTER_BUFFERS and uses
+ * READ_FIXED/WRITE_FIXED on them.  Each connection has at most one
+ * operation in flight, so a completion can always free its connection.
+ *
+ * Waits on the origin are bounded like in epoll mode (-f, -i, -t): the
+ * operation is linked to an IORING_OP_LINK_TIMEOUT, and if that cancels
+ * it the client gets a 504, unless part of the response was relayed.
+ * The timeout's own completion carries IGNORE_TAG and is ignored.
+ *
+ * Connects race the origin's addresses like in epoll mode (-c): each
+ * attempt is a CONNECT linked to a timeout, and an IORING_OP_TIMEOUT
+ * starts the next one CONNECT_DELAY ms later.  The attempts belong to a
+ * urace_t that outlives the connection until all of them completed.
+ *
+ * liburing is not required: the ring is set up with the raw system
+ * calls.  kill -USR1 prints how many completions each enter returned.
+ */
+#include "proxy.h"
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+
+#define URING_ENTRIES 1024  /* Submission queue size per ring */
+#define URING_NBUFS   256   /* Registered relay buffers per ring */
+#define REQ_INITSIZE  1024  /* First request buffer, grown up to MAXLINE */
+
+#define ACCEPT_TAG  0       /* user_data of the multishot accept */
+#define BACKOFF_TAG 1       /* ... and of the pause before re-arming it */
+#define IGNORE_TAG  2       /* ... and of linked timeouts and cancels */
+#define RACE_SHIFT  56      /* Connect races: urace_t | slot << RACE_SHIFT */
+#define RACE_TIMER  0xff    /* ... slot of the stagger timer, else attempt+1 */
+#define BACKOFF_MS  100     /* Pause when out of descriptors */
+
+enum uconn_state { U_RECV_REQ, U_SEND_HIT, U_RESOLVE, U_CONNECT, U_SEND_REQ,
+                   U_RELAY_RECV, U_RELAY_SEND };
+
+typedef struct {
+    enum uconn_state state;
+    int cfd, sfd;
+
+    char *in;               /* Request head read from the client */
+    int in_len, in_cap;
+    http_parser hp;         /* ... parsed as it arrives */
+
+    char *uri;              /* Cache key */
+    dns_entry *dns;         /* Holds ai_list */
+    struct addrinfo *ai_list, *ai_next;
+
+    char *out;              /* Cached object or request to the origin */
+    int out_len, out_off;
+    cache_block *hit;       /* Pins out for a cache hit */
+
+    char *buf;              /* Relay buffer */
+    int buf_index;          /* Its registered index, -1 if Malloc'd */
+    int buf_len, buf_off;
+
+    char *obj;              /* Response copy for the cache */
+    int obj_size, obj_cap;
+    unsigned long started;  /* now_ms() when the fetch began */
+    unsigned long deadline; /* now_ms() the response must be done by, or 0 */
+    struct __kernel_timespec ts;    /* For the op's linked timeout */
+} uconn_t;
+
+/* The connect attempts racing c's origin addresses */
+typedef struct {
+    uconn_t *c;             /* NULL once c connected or gave up */
+    int fds[CONNECT_MAXRACE];       /* -1 once over */
+    int nfds, pending;      /* Attempts started, still in flight */
+    int nops;               /* Completions to come, the timer's included */
+    int timer, timed_out;
+    unsigned long connect_by;       /* now_ms() to give up by */
+    unsigned long next_try; /* now_ms() to race the next address */
+    struct __kernel_timespec delay, limit;
+} urace_t;
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;      /* Our tail, published on submit */
+    unsigned to_submit;
+
+    char *bufs;             /* URING_NBUFS * MAXBUF bytes */
+    int *free_bufs, nfree;
+    int registered;
+
+    int accept_flags;       /* IORING_ACCEPT_MULTISHOT, or 0 if unsupported */
+    struct __kernel_timespec backoff;
+} ring_t;
+
+static void *ring_thread(void *vargp);
+static void ring_init(ring_t *r);
+static void ring_submit(ring_t *r, unsigned wait_nr);
+static struct io_uring_sqe *get_sqe(ring_t *r);
+static void reserve_sqes(ring_t *r, unsigned n);
+static void prep_accept(ring_t *r);
+static void rearm_accept(ring_t *r, int res);
+static struct io_uring_sqe *prep_io(ring_t *r, uconn_t *c, int op, int fd,
+                                    char *buf, int len);
+static void prep_timed(ring_t *r, uconn_t *c, int op, int fd, char *buf,
+                       int len, int timeout);
+static void prep_link_timeout(ring_t *r, struct __kernel_timespec *ts,
+                              int timeout);
+static void handle_cqe(ring_t *r, struct io_uring_cqe *cqe);
+static void new_conn(ring_t *r, int connfd);
+static int on_recv_req(ring_t *r, uconn_t *c, int res);
+static int start_request(ring_t *r, uconn_t *c);
+static int resolve(ring_t *r, uconn_t *c);
+static int start_race(ring_t *r, uconn_t *c);
+static int race_next(ring_t *r, urace_t *rc);
+static void race_timer(ring_t *r, urace_t *rc, int ms);
+static void on_race(ring_t *r, urace_t *rc, int slot, int res);
+static void race_end(ring_t *r, urace_t *rc);
+static int on_send(ring_t *r, uconn_t *c, int res);
+static int start_relay(ring_t *r, uconn_t *c);
+static int on_relay_recv(ring_t *r, uconn_t *c, int res);
+static int on_relay_send(ring_t *r, uconn_t *c, int res);
+static void relay_recv(ring_t *r, uconn_t *c);
+static int gateway_timeout(ring_t *r, uconn_t *c);
+static void uconn_close(ring_t *r, uconn_t *c);
+static void sigusr1_uring(int sig);
+
+static int listen_fd;
+static long nr_enters, nr_cqes;     /* Totals over all rings */
+
+/* ---------------- Rings ---------------- */
+void uring_serve(int listenfd, int nrings) {
+    pthread_t tid;
+    int i;
+
+    listen_fd = listenfd;
+    Signal(SIGUSR1, sigusr1_uring);
+    for (i = 1; i < nrings; i++)
+        Pthread_create(&tid, NULL, ring_thread, NULL);
+    ring_thread(NULL);
+}
+
+static void *ring_thread(void *vargp) {
+    ring_t ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail, n;
+
+    (void)vargp;
+    ring_init(&ring);
+    prep_accept(&ring);
+
+    while (1) {
+        ring_submit(&ring, 1);
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (n = 0; head != tail; head++, n++) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            handle_cqe(&ring, cqe);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&nr_cqes, n, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void ring_init(ring_t *r) {
+    struct io_uring_params p;
+    struct iovec *iov;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        unix_error("io_uring_setup error");
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        app_error("io_uring: kernel too old (no IORING_FEAT_SINGLE_MMAP)");
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size)
+        sq_size = cq_size;
+    sq_ptr = Mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    cq_ptr = sq_ptr;
+
+    r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    r->sqes = Mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->to_submit = 0;
+    r->accept_flags = IORING_ACCEPT_MULTISHOT;
+
+    /* Relay buffers; without registration they still work as plain ones */
+    r->bufs = Mmap(NULL, (size_t)URING_NBUFS * MAXBUF, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->free_bufs = Malloc(URING_NBUFS * sizeof(int));
+    iov = Malloc(URING_NBUFS * sizeof(struct iovec));
+    for (i = 0; i < URING_NBUFS; i++) {
+        r->free_bufs[i] = i;
+        iov[i].iov_base = r->bufs + (size_t)i * MAXBUF;
+        iov[i].iov_len = MAXBUF;
+    }
+    r->nfree = URING_NBUFS;
+    r->registered = syscall(SYS_io_uring_register, r->fd,
+                            IORING_REGISTER_BUFFERS, iov, URING_NBUFS) == 0;
+    if (!r->registered)
+        fprintf(stderr, "io_uring: cannot register buffers (%s), "
+                "using RECV/SEND\n", strerror(errno));
+    Free(iov);
+}
+
+/* Publish queued SQEs and, if wait_nr > 0, wait for that many CQEs */
+static void ring_submit(ring_t *r, unsigned wait_nr) {
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    while ((ret = syscall(SYS_io_uring_enter, r->fd, r->to_submit, wait_nr,
+                          wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            unix_error("io_uring_enter error");
+        if (errno != EINTR)
+            break;          /* Completions pending: reap, then retry */
+    }
+    if (ret > 0)
+        r->to_submit -= ret;
+    __atomic_add_fetch(&nr_enters, 1, __ATOMIC_RELAXED);
+}
+
+static struct io_uring_sqe *get_sqe(ring_t *r) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+           >= r->sq_entries)
+        ring_submit(r, 0);  /* Queue full: hand it to the kernel first */
+
+    idx = r->sqe_tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+/* Make room for n SQEs that must go to the kernel together */
+static void reserve_sqes(ring_t *r, unsigned n) {
+    while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n
+           > r->sq_entries)
+        ring_submit(r, 0);
+}
+
+static void prep_accept(ring_t *r) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = r->accept_flags;
+    sqe->user_data = ACCEPT_TAG;
+}
+
+/* The accept ended with res: queue it again, at once or after a pause */
+static void rearm_accept(ring_t *r, int res) {
+    struct io_uring_sqe *sqe;
+
+    if (res == -EINVAL && r->accept_flags) {
+        /* Kernel before 5.19: accept one connection per SQE */
+        fprintf(stderr, "io_uring: no multishot accept, using single-shot\n");
+        r->accept_flags = 0;
+    } else if (res == -EINVAL) {
+        errno = -res;
+        unix_error("io_uring accept error");
+    } else if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS
+               || res == -ENOMEM) {
+        /* Out of descriptors or memory: give closes a chance first */
+        sqe = get_sqe(r);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        r->backoff.tv_sec = 0;
+        r->backoff.tv_nsec = BACKOFF_MS * 1000000L;
+        sqe->addr = (unsigned long)&r->backoff;
+        sqe->len = 1;
+        sqe->user_data = BACKOFF_TAG;
+        return;
+    }
+    prep_accept(r);
+}
+
+/* Queue a single RECV/SEND/POLL_ADD/READ_FIXED/WRITE_FIXED for c */
+static struct io_uring_sqe *prep_io(ring_t *r, uconn_t *c, int op, int fd,
+                                    char *buf, int len) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    if (op == IORING_OP_SEND)
+        sqe->msg_flags = MSG_NOSIGNAL;
+    if (op == IORING_OP_READ_FIXED || op == IORING_OP_WRITE_FIXED)
+        sqe->buf_index = c->buf_index;
+    if (op == IORING_OP_POLL_ADD)
+        sqe->poll32_events = POLLIN;
+    sqe->user_data = (unsigned long)c;
+    return sqe;
+}
+
+/*
+ * prep_timed - Queue an operation on the origin for c like prep_io(),
+ *     to be cancelled if it has not completed within timeout ms (no limit
+ *     if < 0) or by c->deadline.
+ */
+static void prep_timed(ring_t *r, uconn_t *c, int op, int fd, char *buf,
+                       int len, int timeout) {
+    struct io_uring_sqe *sqe;
+    unsigned long now;
+
+    if (c->deadline) {
+        now = now_ms();
+        if (now >= c->deadline)
+            timeout = 0;
+        else if (timeout < 0 || c->deadline - now < (unsigned long)timeout)
+            timeout = c->deadline - now;
+    }
+    if (timeout < 0) {
+        prep_io(r, c, op, fd, buf, len);
+        return;
+    }
+
+    reserve_sqes(r, 2);     /* The link must not be split across submits */
+    sqe = prep_io(r, c, op, fd, buf, len);
+    sqe->flags |= IOSQE_IO_LINK;
+    prep_link_timeout(r, &c->ts, timeout);
+}
+
+/* Queue the timeout of timeout ms for the SQE just linked to it */
+static void prep_link_timeout(ring_t *r, struct __kernel_timespec *ts,
+                              int timeout) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+
+    ts->tv_sec = timeout / 1000;
+    ts->tv_nsec = (timeout % 1000) * 1000000L;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->user_data = IGNORE_TAG;
+}
+
+/* ---------------- Completions ---------------- */
+static void handle_cqe(ring_t *r, struct io_uring_cqe *cqe) {
+    uconn_t *c;
+    int rc = 0;
+
+    if (cqe->user_data == ACCEPT_TAG) {
+        if (cqe->res >= 0)
+            new_conn(r, cqe->res);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            rearm_accept(r, cqe->res);  /* Multishot ended */
+        return;
+    }
+    if (cqe->user_data == BACKOFF_TAG) {
+        prep_accept(r);
+        return;
+    }
+    if (cqe->user_data == IGNORE_TAG)
+        return;             /* The op it was linked to reports the outcome */
+    if (cqe->user_data >> RACE_SHIFT) {
+        on_race(r, (urace_t *)(unsigned long)(cqe->user_data
+                                              & ((1UL << RACE_SHIFT) - 1)),
+                cqe->user_data >> RACE_SHIFT, cqe->res);
+        return;
+    }
+
+    c = (uconn_t *)(unsigned long)cqe->user_data;
+    switch (c->state) {
+    case U_RECV_REQ:
+        rc = on_recv_req(r, c, cqe->res);
+        break;
+    case U_RESOLVE:
+        close(c->sfd);
+        c->sfd = -1;
+        rc = cqe->res == -ECANCELED ? gateway_timeout(r, c) : resolve(r, c);
+        break;
+    case U_CONNECT:
+        break;              /* Its attempts complete through on_race() */
+    case U_SEND_HIT:
+    case U_SEND_REQ:
+        rc = on_send(r, c, cqe->res);
+        break;
+    case U_RELAY_RECV:
+        rc = on_relay_recv(r, c, cqe->res);
+        break;
+    case U_RELAY_SEND:
+        rc = on_relay_send(r, c, cqe->res);
+        break;
+    }
+    if (rc < 0)
+        uconn_close(r, c);
+}
+
+static void new_conn(ring_t *r, int connfd) {
+    uconn_t *c = Calloc(1, sizeof(uconn_t));
+
+    c->state = U_RECV_REQ;
+    c->cfd = connfd;
+    c->sfd = -1;
+    c->buf_index = -1;
+    c->in_cap = REQ_INITSIZE;
+    c->in = Malloc(c->in_cap);
+    http_parser_init(&c->hp);
+    prep_io(r, c, IORING_OP_RECV, c->cfd, c->in, c->in_cap - 1);
+}
+
+/* RECV_REQ: collect the request head up to the blank line */
+static int on_recv_req(ring_t *r, uconn_t *c, int res) {
+    if (res <= 0)
+        return -1;
+    c->in_len += res;
+    switch (http_parse(&c->hp, c->in, c->in_len)) {
+    case 1:
+        return start_request(r, c);
+    case -1:
+        return -1;
+    }
+
+    if (c->in_len == c->in_cap - 1) {
+        if (c->in_cap >= MAXLINE)
+            return -1;      /* Request head too large */
+        c->in_cap = 2 * c->in_cap > MAXLINE ? MAXLINE : 2 * c->in_cap;
+        c->in = Realloc(c->in, c->in_cap);
+    }
+    prep_io(r, c, IORING_OP_RECV, c->cfd, c->in + c->in_len,
+            c->in_cap - 1 - c->in_len);
+    return 0;
+}
+
+static int start_request(ring_t *r, uconn_t *c) {
+    char uri[MAXLINE], hostname[MAXLINE], path[MAXLINE], portstr[16];
+    int port;
+
+    if (!http_span_is(c->in, c->hp.method, "GET")) {
+        printf("Proxy only supports GET\n");
+        return -1;
+    }
+
+    c->uri = Malloc(c->hp.uri.len + 1);
+    memcpy(c->uri, c->in + c->hp.uri.off, c->hp.uri.len);
+    c->uri[c->hp.uri.len] = '\0';
+    if ((c->hit = cache_lookup(c->uri, &c->out, &c->out_len)) != NULL) {
+        if (c->out_len == 0)
+            return -1;
+        c->state = U_SEND_HIT;
+        prep_io(r, c, IORING_OP_SEND, c->cfd, c->out, c->out_len);
+        return 0;
+    }
+
+    c->started = now_ms();
+    c->deadline = request_timeout < 0 ? 0 : c->started + request_timeout;
+    strcpy(uri, c->uri);            /* parse_uri() modifies its argument */
+    parse_uri(uri, hostname, path, &port);
+    c->out = Malloc(MAXLINE);
+    if (build_requesthdrs(c->out, c->in, &c->hp, hostname, path, 0) < 0)
+        return -1;
+    c->out_len = strlen(c->out);
+    Free(c->in);
+    c->in = NULL;
+
+    sprintf(portstr, "%d", port);
+    c->dns = dns_lookup(hostname, portstr);
+    return resolve(r, c);
+}
+
+/*
+ * RESOLVE: connect once the name is resolved, polling the descriptor
+ *     from dns_fd() while the lookup is in flight.
+ */
+static int resolve(ring_t *r, uconn_t *c) {
+    switch (dns_result(c->dns, &c->ai_list)) {
+    case 0:
+        if ((c->sfd = dns_fd(c->dns)) < 0)
+            return -1;
+        c->state = U_RESOLVE;
+        prep_timed(r, c, IORING_OP_POLL_ADD, c->sfd, NULL, 0, -1);
+        return 0;
+    case -1:
+        return -1;
+    }
+    return start_race(r, c);
+}
+
+/* SEND_HIT / SEND_REQ: keep sending c->out until all of it went out */
+static int on_send(ring_t *r, uconn_t *c, int res) {
+    if (res == -ECANCELED && c->state == U_SEND_REQ)
+        return gateway_timeout(r, c);
+    if (res <= 0)
+        return -1;
+    c->out_off += res;
+    if (c->out_off < c->out_len) {
+        if (c->state == U_SEND_HIT)
+            prep_io(r, c, IORING_OP_SEND, c->cfd, c->out + c->out_off,
+                    c->out_len - c->out_off);
+        else
+            prep_timed(r, c, IORING_OP_SEND, c->sfd, c->out + c->out_off,
+                       c->out_len - c->out_off, -1);
+        return 0;
+    }
+    if (c->state == U_SEND_HIT)
+        return -1;          /* Whole object written */
+    return start_relay(r, c);
+}
+
+static int start_relay(ring_t *r, uconn_t *c) {
+    Free(c->out);
+    c->out = NULL;
+    if (r->nfree > 0) {
+        c->buf_index = r->free_bufs[--r->nfree];
+        c->buf = r->bufs + (size_t)c->buf_index * MAXBUF;
+    } else {
+        c->buf = Malloc(MAXBUF);
+    }
+    relay_recv(r, c);
+    return 0;
+}
+
+static void relay_recv(ring_t *r, uconn_t *c) {
+    int timeout = c->obj_size ? inter_byte_timeout : first_byte_timeout;
+
+    c->state = U_RELAY_RECV;
+    if (c->buf_index >= 0 && r->registered)
+        prep_timed(r, c, IORING_OP_READ_FIXED, c->sfd, c->buf, MAXBUF,
+                   timeout);
+    else
+        prep_timed(r, c, IORING_OP_RECV, c->sfd, c->buf, MAXBUF, timeout);
+}
+
+/* RELAY_RECV: a chunk arrived from the origin, pass it on */
+static int on_relay_recv(ring_t *r, uconn_t *c, int res) {
+    unsigned long cost;
+    long expires;
+
+    if (res == -ECANCELED)
+        return gateway_timeout(r, c);
+    if (res < 0)
+        return -1;
+    if (res == 0) {
+        cost = now_ms() - c->started;
+        if (c->obj_size < cache_max_object()
+            && (expires = cache_expiry(c->obj, c->obj_size, cost)) >= 0)
+            cache_insert(c->uri, c->obj, c->obj_size, cost, expires);
+        return -1;          /* Done */
+    }
+
+    cache_append(&c->obj, &c->obj_cap, &c->obj_size, c->buf, res);
+
+    c->buf_len = res;
+    c->buf_off = 0;
+    return on_relay_send(r, c, 0);
+}
+
+/* RELAY_SEND: res more bytes reached the client */
+static int on_relay_send(ring_t *r, uconn_t *c, int res) {
+    if (res < 0)
+        return -1;
+    c->buf_off += res;
+    if (c->buf_off == c->buf_len) {
+        relay_recv(r, c);
+        return 0;
+    }
+
+    c->state = U_RELAY_SEND;
+    if (c->buf_index >= 0 && r->registered)
+        prep_io(r, c, IORING_OP_WRITE_FIXED, c->cfd, c->buf + c->buf_off,
+                c->buf_len - c->buf_off);
+    else
+        prep_io(r, c, IORING_OP_SEND, c->cfd, c->buf + c->buf_off,
+                c->buf_len - c->buf_off);
+    return 0;
+}
+
+/*
+ * The origin did not answer in time: send the client a 504 and close,
+ * or just close if it already has part of the response
+ */
+static int gateway_timeout(ring_t *r, uconn_t *c) {
+    if (c->obj_size > 0)
+        return -1;
+    free(c->out);
+    c->out_len = strlen(gateway_timeout_msg);
+    c->out = Malloc(c->out_len);
+    memcpy(c->out, gateway_timeout_msg, c->out_len);
+    c->out_off = 0;
+    c->state = U_SEND_HIT;
+    prep_io(r, c, IORING_OP_SEND, c->cfd, c->out, c->out_len);
+    return 0;
+}
+
+/* Only called with no operation in flight for c */
+static void uconn_close(ring_t *r, uconn_t *c) {
+    close(c->cfd);
+    if (c->sfd >= 0)
+        close(c->sfd);
+    if (c->dns)
+        dns_release(c->dns);
+    if (c->buf_index >= 0)
+        r->free_bufs[r->nfree++] = c->buf_index;
+    else
+        free(c->buf);
+    free(c->in);
+    free(c->uri);
+    if (c->hit)
+        cache_release(c->hit);
+    else
+        free(c->out);
+    free(c->obj);
+    Free(c);
+}
+
+/* Report batching statistics using only async-signal-safe calls */
+static void sigusr1_uring(int sig) {
+    int olderrno = errno;
+
+    (void)sig;
+    sio_puts("uring: enters ");
+    sio_putl(nr_enters);
+    sio_puts(" completions ");
+    sio_putl(nr_cqes);
+    sio_puts("\n");
+    sigusr1_handler(sig);
+    errno = olderrno;
+}
+
+/* ---------------- Connect races ---------------- */
+
+/* CONNECT: race connects to c's addresses for at most -c seconds */
+static int start_race(ring_t *r, uconn_t *c) {
+    urace_t *rc = Calloc(1, sizeof(urace_t));
+    int ret;
+
+    rc->c = c;
+    rc->connect_by = now_ms() + upstream_connect_timeout();
+    if (c->deadline && c->deadline < rc->connect_by)
+        rc->connect_by = c->deadline;
+    c->ai_next = c->ai_list;
+    c->state = U_CONNECT;
+    ret = race_next(r, rc);
+    if (!rc->c && !rc->nops)
+        Free(rc);
+    return ret;
+}
+
+/*
+ * race_next - Queue a connect to the next address, alongside those still
+ *     in flight, and the timer to race the one after.  Once none is left,
+ *     ends the race and returns c's outcome: -1 if every attempt failed,
+ *     or 0 with a 504 queued if they ran out of time.
+ */
+static int race_next(ring_t *r, urace_t *rc) {
+    uconn_t *c = rc->c;
+    struct addrinfo *p;
+    struct io_uring_sqe *sqe;
+    unsigned long now = now_ms();
+    int fd;
+
+    for (p = c->ai_next; p && now < rc->connect_by; p = p->ai_next) {
+        if (rc->nfds == CONNECT_MAXRACE)
+            break;
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        c->ai_next = p->ai_next;
+        rc->fds[rc->nfds++] = fd;
+        rc->pending++;
+        rc->nops++;
+
+        reserve_sqes(r, 2);
+        sqe = get_sqe(r);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)p->ai_addr;
+        sqe->off = p->ai_addrlen;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (unsigned long)rc
+                         | (unsigned long)rc->nfds << RACE_SHIFT;
+        prep_link_timeout(r, &rc->limit, rc->connect_by - now);
+
+        if (c->ai_next && rc->nfds < CONNECT_MAXRACE) {
+            rc->next_try = now + CONNECT_DELAY;
+            if (!rc->timer)
+                race_timer(r, rc, CONNECT_DELAY);
+        }
+        return 0;
+    }
+    if (rc->pending)
+        return 0;
+
+    rc->c = NULL;           /* Lost on every address */
+    if (rc->timed_out || now >= rc->connect_by)
+        return gateway_timeout(r, c);
+    return -1;
+}
+
+/* Wake the race in ms to start its next attempt */
+static void race_timer(ring_t *r, urace_t *rc, int ms) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+
+    rc->delay.tv_sec = ms / 1000;
+    rc->delay.tv_nsec = (ms % 1000) * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&rc->delay;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long)rc
+                     | (unsigned long)RACE_TIMER << RACE_SHIFT;
+    rc->timer = 1;
+    rc->nops++;
+}
+
+/* An attempt (slot > 0) or the stagger timer of rc completed with res */
+static void on_race(ring_t *r, urace_t *rc, int slot, int res) {
+    uconn_t *c = rc->c;
+    unsigned long now;
+    int fd, ret = 0;
+
+    rc->nops--;
+    if (slot == RACE_TIMER) {
+        rc->timer = 0;
+        if (c && (now = now_ms()) < rc->next_try)
+            race_timer(r, rc, rc->next_try - now);  /* One started since */
+        else if (c)
+            ret = race_next(r, rc);
+    } else {
+        fd = rc->fds[slot - 1];
+        rc->fds[slot - 1] = -1;
+        rc->pending--;
+        if (c && res >= 0) {
+            /* Won: drop the other attempts and send the request */
+            race_end(r, rc);
+            c->sfd = fd;
+            dns_release(c->dns);
+            c->dns = NULL;
+            c->ai_list = c->ai_next = NULL;
+            c->state = U_SEND_REQ;
+            c->out_off = 0;
+            prep_timed(r, c, IORING_OP_SEND, c->sfd, c->out, c->out_len, -1);
+        } else {
+            close(fd);
+            if (res == -ECANCELED)
+                rc->timed_out = 1;
+            if (c)
+                ret = race_next(r, rc);     /* Race the next at once */
+        }
+    }
+    if (ret < 0)
+        uconn_close(r, c);
+    if (!rc->c && !rc->nops)
+        Free(rc);
+}
+
+/*
+ * Detach rc from its connection and cancel the attempts still in flight.
+ * The stagger timer is left to expire; rc is freed after it.
+ */
+static void race_end(ring_t *r, urace_t *rc) {
+    struct io_uring_sqe *sqe;
+    int i;
+
+    rc->c = NULL;
+    for (i = 0; i < rc->nfds; i++)
+        if (rc->fds[i] >= 0) {
+            sqe = get_sqe(r);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long)rc
+                        | (unsigned long)(i + 1) << RACE_SHIFT;
+            sqe->user_data = IGNORE_TAG;
+        }
+}